@@ -0,0 +1,73 @@
+#ifndef PXOS_BENCH
+#define PXOS_BENCH
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <PxResult.hpp>
+#include <trace.hpp>
+
+// Settings for a run, taken from PXOS_BENCH_* environment variables so
+// they can be given straight to `make bench`.
+struct benchconf_t {
+    // scratch directory the synthetic trees and images are made in
+    std::string dir;
+    size_t threads;
+    // percent of the default data sizes
+    size_t scale;
+    // milliseconds the HTTP server waits before every response
+    long latency;
+    // bytes per second the HTTP server sends on each connection, 0 for no limit
+    double bandwidth;
+    // only benchmarks whose names contain this are run
+    std::string filter;
+    // drop the page cache before each benchmark (needs root)
+    bool dropCaches;
+};
+
+struct benchresult_t {
+    std::string name;
+    double seconds = 0;
+    // what the routine got through, for its throughput
+    int64_t bytes = 0;
+    int64_t items = 0;
+    // this process only, so not what tar or gpg use when they are run
+    Trace::counters_t used = {0, 0, 0};
+    // set instead of everything else when the benchmark couldn't run
+    std::string skipped;
+};
+
+class Bench {
+private:
+    std::vector<benchresult_t> results;
+public:
+    benchconf_t conf;
+
+    Bench(benchconf_t conf) : conf(conf) {}
+
+    // Scales a default size by conf.scale.
+    int64_t scaled(int64_t size) {
+        return std::max<int64_t>(1, size * (int64_t)conf.scale / 100);
+    }
+    bool wanted(const std::string &name);
+
+    // Times `fn`, which says how much it processed through the result it is handed.
+    PxResult::Result<void> run(std::string name, std::function<PxResult::Result<void>(benchresult_t&)> fn);
+    void skip(std::string name, std::string why);
+    std::string json(std::string label);
+};
+
+// Each group makes its own data under conf.dir and cleans it up afterwards.
+PxResult::Result<void> benchTrees(Bench &bench);
+PxResult::Result<void> benchExtract(Bench &bench);
+PxResult::Result<void> benchVerify(Bench &bench);
+PxResult::Result<void> benchNetwork(Bench &bench);
+PxResult::Result<void> benchBoot(Bench &bench);
+
+// Helpers shared by the groups.
+PxResult::Result<void> writeRandomFile(std::string path, int64_t size, uint64_t seed);
+int64_t treeSize(std::string path, int64_t *files = NULL);
+
+#endif
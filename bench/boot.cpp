@@ -0,0 +1,102 @@
+#include <bench.hpp>
+#include <bootfiles.hpp>
+#include <recurse.hpp>
+#include <PxFunction.hpp>
+#include <PxState.hpp>
+#include <cstdio>
+#include <filesystem>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A root just big enough for generateBootFiles to chroot into: bash and its
+// libraries, with stand-ins for mkinitcpio and lsinitcpio that only use
+// builtins. The image lists /etc/fstab among its files, as a real one does.
+static PxResult::Result<void> makeBootRoot(std::string root) {
+    FILE *pipe = popen("ldd /bin/bash", "r");
+    if (pipe == NULL) return PxResult::FResult("makeBootRoot / popen", errno);
+    std::string out;
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), pipe)) > 0) out.append(buf, len);
+    if (pclose(pipe) != 0) return PxResult::FResult("makeBootRoot / ldd", EINVAL);
+
+    std::vector<std::string> files = { "/bin/bash" };
+    for (auto &line : PxFunction::split(out, "\n")) {
+        auto start = line.find('/');
+        if (start == std::string::npos) continue;
+        files.push_back(line.substr(start, line.find(' ', start) - start));
+    }
+    std::error_code ec;
+    for (auto &i : files) {
+        std::filesystem::create_directories(std::filesystem::path(root+i).parent_path(), ec);
+        if (!ec) std::filesystem::copy_file(i, root+i, ec);
+        if (ec) return PxResult::FResult("makeBootRoot / copy "+i, ec.value());
+    }
+    for (auto &i : {"/usr/bin", "/etc/mkinitcpio.d", "/boot", "/var"}) {
+        std::filesystem::create_directories(root+i, ec);
+        if (ec) return PxResult::FResult("makeBootRoot / mkdir", ec.value());
+    }
+
+    std::vector<std::pair<std::string, std::string>> contents = {
+        { "/usr/bin/mkinitcpio", "#!/bin/bash\n"
+            "echo \"initramfs of $(< /boot/vmlinuz-linux) with $(< /etc/mkinitcpio.conf)\" > /boot/initramfs-linux.img\n"
+            "echo \"$2\" >> /var/mkinitcpio.log\n" },
+        { "/usr/bin/lsinitcpio", "#!/bin/bash\nprintf '%s\\n' ./usr/bin/mkinitcpio ./bin/bash ./etc/fstab\n" },
+        { "/etc/mkinitcpio.conf", "HOOKS=(base)\n" },
+        { "/etc/mkinitcpio.d/linux.preset", "PRESETS=('default')\ndefault_image=\"/boot/initramfs-linux.img\"\n" },
+        { "/etc/fstab", "/dev/sda1 / ext4 defaults 0 1\n" },
+        { "/boot/vmlinuz-linux", "linux 1.0\n" },
+    };
+    for (auto &[path, text] : contents) PXASSERTM(PxState::fput(root+path, text), "makeBootRoot");
+    for (auto &i : {"/usr/bin/mkinitcpio", "/usr/bin/lsinitcpio"})
+        PXASSERTM(PxFunction::wrap("chmod", chmod((root+i).c_str(), 0755)), "makeBootRoot");
+    return PxResult::Null;
+}
+
+// How many times mkinitcpio has run in `root`.
+static size_t builds(std::string root) {
+    auto log = PxState::fget(root+"/var/mkinitcpio.log");
+    if (log.eno) return 0;
+    return PxFunction::split(PxFunction::trim(log.assert()), "\n").size();
+}
+
+PxResult::Result<void> benchBoot(Bench &bench) {
+    auto &conf = bench.conf;
+    const char *names[] = { "initramfs (generated)", "initramfs (cached)" };
+    // generateBootFiles chroots into the root
+    if (geteuid() != 0 || access("/bin/bash", X_OK) != 0) {
+        for (auto &i : names) bench.skip(i, geteuid() != 0 ? "needs root" : "no /bin/bash");
+        return PxResult::Null;
+    }
+    if (!bench.wanted("initramfs")) return PxResult::Null;
+
+    auto root = conf.dir+"/bootroot";
+    auto cache = conf.dir+"/bootcache";
+    PXASSERT(makeBootRoot(root));
+
+    PXASSERT(bench.run(names[0], [&](benchresult_t &r) -> PxResult::Result<void> {
+        PXASSERT(generateBootFiles(root, "", cache, false));
+        r.items = 1;
+        return PxResult::Null;
+    }));
+
+    // what every update does to the new root between two of them
+    PXASSERTM(PxState::fput(root+"/etc/fstab", "UUID=0b5c2a5e-7d3e-4c7a-9f6e-2d1f8e9a4b11 / ext4 defaults 0 1\n"), "benchBoot");
+    PXASSERTM(PxFunction::wrap("remove", remove((root+"/boot/initramfs-linux.img").c_str())), "benchBoot");
+    PXASSERT(bench.run(names[1], [&](benchresult_t &r) -> PxResult::Result<void> {
+        PXASSERT(generateBootFiles(root, "", cache, false));
+        r.items = 1;
+        return PxResult::Null;
+    }));
+    if (builds(root) != 1 || access((root+"/boot/initramfs-linux.img").c_str(), F_OK) != 0)
+        return PxResult::FResult("benchBoot (an update with the same kernel missed the initramfs cache)", EBADMSG);
+
+    // and a new kernel still gets a new image
+    PXASSERTM(PxState::fput(root+"/boot/vmlinuz-linux", "linux 1.1\n"), "benchBoot");
+    PXASSERT(generateBootFiles(root, "", cache, false));
+    if (builds(root) != 2) return PxResult::FResult("benchBoot (a new kernel was served from the initramfs cache)", EBADMSG);
+
+    PXASSERT(removerecursedir(root, conf.threads));
+    PXASSERT(removerecursedir(cache, conf.threads));
+    return PxResult::Null;
+}
@@ -0,0 +1,56 @@
+#include <bench.hpp>
+#include <recurse.hpp>
+#include <untar.hpp>
+#include <PxFunction.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PxResult::Result<void> benchExtract(Bench &bench) {
+    auto &conf = bench.conf;
+    auto src = conf.dir+"/small";
+    auto image = conf.dir+"/small.tar";
+    int64_t files;
+    int64_t bytes = treeSize(src, &files);
+
+    // the archive itself is made with the system tar, outside the timings
+    if (system(("tar cf "+image+" -C "+src+" .").c_str()) != 0) return PxResult::FResult("benchExtract / tar cf", EINVAL);
+    PXASSERT(removerecursedir(src, conf.threads));
+
+    auto extracted = [&](std::string dest, std::function<PxResult::Result<void>()> fn) {
+        return [&, dest, fn](benchresult_t &r) -> PxResult::Result<void> {
+            PXASSERTM(PxFunction::wrap("mkdir", mkdir(dest.c_str(), 0755)), "benchExtract");
+            PXASSERT(fn());
+            r.bytes = bytes;
+            r.items = files;
+            return PxResult::Null;
+        };
+    };
+
+    auto tarDest = conf.dir+"/small.tar-xpf";
+    PXASSERT(bench.run("extract small (tar xpf)", extracted(tarDest, [&]() -> PxResult::Result<void> {
+        // the same command extractImage falls back to
+        if (system(("tar xpf "+image+" --xattrs-include=\\* -C "+tarDest).c_str()) != 0) return PxResult::FResult("benchExtract / tar xpf", EINVAL);
+        return PxResult::Null;
+    })));
+    if (access(tarDest.c_str(), F_OK) == 0) PXASSERT(removerecursedir(tarDest, conf.threads));
+
+    auto nativeDest = conf.dir+"/small.native";
+    PXASSERT(bench.run("extract small (TarExtractor)", extracted(nativeDest, [&]() -> PxResult::Result<void> {
+        return extractImage(image, nativeDest);
+    })));
+    // what an update mostly does: extract over a tree that already matches
+    if (bench.wanted("extract small unchanged (TarExtractor sync)") && access(nativeDest.c_str(), F_OK) != 0) {
+        PXASSERTM(PxFunction::wrap("mkdir", mkdir(nativeDest.c_str(), 0755)), "benchExtract");
+        PXASSERT(extractImage(image, nativeDest));
+    }
+    PXASSERT(bench.run("extract small unchanged (TarExtractor sync)", [&](benchresult_t &r) -> PxResult::Result<void> {
+        PXASSERT(extractImage(image, nativeDest, true));
+        r.bytes = bytes;
+        r.items = files;
+        return PxResult::Null;
+    }));
+    if (access(nativeDest.c_str(), F_OK) == 0) PXASSERT(removerecursedir(nativeDest, conf.threads));
+
+    remove(image.c_str());
+    return PxResult::Null;
+}
@@ -0,0 +1,185 @@
+#include <bench.hpp>
+#include <recurse.hpp>
+#include <PxFunction.hpp>
+#include <PxLog.hpp>
+#include <PxState.hpp>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+bool Bench::wanted(const std::string &name) {
+    return conf.filter.empty() || name.find(conf.filter) != std::string::npos;
+}
+
+PxResult::Result<void> Bench::run(std::string name, std::function<PxResult::Result<void>(benchresult_t&)> fn) {
+    if (!wanted(name)) return PxResult::Null;
+
+    if (conf.dropCaches) {
+        sync();
+        // best effort; without root the run is simply warm
+        int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (write(fd, "3", 1) != 1) PxLog::log.warn("Failed to drop caches: "+(std::string)strerror(errno));
+            close(fd);
+        }
+    }
+
+    benchresult_t result;
+    result.name = name;
+    auto before = Trace::sample();
+    auto start = std::chrono::steady_clock::now();
+    auto res = fn(result);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto after = Trace::sample();
+    PXASSERTM(res, "Bench::run "+name);
+
+    result.used = { after.cpu - before.cpu, after.syscalls - before.syscalls, after.ioBytes - before.ioBytes };
+    results.push_back(result);
+
+    std::string line = name+": "+std::to_string((int64_t)std::round(result.seconds * 1000))+" ms";
+    if (result.bytes > 0) line += ", "+std::to_string((int64_t)std::round(result.bytes / result.seconds / 1024 / 1024))+" MiB/s";
+    if (result.items > 0) line += ", "+std::to_string((int64_t)std::round(result.items / result.seconds))+" items/s";
+    line += ", "+std::to_string(result.used.syscalls)+" syscalls";
+    PxLog::log.info(line);
+    return PxResult::Null;
+}
+
+void Bench::skip(std::string name, std::string why) {
+    if (!wanted(name)) return;
+    benchresult_t result;
+    result.name = name;
+    result.skipped = why;
+    results.push_back(result);
+    PxLog::log.info(name+": skipped ("+why+")");
+}
+
+static std::string quote(const std::string &str) {
+    std::string out = "\"";
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (c >= 0x20) out += c;
+    }
+    return out+"\"";
+}
+
+static std::string number(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", std::isfinite(value) ? value : 0);
+    return buf;
+}
+
+std::string Bench::json(std::string label) {
+    std::string out = "{\"label\":"+quote(label)+",\"time\":"+std::to_string(time(NULL))+
+        ",\"threads\":"+std::to_string(conf.threads)+",\"scale\":"+std::to_string(conf.scale)+
+        ",\"latency_ms\":"+std::to_string(conf.latency)+",\"bandwidth\":"+number(conf.bandwidth)+
+        ",\"cold_cache\":"+(conf.dropCaches ? "true" : "false")+",\"results\":[";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &r = results[i];
+        if (i > 0) out += ",";
+        out += "\n{\"name\":"+quote(r.name);
+        if (!r.skipped.empty()) {
+            out += ",\"skipped\":"+quote(r.skipped)+"}";
+            continue;
+        }
+        out += ",\"seconds\":"+number(r.seconds)+",\"bytes\":"+std::to_string(r.bytes)+",\"items\":"+std::to_string(r.items)+
+            ",\"bytes_per_second\":"+number(r.bytes / r.seconds)+",\"items_per_second\":"+number(r.items / r.seconds)+
+            ",\"cpu_seconds\":"+number(r.used.cpu / 1e6)+",\"syscalls\":"+std::to_string(r.used.syscalls)+
+            ",\"io_bytes\":"+std::to_string(r.used.ioBytes)+"}";
+    }
+    return out+"\n]}\n";
+}
+
+PxResult::Result<void> writeRandomFile(std::string path, int64_t size, uint64_t seed) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return PxResult::FResult("writeRandomFile / open "+path, errno);
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> buf(128 * 1024);
+    for (int64_t done = 0; done < size;) {
+        for (auto &i : buf) i = rng();
+        size_t len = std::min<int64_t>(buf.size() * sizeof(uint64_t), size - done);
+        if (write(fd, buf.data(), len) != (ssize_t)len) {
+            int err = errno;
+            close(fd);
+            return PxResult::FResult("writeRandomFile / write "+path, err);
+        }
+        done += len;
+    }
+    close(fd);
+    return PxResult::Null;
+}
+
+int64_t treeSize(std::string path, int64_t *files) {
+    std::atomic<int64_t> bytes = 0, count = 0;
+    fswalk(path, [&](const fsentry_t &entry) -> PxResult::Result<void> {
+        if (S_ISREG(entry.st.st_mode)) {
+            bytes += entry.st.st_size;
+            count++;
+        }
+        return PxResult::Null;
+    }, [](const fsentry_t &) -> PxResult::Result<void> { return PxResult::Null; });
+    if (files != NULL) *files = count;
+    return bytes;
+}
+
+static std::string env(const char *name, std::string fallback) {
+    auto value = getenv(name);
+    return value == NULL || *value == 0 ? fallback : value;
+}
+
+int main(int argc, const char* argv[]) {
+    benchconf_t conf;
+    try {
+        conf = {
+            .dir = env("PXOS_BENCH_DIR", "/var/tmp"),
+            .threads = std::stoul(env("PXOS_BENCH_THREADS", std::to_string(std::max(1u, std::thread::hardware_concurrency())))),
+            .scale = std::stoul(env("PXOS_BENCH_SCALE", "100")),
+            .latency = std::stol(env("PXOS_BENCH_LATENCY", "20")),
+            .bandwidth = std::stod(env("PXOS_BENCH_BANDWIDTH", "0")) * 1024 * 1024,
+            .filter = env("PXOS_BENCH_FILTER", ""),
+            .dropCaches = env("PXOS_BENCH_COLD", "0") != "0"
+        };
+    } catch (std::exception &e) {
+        PxLog::log.error("Bad PXOS_BENCH_* setting.");
+        return 1;
+    }
+
+    // everything goes in a directory of its own, removed at the end
+    conf.dir += "/pxos-bench.XXXXXX";
+    if (mkdtemp(conf.dir.data()) == NULL) {
+        PxLog::log.error("Failed to make a scratch directory: "+(std::string)strerror(errno));
+        return 1;
+    }
+
+    Bench bench(conf);
+    PxResult::Result<void> res = PxResult::Null;
+    for (auto group : {benchTrees, benchExtract, benchVerify, benchNetwork, benchBoot}) {
+        res = group(bench);
+        if (res.eno) break;
+    }
+    removerecursedir(conf.dir, conf.threads);
+    if (res.eno) {
+        PxLog::log.error("Benchmark failed: "+res.funcName+": "+strerror(res.eno));
+        return 1;
+    }
+
+    auto out = bench.json(env("PXOS_BENCH_LABEL", ""));
+    if (argc > 1) {
+        auto putres = PxState::fput(argv[1], out);
+        if (putres.eno) {
+            PxLog::log.error("Failed to write "+(std::string)argv[1]+": "+strerror(putres.eno));
+            return 1;
+        }
+        PxLog::log.info("Wrote results to "+(std::string)argv[1]);
+    } else {
+        fputs(out.c_str(), stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,340 @@
+#include <bench.hpp>
+#include <delta.hpp>
+#include <chunkcache.hpp>
+#include <PxDownload.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxLog.hpp>
+#include <PxState.hpp>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+// A loopback HTTP/1.1 server for the download benchmarks. It serves the
+// files in a directory with keep-alive and single byte ranges, waits
+// `latency` before every response and paces each connection to `bandwidth`.
+class BenchServer {
+private:
+    std::string dir;
+    long latency;
+    double bandwidth;
+    int listenfd = -1;
+    int port = 0;
+    std::thread acceptor;
+    std::mutex lock;
+    std::vector<std::thread> workers;
+    std::vector<int> conns;
+    std::atomic<bool> stopping = false;
+
+    void serve(int fd);
+    bool respond(int fd, const std::string &request);
+    bool sendAll(int fd, const char *data, size_t len);
+public:
+    std::atomic<int64_t> requests = 0;
+
+    BenchServer(std::string dir, long latency, double bandwidth) : dir(dir), latency(latency), bandwidth(bandwidth) {}
+    ~BenchServer();
+
+    PxResult::Result<void> start();
+    std::string url(std::string file) {
+        return "http://127.0.0.1:"+std::to_string(port)+"/"+file;
+    }
+};
+
+PxResult::Result<void> BenchServer::start() {
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) return PxResult::FResult("BenchServer::start / socket", errno);
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenfd, 64) != 0 ||
+        getsockname(listenfd, (struct sockaddr*)&addr, &len) != 0)
+        return PxResult::FResult("BenchServer::start / bind", errno);
+    port = ntohs(addr.sin_port);
+
+    acceptor = std::thread([this]() {
+        while (!stopping) {
+            int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::lock_guard<std::mutex> guard(lock);
+            conns.push_back(fd);
+            workers.emplace_back([this, fd]() { serve(fd); });
+        }
+    });
+    return PxResult::Null;
+}
+
+BenchServer::~BenchServer() {
+    stopping = true;
+    if (listenfd >= 0) {
+        // wakes the acceptor up out of accept()
+        shutdown(listenfd, SHUT_RDWR);
+        if (acceptor.joinable()) acceptor.join();
+        close(listenfd);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto fd : conns) shutdown(fd, SHUT_RDWR);
+    for (auto &i : workers) i.join();
+    for (auto fd : conns) close(fd);
+}
+
+bool BenchServer::sendAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t res = send(fd, data, len, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        data += res;
+        len -= res;
+    }
+    return true;
+}
+
+void BenchServer::serve(int fd) {
+    std::string buf;
+    char chunk[16384];
+    while (!stopping) {
+        auto end = buf.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            ssize_t len = recv(fd, chunk, sizeof(chunk), 0);
+            if (len < 0 && errno == EINTR) continue;
+            if (len <= 0) return;
+            buf.append(chunk, len);
+            continue;
+        }
+        auto request = buf.substr(0, end);
+        buf.erase(0, end + 4);
+        if (!respond(fd, request)) return;
+    }
+}
+
+bool BenchServer::respond(int fd, const std::string &request) {
+    requests++;
+    auto lines = PxFunction::split(request, "\r\n");
+    auto parts = PxFunction::split(lines[0], " ");
+    if (parts.size() < 2) return false;
+    bool head = parts[0] == "HEAD";
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+
+    // the path is only ever a file name the benchmarks made
+    auto path = dir+"/"+parts[1].substr(parts[1].rfind('/') + 1);
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (file < 0 || fstat(file, &st) != 0) {
+        if (file >= 0) close(file);
+        std::string out = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        return sendAll(fd, out.data(), out.size());
+    }
+    DEFER(close_file, close(file));
+
+    off_t from = 0, to = st.st_size - 1;
+    bool ranged = false;
+    for (auto &i : lines) {
+        if (strncasecmp(i.c_str(), "Range: bytes=", 13) != 0) continue;
+        auto spec = i.substr(13);
+        auto dash = spec.find('-');
+        from = std::stoll(spec.substr(0, dash));
+        if (dash + 1 < spec.size()) to = std::min<off_t>(to, std::stoll(spec.substr(dash + 1)));
+        ranged = true;
+    }
+
+    std::string out = ranged ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+    out += "Content-Length: "+std::to_string(to - from + 1)+"\r\nAccept-Ranges: bytes\r\n";
+    out += "ETag: \""+std::to_string(st.st_size)+"-"+std::to_string(st.st_mtime)+"\"\r\n";
+    if (ranged) out += "Content-Range: bytes "+std::to_string(from)+"-"+std::to_string(to)+"/"+std::to_string(st.st_size)+"\r\n";
+    out += "\r\n";
+    if (!sendAll(fd, out.data(), out.size())) return false;
+    if (head) return true;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char> data(64 * 1024);
+    for (off_t off = from, sent = 0; off <= to;) {
+        ssize_t len = pread(file, data.data(), std::min<off_t>(data.size(), to - off + 1), off);
+        if (len <= 0 || !sendAll(fd, data.data(), len)) return false;
+        off += len;
+        sent += len;
+        if (bandwidth > 0) std::this_thread::sleep_until(start + std::chrono::duration<double>(sent / bandwidth));
+    }
+    return true;
+}
+
+static PxResult::Result<void> sameFile(std::string a, std::string b) {
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    std::stringstream sa, sb;
+    sa << fa.rdbuf();
+    sb << fb.rdbuf();
+    if (sa.str() != sb.str()) return PxResult::FResult("sameFile ("+b+" doesn't match "+a+")", EBADMSG);
+    return PxResult::Null;
+}
+
+// The next image: the old one with some regions rewritten and some data
+// inserted, so chunk boundaries after each insertion shift.
+static PxResult::Result<void> makeNextImage(std::string from, std::string to) {
+    std::ifstream in(from, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    auto data = ss.str();
+
+    std::mt19937_64 rng(4);
+    auto noise = [&](size_t len) {
+        std::string out(len, 0);
+        for (auto &c : out) c = rng();
+        return out;
+    };
+    // a 64KiB rewrite every 4MiB and an insertion every 8MiB, on average
+    size_t size = data.size();
+    for (size_t i = 0; i < std::max<size_t>(1, size >> 22) && size > 65536; i++) data.replace(rng() % (size - 65536), 65536, noise(65536));
+    for (size_t i = 0; i < std::max<size_t>(1, size >> 23); i++) data.insert(rng() % data.size(), noise(16384));
+
+    std::ofstream out(to, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out) return PxResult::FResult("makeNextImage / write", EIO);
+    return PxResult::Null;
+}
+
+// A copy of `from` with `len` bytes in its middle inverted.
+static PxResult::Result<void> damagedCopy(std::string from, std::string to, size_t len) {
+    std::ifstream in(from, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    auto data = ss.str();
+    size_t start = data.size() / 2;
+    for (size_t i = start; i < std::min(data.size(), start + len); i++) data[i] = ~data[i];
+
+    std::ofstream out(to, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out) return PxResult::FResult("damagedCopy / write", EIO);
+    return PxResult::Null;
+}
+
+// Not timed: checks that a delta rebuilds the next image exactly, and that the
+// cases fetchImage falls back to a whole download on fail the way it expects.
+static PxResult::Result<void> checkDelta(BenchServer &server, std::string dir, std::string oldImage, ChunkIndex &index, std::string scratch) {
+    auto fail = [](std::string what) { return PxResult::FResult("checkDelta ("+what+")", EBADMSG); };
+    auto out = scratch+"/check.img";
+
+    // a missing or corrupt index means the whole image is downloaded
+    ChunkIndex fetched;
+    if (!fetched.fetch({ server.url("missing.idx") }, out+ChunkIndex::suffix).eno) return fail("a missing index loaded");
+    PXASSERTM(PxState::fput(dir+"/corrupt.idx", "SIZE=4096\nCHUNK=0123:4096\n"), "checkDelta");
+    if (!fetched.fetch({ server.url("corrupt.idx") }, out+ChunkIndex::suffix).eno) return fail("a corrupt index loaded");
+    PXASSERTM(index.save(dir+"/next.img"+ChunkIndex::suffix), "checkDelta");
+    PXASSERTM(fetched.fetch({ server.url("next.img"+(std::string)ChunkIndex::suffix) }, out+ChunkIndex::suffix), "checkDelta");
+    remove((out+ChunkIndex::suffix).c_str());
+
+    // damaged data in the seed is downloaded instead of copied
+    auto seed = scratch+"/seed.img";
+    PXASSERT(damagedCopy(oldImage, seed, 1024 * 1024));
+    auto res = fetchDelta({ server.url("next.img") }, fetched, { seed }, out, 8);
+    PXASSERTM(res, "checkDelta");
+    PXASSERT(sameFile(dir+"/next.img", out));
+    remove(seed.c_str());
+
+    // a mirror serving a damaged chunk fails the delta with something other than
+    // EBADMSG, so the whole image is tried next; what arrived intact is cached
+    PXASSERT(damagedCopy(dir+"/next.img", dir+"/damaged.img", 1));
+    ChunkCache cache(scratch+"/cache", 1024LL * 1024 * 1024);
+    PXASSERTM(cache.open(), "checkDelta");
+    res = fetchDelta({ server.url("damaged.img") }, fetched, {}, out, 8, NULL, &cache);
+    if (!res.eno || res.eno == EBADMSG) return fail("a damaged chunk was accepted");
+    res = fetchDelta({ server.url("next.img") }, fetched, {}, out, 8, NULL, &cache);
+    PXASSERTM(res, "checkDelta");
+    if (res.assert().cached == 0) return fail("nothing was cached from the failed delta");
+    PXASSERT(sameFile(dir+"/next.img", out));
+
+    for (auto &i : {dir+"/corrupt.idx", dir+"/next.img"+ChunkIndex::suffix, dir+"/damaged.img", out}) remove(i.c_str());
+    PxLog::log.info("Delta checks passed.");
+    return PxResult::Null;
+}
+
+PxResult::Result<void> benchNetwork(Bench &bench) {
+    auto &conf = bench.conf;
+    auto dir = conf.dir+"/www";
+    PXASSERTM(PxFunction::wrap("mkdir", mkdir(dir.c_str(), 0755)), "benchNetwork");
+
+    int64_t imageSize = bench.scaled(256LL * 1024 * 1024);
+    PXASSERT(writeRandomFile(dir+"/image.img", imageSize, 5));
+    int64_t smallFiles = 64, smallSize = 256 * 1024;
+    for (int64_t i = 0; i < smallFiles; i++) PXASSERT(writeRandomFile(dir+"/small"+std::to_string(i), smallSize, 100 + i));
+
+    BenchServer server(dir, conf.latency, conf.bandwidth);
+    PXASSERT(server.start());
+    auto out = conf.dir+"/download";
+
+    for (size_t segments : {(size_t)1, (size_t)4}) {
+        PXASSERT(bench.run("PxDownload image ("+std::to_string(segments)+(segments == 1 ? " segment)" : " segments)"), [&](benchresult_t &r) -> PxResult::Result<void> {
+            int64_t before = server.requests;
+            PxDownload::Download dl(8);
+            PXASSERT(dl.add(server.url("image.img"), segments)->bindOutput(out));
+            PXASSERT(dl.perform());
+            r.bytes = imageSize;
+            r.items = server.requests - before;
+            return PxResult::Null;
+        }));
+        remove(out.c_str());
+    }
+
+    // latency rather than bandwidth bound, so connection reuse and concurrency show
+    PXASSERT(bench.run("PxDownload "+std::to_string(smallFiles)+" small files", [&](benchresult_t &r) -> PxResult::Result<void> {
+        PxDownload::Download dl(8);
+        for (int64_t i = 0; i < smallFiles; i++)
+            PXASSERT(dl.add(server.url("small"+std::to_string(i)))->bindOutput(out+std::to_string(i)));
+        PXASSERT(dl.perform());
+        r.bytes = smallFiles * smallSize;
+        r.items = smallFiles;
+        return PxResult::Null;
+    }));
+    for (int64_t i = 0; i < smallFiles; i++) remove((out+std::to_string(i)).c_str());
+
+    // two versions of an image, the way a delta update sees them
+    if (!bench.wanted("delta")) return PxResult::Null;
+    auto oldImage = conf.dir+"/old.img";
+    PXASSERT(writeRandomFile(oldImage, bench.scaled(128LL * 1024 * 1024), 6));
+    PXASSERT(makeNextImage(oldImage, dir+"/next.img"));
+    ChunkIndex index;
+    PXASSERT(index.build(dir+"/next.img"));
+
+    PXASSERT(bench.run("delta next image (whole download)", [&](benchresult_t &r) -> PxResult::Result<void> {
+        PxDownload::Download dl(8);
+        PXASSERT(dl.add(server.url("next.img"), 4)->bindOutput(out));
+        PXASSERT(dl.perform());
+        r.bytes = index.size;
+        return PxResult::Null;
+    }));
+    PXASSERT(sameFile(dir+"/next.img", out));
+    remove(out.c_str());
+
+    PXASSERT(bench.run("delta next image (chunk delta)", [&](benchresult_t &r) -> PxResult::Result<void> {
+        auto res = fetchDelta({ server.url("next.img") }, index, { oldImage }, out, 8);
+        PXASSERT(res);
+        r.bytes = index.size;
+        r.items = res.assert().requests;
+        PxLog::log.info("  reused "+std::to_string(res.assert().reused / 1024 / 1024)+" MiB, fetched "+
+            std::to_string(res.assert().fetched / 1024 / 1024)+" MiB");
+        return PxResult::Null;
+    }));
+    PXASSERT(sameFile(dir+"/next.img", out));
+    remove(out.c_str());
+
+    PXASSERT(checkDelta(server, dir, oldImage, index, conf.dir));
+    return PxResult::Null;
+}
@@ -0,0 +1,166 @@
+#include <bench.hpp>
+#include <recurse.hpp>
+#include <PxFunction.hpp>
+#include <atomic>
+#include <cstdio>
+#include <fcntl.h>
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static PxResult::Result<void> makeDir(std::string path) {
+    auto mkdir_res = PxFunction::wrap("mkdir", mkdir(path.c_str(), 0755));
+    if (mkdir_res.eno != EEXIST) PXASSERTM(mkdir_res, "makeDir "+path);
+    return PxResult::Null;
+}
+
+static PxResult::Result<void> writeSmall(std::string path, size_t size, std::mt19937_64 &rng) {
+    std::string data(size, 0);
+    for (auto &c : data) c = rng();
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return PxResult::FResult("writeSmall / open "+path, errno);
+    bool ok = write(fd, data.data(), size) == (ssize_t)size;
+    close(fd);
+    if (!ok) return PxResult::FResult("writeSmall / write "+path, EIO);
+    return PxResult::Null;
+}
+
+// Many small files, a hundred to a directory, like /usr.
+static PxResult::Result<void> makeSmall(Bench &bench, std::string dir) {
+    PXASSERT(makeDir(dir));
+    std::mt19937_64 rng(1);
+    int64_t files = bench.scaled(20000);
+    for (int64_t i = 0; i < files; i++) {
+        auto sub = dir+"/"+std::to_string(i / 10000)+"/"+std::to_string(i / 100 % 100);
+        if (i % 10000 == 0) PXASSERT(makeDir(dir+"/"+std::to_string(i / 10000)));
+        if (i % 100 == 0) PXASSERT(makeDir(sub));
+        PXASSERT(writeSmall(sub+"/f"+std::to_string(i), rng() % 8192, rng));
+        // the odd symlink, since the routines treat them separately
+        if (i % 50 == 0) PXASSERTM(PxFunction::wrap("symlink", symlink(("f"+std::to_string(i)).c_str(), (sub+"/l"+std::to_string(i)).c_str())), "makeSmall");
+    }
+    return PxResult::Null;
+}
+
+// One long chain of directories with a few files at every level.
+static PxResult::Result<void> makeDeep(Bench &bench, std::string dir) {
+    std::mt19937_64 rng(2);
+    auto path = dir;
+    for (int64_t depth = 0; depth < 256; depth++) {
+        PXASSERT(makeDir(path));
+        for (int i = 0; i < 8; i++) PXASSERT(writeSmall(path+"/f"+std::to_string(i), 4096, rng));
+        path += "/d";
+    }
+    return PxResult::Null;
+}
+
+// A few large files that are mostly holes, like disk images.
+static PxResult::Result<void> makeSparse(Bench &bench, std::string dir) {
+    PXASSERT(makeDir(dir));
+    std::mt19937_64 rng(3);
+    std::string extent(1024 * 1024, 0);
+    for (auto &c : extent) c = rng();
+    int64_t size = bench.scaled(1024LL * 1024 * 1024);
+    for (int i = 0; i < 4; i++) {
+        auto path = dir+"/sparse"+std::to_string(i);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return PxResult::FResult("makeSparse / open", errno);
+        bool ok = ftruncate(fd, size) == 0;
+        // eight extents of data spread through each file
+        for (int64_t j = 0; j < 8 && ok; j++) {
+            off_t off = std::min<int64_t>(size / 8 * j, std::max<int64_t>(0, size - (int64_t)extent.size()));
+            ok = pwrite(fd, extent.data(), std::min<int64_t>(extent.size(), size), off) > 0;
+        }
+        close(fd);
+        if (!ok) return PxResult::FResult("makeSparse / write", EIO);
+    }
+    return PxResult::Null;
+}
+
+static PxResult::Result<void> copyTree(std::string from, std::string to) {
+    return fswalk(from, [&](const fsentry_t &entry) -> PxResult::Result<void> {
+        struct stat st = entry.st;
+        return fcopy(entry.rel.empty() ? from : from+"/"+entry.rel, entry.rel.empty() ? to : to+"/"+entry.rel, st);
+    }, [](const fsentry_t &) -> PxResult::Result<void> { return PxResult::Null; });
+}
+
+PxResult::Result<void> benchTrees(Bench &bench) {
+    auto &conf = bench.conf;
+    auto threads = std::to_string(conf.threads)+" threads";
+
+    for (auto shape : {"small", "deep", "sparse"}) {
+        std::string name = shape;
+        auto src = conf.dir+"/"+name;
+        if (name == "small") PXASSERT(makeSmall(bench, src));
+        if (name == "deep") PXASSERT(makeDeep(bench, src));
+        if (name == "sparse") PXASSERT(makeSparse(bench, src));
+        int64_t files;
+        int64_t bytes = treeSize(src, &files);
+
+        auto walk = [&](size_t threads) {
+            return [&, threads](benchresult_t &r) -> PxResult::Result<void> {
+                std::atomic<int64_t> seen = 0;
+                PXASSERT(fswalk(src, [&](const fsentry_t &) -> PxResult::Result<void> {
+                    seen++;
+                    return PxResult::Null;
+                }, [](const fsentry_t &) -> PxResult::Result<void> { return PxResult::Null; }, threads, false));
+                r.items = seen;
+                return PxResult::Null;
+            };
+        };
+        PXASSERT(bench.run("fswalk "+name+" (1 thread)", walk(1)));
+        if (conf.threads > 1) PXASSERT(bench.run("fswalk "+name+" ("+threads+")", walk(conf.threads)));
+
+        PXASSERT(bench.run("fsrecurse "+name, [&](benchresult_t &r) -> PxResult::Result<void> {
+            auto noop = [](std::string, std::string, struct stat&) -> PxResult::Result<void> { return PxResult::Null; };
+            PXASSERT(fsrecurse(src, "", [&](std::string, std::string, struct stat&) -> PxResult::Result<void> {
+                r.items++;
+                return PxResult::Null;
+            }, noop));
+            return PxResult::Null;
+        }));
+
+        auto copied = conf.dir+"/"+name+".fcopy";
+        PXASSERT(bench.run("fcopy "+name, [&](benchresult_t &r) -> PxResult::Result<void> {
+            PXASSERT(copyTree(src, copied));
+            r.bytes = bytes;
+            r.items = files;
+            return PxResult::Null;
+        }));
+
+        auto merged = conf.dir+"/"+name+".merge";
+        PXASSERT(makeDir(merged));
+        PXASSERT(bench.run("mergedir "+name+" copy ("+threads+")", [&](benchresult_t &r) -> PxResult::Result<void> {
+            PXASSERT(mergedir(merged, src, true, conf.threads));
+            r.bytes = bytes;
+            r.items = files;
+            return PxResult::Null;
+        }));
+        // the common case on an update: most files are already identical
+        auto unchanged = "mergedir "+name+" unchanged ("+threads+")";
+        if (!bench.wanted("mergedir "+name+" copy ("+threads+")") && bench.wanted(unchanged)) PXASSERT(mergedir(merged, src, true, conf.threads));
+        PXASSERT(bench.run(unchanged, [&](benchresult_t &r) -> PxResult::Result<void> {
+            PXASSERT(mergedir(merged, src, true, conf.threads));
+            r.items = files;
+            return PxResult::Null;
+        }));
+
+        // with some benchmarks filtered out, the trees to remove may not be there yet
+        auto removeOne = "removerecursedir "+name+" (1 thread)", removeMany = "removerecursedir "+name+" ("+threads+")";
+        if (bench.wanted(removeOne) && access(copied.c_str(), F_OK) != 0) PXASSERT(copyTree(src, copied));
+        if (bench.wanted(removeMany)) PXASSERT(mergedir(merged, src, true, conf.threads));
+        PXASSERT(bench.run(removeOne, [&](benchresult_t &r) -> PxResult::Result<void> {
+            PXASSERT(removerecursedir(copied, 1));
+            r.items = files;
+            return PxResult::Null;
+        }));
+        PXASSERT(bench.run(removeMany, [&](benchresult_t &r) -> PxResult::Result<void> {
+            PXASSERT(removerecursedir(merged, conf.threads));
+            r.items = files;
+            return PxResult::Null;
+        }));
+
+        // the small tree is kept for the extraction benchmarks
+        if (name != "small") PXASSERT(removerecursedir(src, conf.threads));
+    }
+    return PxResult::Null;
+}
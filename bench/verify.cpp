@@ -0,0 +1,88 @@
+#include <bench.hpp>
+#include <recurse.hpp>
+#include <verify.hpp>
+#include <workpool.hpp>
+#include <PxFunction.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Feeds `path` to `verifier` the way a download would, in 1MiB pieces.
+static PxResult::Result<void> stream(std::string path, PxDownload::StreamVerifier &verifier) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return PxResult::FResult("stream / open "+path, errno);
+    std::vector<char> buf(1024 * 1024);
+    ssize_t len;
+    while ((len = read(fd, buf.data(), buf.size())) > 0) {
+        auto res = verifier.update(buf.data(), len);
+        if (res.eno) {
+            close(fd);
+            PXASSERTM(res, "stream");
+        }
+    }
+    int err = errno;
+    close(fd);
+    if (len < 0) return PxResult::FResult("stream / read "+path, err);
+    PXASSERTM(verifier.final(), "stream");
+    return PxResult::Null;
+}
+
+PxResult::Result<void> benchVerify(Bench &bench) {
+    auto &conf = bench.conf;
+    auto image = conf.dir+"/verify.img";
+    int64_t size = bench.scaled(512LL * 1024 * 1024);
+    PXASSERT(writeRandomFile(image, size, 7));
+
+    Manifest::File expected = { size, {} };
+    {
+        WorkPool pool(conf.threads);
+        auto res = TreeHash::files({ image }, TreeHash::leafSize, pool);
+        PXASSERTM(res, "benchVerify");
+        expected.root = res.assert()[0];
+    }
+
+    auto hash = [&](size_t threads) {
+        return [&, threads](benchresult_t &r) -> PxResult::Result<void> {
+            WorkPool pool(threads);
+            PXASSERT(TreeHash::files({ image }, TreeHash::leafSize, pool));
+            r.bytes = size;
+            return PxResult::Null;
+        };
+    };
+    PXASSERT(bench.run("tree hash file (1 thread)", hash(1)));
+    if (conf.threads > 1) PXASSERT(bench.run("tree hash file ("+std::to_string(conf.threads)+" threads)", hash(conf.threads)));
+    PXASSERT(bench.run("tree hash stream ("+std::to_string(conf.threads)+" threads)", [&](benchresult_t &r) -> PxResult::Result<void> {
+        TreeHashVerifier verifier(expected, TreeHash::leafSize, conf.threads);
+        PXASSERT(stream(image, verifier));
+        r.bytes = size;
+        return PxResult::Null;
+    }));
+
+    // what the tree hash replaced; GpgStreamVerifier is tied to the system
+    // keyring, so this runs the same gpg --verify against a throwaway one
+    auto gpgName = "gpg --verify";
+    if (system("gpg --version >/dev/null 2>&1") != 0) {
+        bench.skip(gpgName, "no gpg");
+    } else if (bench.wanted(gpgName)) {
+        auto home = conf.dir+"/gnupg";
+        PXASSERTM(PxFunction::wrap("mkdir", mkdir(home.c_str(), 0700)), "benchVerify");
+        auto gpg = "gpg --batch --quiet --homedir "+home+" ";
+        if (system((gpg+"--pinentry-mode loopback --passphrase '' --quick-gen-key pxos-bench ed25519 sign never >/dev/null 2>&1").c_str()) != 0 ||
+            system((gpg+"--detach-sign -o "+image+".sig "+image).c_str()) != 0)
+            return PxResult::FResult("benchVerify / gpg", EINVAL);
+
+        PXASSERT(bench.run(gpgName, [&](benchresult_t &r) -> PxResult::Result<void> {
+            if (system((gpg+"--verify "+image+".sig - <"+image+" 2>/dev/null").c_str()) != 0)
+                return PxResult::FResult("benchVerify / gpg --verify", EBADMSG);
+            r.bytes = size;
+            return PxResult::Null;
+        }));
+        remove((image+".sig").c_str());
+        // gpg leaves an agent running for the home directory
+        system(("gpgconf --homedir "+home+" --kill all >/dev/null 2>&1").c_str());
+        PXASSERT(removerecursedir(home, 1));
+    }
+
+    remove(image.c_str());
+    return PxResult::Null;
+}
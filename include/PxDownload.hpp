@@ -1,14 +1,15 @@
-
 #include <cerrno>
 #include <cmath>
-#include <fstream>
+#include <chrono>
 #include <memory>
 #include <stdlib.h>
 #include <PxResult.hpp>
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include <curl/multi.h>
 #include <string>
-#include <thread>
+#include <deque>
+#include <functional>
 #include <PxJob.hpp>
 #include <PxLog.hpp>
 #include <vector>
@@ -44,153 +45,298 @@ namespace PxDownload {
 		}
 	};
 
+    struct Subdownload;
+
+    // Log where each file's (and each Fetcher request's) time went once it's done.
+    inline bool logTimings = false;
+
+    // Called with each download whose progress changed, every time the display is redrawn.
+    inline std::function<void(Subdownload &)> onProgress;
+
+    // How long requests spent in each phase, in microseconds, summed over
+    // however many were added. Each phase starts where the previous one ended.
+    struct Timing {
+        curl_off_t dns = 0;
+        curl_off_t connect = 0;
+        curl_off_t tls = 0;
+        // from sending the request to the first byte of the response
+        curl_off_t wait = 0;
+        curl_off_t transfer = 0;
+        // bytes received, for working out throughput
+        curl_off_t bytes = 0;
+        long requests = 0;
+        // new connections opened; the rest reused one
+        long connections = 0;
+
+        void add(CURL *curl);
+        std::string repr();
+    };
+
+    // Bandwidth limits every Download is held to, in bytes per second.
+    struct Limits {
+        // 0 for no limit
+        curl_off_t rate = 0;
+        // drop to idleRate whenever the network is carrying other traffic
+        bool idleOnly = false;
+        // how much other traffic it takes for the network to count as busy
+        curl_off_t idleThreshold = 256 * 1024;
+        curl_off_t idleRate = 64 * 1024;
+    };
+    inline Limits limits;
+
+    struct Segment;
+
+    // A token bucket shared by all transfers of one Download. A transfer that
+    // finds it empty is paused, and paused transfers are woken highest
+    // priority first as the bucket refills. In idle-only mode the rate is cut
+    // while the interface counters show traffic other than our own.
+    class Throttle {
+    private:
+        Limits lim;
+        // the rate in force right now; 0 for none
+        curl_off_t current;
+        double tokens;
+        // bytes let through so far, to tell our traffic from everyone else's
+        curl_off_t received = 0;
+        curl_off_t sampledReceived = 0;
+        // -1 until the interface counters have been read once
+        curl_off_t sampledTotal = -1;
+        std::chrono::steady_clock::time_point lastRefill;
+        std::chrono::steady_clock::time_point lastSample;
+        std::vector<Segment*> paused;
+
+        double burst();
+        void sample(std::chrono::steady_clock::time_point now);
+    public:
+        // How often the network counters are read in idle-only mode, in milliseconds.
+        static constexpr long sampleInterval = 1000;
+
+        Throttle(Limits lim);
+
+        bool enabled() {
+            return lim.rate > 0 || lim.idleOnly;
+        }
+        // Whether `seg` may take `count` bytes now. If not, it is remembered
+        // as paused and the caller has to pause the transfer.
+        bool admit(Segment *seg, size_t count);
+        // Refills the bucket and unpauses whichever transfers can go again.
+        void wake();
+        // Milliseconds until a paused transfer could go again, or -1 if none is waiting.
+        long wait();
+    };
+
+    // Applies what every transfer shares: the connection, DNS and TLS session
+    // caches common to the whole process, and HTTP/2 wherever TLS allows it.
+    void setupHandle(CURL *curl);
+
+    // Receives a download's bytes strictly in file order while it is being
+    // written, so it can be hashed or checked without reading it back later.
+    class StreamVerifier {
+    public:
+        virtual ~StreamVerifier() {}
+        // false while the verifier can't accept data yet (e.g. its signature isn't here)
+        virtual bool ready() { return true; }
+        virtual PxResult::Result<void> update(const char *data, size_t count) = 0;
+        // Called once every byte has been passed to update().
+        virtual PxResult::Result<void> final() = 0;
+    };
+
+    // A single HTTP request made on behalf of a Subdownload: either the whole
+    // file, one byte range of it, or the HEAD request used to plan ranges.
+    struct Segment {
+        enum Kind { Whole, Range, Probe };
+
+        Subdownload *parent;
+        Kind kind;
+        // index into the parent's sources this request went to
+        size_t mirror;
+        CURL *curl;
+        curl_off_t offset;
+        // -1 if the length is not known in advance
+        curl_off_t length;
+        curl_off_t written = 0;
+        bool acceptRanges = false;
+        bool checkedResponse = false;
+        bool discard = false;
+        // set when the failure was the server's, so another mirror may do better
+        bool retryable = false;
+        long response = 0;
+        std::string etag;
+        std::string lastModified;
+        struct curl_slist *headers = NULL;
+        PxResult::Result<void> result;
+
+        Segment(Subdownload *parent, Kind kind, curl_off_t offset = 0, curl_off_t length = -1);
+        ~Segment();
+
+        size_t onwrite(char *data, size_t count);
+        size_t onheader(char *data, size_t count);
+        void finish(CURLcode code);
+    };
+
+    // A byte range of the output file and how much of it is already on disk.
+    struct PartState {
+        curl_off_t offset;
+        curl_off_t length;
+        curl_off_t written;
+    };
+
     struct Subdownload {
-        LogDownloadTask *tsk;
+        // Appended to the output path to get the sidecar file tracking a partial download.
+        static constexpr const char *stateSuffix = ".state";
+        // How much new data to accept before syncing the output and saving the sidecar.
+        static constexpr curl_off_t checkpointInterval = 32 * 1024 * 1024;
+
+        LogDownloadTask *tsk = NULL;
         int logid;
-        bool done;
+        bool done = false;
+        // set whenever new data has arrived since the last redraw
+        bool dirty = false;
         PxResult::Result<void> result;
-        CURL *curl;
-        std::ofstream writeTo;
-        Stats stats;
-        std::thread thread;
+        int fd = -1;
+        Stats stats = {0, -1, 0};
+        // the name the download is shown and saved under; always sources[0]
         std::string source;
-        inline Subdownload() {
-            curl = curl_easy_init();
-        }
-        inline ~Subdownload() {
-            curl_easy_cleanup(curl);
-        }
-        PxResult::Result<void> bindOutput(std::string dest) {
-            writeTo = std::ofstream(dest, std::ios::out | std::ios::binary);
-            
-            return PxResult::Null;
-        }
-        size_t onwrite(char *data, size_t count) {
-            curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &stats.down);
-            curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &stats.total);
-            curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &stats.speed);
+        // the same file on every mirror, best first, and the one new requests go to
+        std::vector<std::string> sources;
+        size_t mirror = 0;
+        std::string dest;
+        // number of concurrent ranged requests to split this file into, if the server allows it
+        size_t segments = 1;
+        // higher goes first, both in the queue and for bandwidth under a limit
+        int priority = 0;
+        // set by Download::perform while limits apply
+        Throttle *throttle = NULL;
+        // expected size of the complete file, or -1 if unknown
+        curl_off_t expected = -1;
+        // if set, only these byte ranges are fetched, each written at its own offset
+        std::vector<PartState> wanted;
+        std::vector<std::unique_ptr<Segment>> parts;
+        size_t outstanding = 0;
+        Timing timing;
+        // the same, split up by mirror
+        std::vector<Timing> mirrorTiming;
+        std::chrono::steady_clock::time_point started;
 
-            writeTo.write(data, count);
-            return count;
-        }
+        // resume bookkeeping; validators identify the version of the file on the server
+        bool resume = false;
+        std::string etag;
+        std::string lastModified;
+        // ranges left over from an earlier run, and ranges already complete before this one
+        std::vector<PartState> saved;
+        std::vector<PartState> carried;
+        curl_off_t resumedBytes = 0;
+        curl_off_t lastCheckpoint = 0;
 
-        void sthrd() {
-            curl_easy_setopt(curl, CURLOPT_URL, source.c_str());
-
-            curl_write_callback cfunc = [](char *data, size_t _, size_t count, void *_current) -> size_t {
-                // return count;
-                auto current = (Subdownload*)_current;
-                return current->onwrite(data, count);
-            };
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cfunc);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
-
-            CURLcode res = curl_easy_perform(curl);
-            if (res != CURLE_OK) {
-                result = PxResult::FResult("PxDownload::Download::perform / curl_easy_perform", EINVAL);
-                done = true;
-                return;
-            }
-
-            int response;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
-            if (response != 200) {
-                result = PxResult::FResult("PxDownload::Download::perform / curl_easy_perform", EINVAL);
-                done = true;
-                return;
-            }
-            done = true;
-        }
+        // optional in-order consumer; verified is how far into the file it has got
+        std::shared_ptr<StreamVerifier> verifier;
+        curl_off_t verified = 0;
+        bool finalized = false;
 
-        operator bool() {
-            return curl != NULL;
-        }
+        Subdownload() {}
+        ~Subdownload();
+
+        // Opens the output file. With resume set, existing data is kept and
+        // picked up from the sidecar state file instead of truncating it.
+        // Set `wanted` first to leave everything outside those ranges alone.
+        PxResult::Result<void> bindOutput(std::string dest, bool resume = false);
+        PxResult::Result<void> checkpoint();
+        // Throws away everything on disk and starts from byte 0.
+        void restart();
+        std::string validator();
+
+        // Segments to queue when the download starts.
+        std::vector<Segment*> start();
+        // Called when one of our segments finishes; returns any follow-up segments to queue.
+        std::vector<Segment*> segmentDone(Segment *seg);
+        void addWritten(Segment *seg, curl_off_t count);
+        // Passes freshly written data to the verifier if it is next in line.
+        void feed(Segment *seg, const char *data, size_t count);
+        // Passes anything contiguous that is on disk but hasn't been verified yet.
+        PxResult::Result<void> catchUp();
+        // Finishes verification once the file and the verifier are both ready.
+        PxResult::Result<void> finalize();
 
         void initTask() {
             logid = PxLog::log.newTask(tsk = new LogDownloadTask(source));
         }
 
-        void updateTask() {
-            if (tsk == NULL) return;
-
-            std::vector<std::string> strstats = {};
+        void updateTask();
+    private:
+        Segment *newSegment(Segment::Kind kind, curl_off_t offset = 0, curl_off_t length = -1);
+        bool failover(Segment *seg);
+        Segment *retry(Segment *seg);
+        std::vector<Segment*> planRanges(curl_off_t size);
+        std::vector<Segment*> resumeRanges();
+        Segment *resumeWhole();
+        curl_off_t savedPrefix();
+        curl_off_t contiguous();
+        PxResult::Result<void> loadState();
+        PxResult::Result<void> verify();
+    };
 
-            float spd = std::floor(stats.speed / 1024. / 1024. * 10.)/10.;
-            strstats.push_back(std::to_string(spd)+" MiB/s");
+    // What came back from a Fetcher request.
+    struct Response {
+        long status = 0;
+        std::string body;
+        std::string etag;
+        std::string lastModified;
+    };
 
-            if (stats.total >= 0) {
-                strstats.push_back(std::to_string((int)std::round((float)stats.down * 100. / (float)stats.total))+"%");
-            }
+    // Makes small requests whose whole response is wanted in memory, like
+    // version checks. The same handle is used for every request, so the
+    // connection to a server is reused between them.
+    class Fetcher {
+    private:
+        CURL *curl;
+        struct curl_slist *headers = NULL;
+        Response current;
+    public:
+        // phases of the last request
+        Timing timing;
+        // Bodies larger than this are refused rather than buffered.
+        static constexpr size_t maxBody = 1024 * 1024;
 
-            tsk->stats = PxFunction::join(strstats, ", ");
+        Fetcher();
+        ~Fetcher();
 
-            if (done) {
-                if (result.eno) {
-                    PxLog::log.completeTask(logid, PxLog::Fail);
-                } else {
-                    PxLog::log.completeTask(logid, PxLog::Success);
-                }
-                tsk = NULL;
-            }
-        }
+        // GETs `url`. With `etag` set, a server whose copy still has that
+        // ETag answers 304 with no body. Any HTTP status is returned as a
+        // Response; only transfer failures are errors.
+        PxResult::Result<Response> get(std::string url, std::string etag = "");
     };
 
     class Download {
     private:
         std::vector<std::shared_ptr<Subdownload>> downloads;
+        CURLM *multi;
+        size_t maxConcurrent;
     public:
-        Download() {}
+        // Minimum time between two progress redraws, in milliseconds.
+        static constexpr long redrawInterval = 100;
+        // Files are never split into ranges smaller than this.
+        static constexpr curl_off_t minSegmentSize = 16 * 1024 * 1024;
 
-        std::shared_ptr<Subdownload> add(std::string source) {
+        Download(size_t maxConcurrent = 4);
+        ~Download();
+
+        // `sources` are URLs of the same file on different mirrors, best first.
+        // Requests that fail on one mirror are retried on the next.
+        std::shared_ptr<Subdownload> add(std::vector<std::string> sources, size_t segments = 1) {
             auto dld = std::make_shared<Subdownload>();
-            dld->source = source;
+            dld->source = sources.front();
+            dld->sources = sources;
+            dld->mirrorTiming.resize(sources.size());
+            dld->segments = segments == 0 ? 1 : segments;
             downloads.push_back(dld);
             return dld;
         }
 
-        PxResult::Result<void> perform() {
-            for (auto &i : downloads) {
-                i->done = false;
-                i->result = PxResult::Null;
-
-                i->thread = std::thread([&i]() {
-                    i->sthrd();
-                });
-                i->initTask();
-            }
-
-            PxJob::JobServer js;
-            js.AddJob(std::make_shared<PxJob::OscJob>(&PxLog::log));
-
-            bool done = false;
-
-            while (!done) {
-                js.tick();
-
-                for (auto i : downloads) {
-                    i->updateTask();
-                }
-                PxLog::log.top();
-                PxLog::log.printTasks();
-
-                done = true;
-                for (auto i : downloads) {
-                    done = done && i->done;
-                }
-
-                usleep(50000);
-            }
-
-            for (auto i : downloads) {
-                i->thread.join();
-                i->updateTask();
-            }
-            for (auto i : downloads) {
-                PXASSERT(i->result);
-            }
-
-            return PxResult::Null;
+        std::shared_ptr<Subdownload> add(std::string source, size_t segments = 1) {
+            return add(std::vector<std::string>{ source }, segments);
         }
+
+        PxResult::Result<void> perform();
     };
 }
-#endif
\ No newline at end of file
+#endif
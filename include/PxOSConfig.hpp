@@ -2,6 +2,7 @@
 #include <PxConfig.hpp>
 #include <PxState.hpp>
 #include <PxResult.hpp>
+#include <vector>
 
 #ifndef PXOSCONF
 #define PXOSCONF
@@ -15,6 +16,8 @@ namespace PxOSConfig {
         std::string root2;
         std::string data;
         std::string current;
+        // version `pxos stage` installed on the opposite root, until it is committed or overwritten
+        std::string staged;
 
         conf(std::string path) : path(path) {}
         
@@ -26,6 +29,7 @@ namespace PxOSConfig {
             root2 = cnf.QuickRead("ROOT2");
             data = cnf.QuickRead("DATA");
             current = cnf.QuickRead("CURRENT");
+            staged = cnf.QuickRead("STAGED");
             return PxResult::Null;
         }
         PxResult::Result<void> writeConf() {
@@ -33,7 +37,8 @@ namespace PxOSConfig {
                 "ROOT1="+root1+"\n"
                 "ROOT2="+root2+"\n"
                 "DATA="+data+"\n"
-                "CURRENT="+current
+                "CURRENT="+current+"\n"
+                "STAGED="+staged
             );
             PXASSERTM(res, "PxOSConfig::conf::writeConf");
             return PxResult::Null;
@@ -49,11 +54,42 @@ namespace PxOSConfig {
         }
     };
 
-    PxResult::Result<void> InitializeNew(conf &cfg);
+    // Version of the root filesystem layout. Bumping it makes the next update
+    // start the inactive root from a fresh filesystem instead of syncing it.
+    constexpr int layoutVersion = 1;
+    // Marker on each root recording the layout version it was installed with.
+    constexpr const char *layoutFile = ".px-layout";
+
+    // Prepares the inactive root for a new image. With `incremental`, its
+    // filesystem is kept if it checks clean and has the current layout, so the
+    // image can be synced onto it; otherwise it is reformatted. Returns
+    // whether the old filesystem was kept.
+    PxResult::Result<bool> InitializeNew(conf &cfg, bool incremental = false);
+    // Writes a raw filesystem image straight onto the inactive root, then
+    // grows the filesystem to fill the partition.
+    PxResult::Result<void> InitializeFromImage(conf &cfg, std::string image);
 
     struct OSConfig {
-        std::string repo;
+        // every mirror of the repository, in the order they were configured
+        std::vector<std::string> repos;
         std::string branch;
+        // maximum number of transfers PxDownload runs at once
+        size_t parallelDownloads;
+        // number of ranged requests a large image is split into
+        size_t downloadSegments;
+        // sync the inactive root in place rather than reformatting it
+        bool incrementalUpdates;
+        // where chunks downloaded by delta updates are kept between them, and how many MiB of them
+        std::string chunkCache;
+        size_t chunkCacheSize;
+        // hours a ranking of the mirrors is used for before they are probed again
+        size_t mirrorProbeInterval;
+        // public key the release manifest is signed with
+        std::string signingKey;
+        // where generated initramfs images and grub.cfg are kept between updates
+        std::string bootCache;
+        // what is mounted into the new root to generate its boot files, as a MountPlan
+        std::string chrootMounts;
     };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef PXOS_BOOTFILES
+#define PXOS_BOOTFILES
+
+#include <string>
+#include <PxResult.hpp>
+
+// Generates the initramfs images of every mkinitcpio preset, then grub.cfg,
+// in the new root at `root`. /boot, /proc, /sys and /dev must already be
+// mounted there. Presets are built in parallel.
+//
+// With a `cacheDir`, generated files are kept there under a hash of their
+// inputs. The next update whose inputs hash the same copies them back in
+// instead of generating them again:
+//   - an initramfs is keyed by the kernels, the module tree, mkinitcpio's
+//     config and hooks, and its preset. The files it was built from are
+//     remembered too, so a new busybox (say) still causes a rebuild, even
+//     though it isn't part of the key.
+//   - grub.cfg is keyed by GRUB's config and scripts, the names of the files
+//     in /boot, and the filesystem UUID of `rootDevice`.
+// Two entries of each are kept, enough for both root partitions.
+//
+// Without `grub`, only the initramfs images are made, to fill the cache
+// ahead of time: grub.cfg depends on where /boot is mounted from as well.
+PxResult::Result<void> generateBootFiles(std::string root, std::string rootDevice, std::string cacheDir, bool grub = true);
+
+#endif
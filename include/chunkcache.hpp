@@ -0,0 +1,56 @@
+#ifndef PXOS_CHUNKCACHE
+#define PXOS_CHUNKCACHE
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <sys/types.h>
+#include <PxResult.hpp>
+#include <delta.hpp>
+
+// A size-bounded store of chunks kept across updates, addressed by their
+// hash. Each chunk is a file under <dir>/<first two hex digits>/, and an
+// index file remembers sizes and when each chunk was last used, so the
+// least recently used ones can be dropped once the store is over its limit.
+// Chunks are checked against their hash every time they are read back.
+class ChunkCache {
+private:
+    struct entry_t {
+        size_t length;
+        uint64_t used;
+    };
+
+    std::string dir;
+    off_t limit;
+    off_t total = 0;
+    // bumped on every access; stands in for a timestamp in the LRU order
+    uint64_t clock = 0;
+    bool dirty = false;
+    std::unordered_map<std::string, entry_t> entries;
+
+    std::string pathOf(const std::string &hex);
+    void drop(const std::string &hex);
+    void evict();
+    // Brings the index in line with the chunk files that are actually there.
+    void reconcile();
+public:
+    // Name of the index file inside the cache directory.
+    static constexpr const char *indexName = "index";
+
+    // `limit` is in bytes; a limit of 0 disables the cache.
+    ChunkCache(std::string dir, off_t limit) : dir(dir), limit(limit) {}
+
+    bool enabled() {
+        return limit > 0;
+    }
+
+    // Creates the directory if needed and loads the index.
+    PxResult::Result<void> open();
+    // Reads the chunk with `hash` into `buf`; false if it isn't cached or its data is damaged.
+    bool get(const chunkhash_t &hash, size_t length, std::vector<unsigned char> &buf);
+    PxResult::Result<void> put(const chunkhash_t &hash, const std::vector<unsigned char> &data);
+    // Writes the index back out.
+    PxResult::Result<void> save();
+};
+
+#endif
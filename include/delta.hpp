@@ -0,0 +1,76 @@
+#ifndef PXOS_DELTA
+#define PXOS_DELTA
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <PxResult.hpp>
+#include <PxDownload.hpp>
+
+typedef std::array<unsigned char, 32> chunkhash_t;
+
+// Splits a stream into content-defined chunks: a boundary falls wherever a
+// rolling hash of the last few dozen bytes hits a fixed pattern, so the same
+// data produces the same chunks wherever it sits in a file or on a disk.
+namespace Chunker {
+    // Limits on chunk size; the average lands around minChunk + 64KiB.
+    constexpr size_t minChunk = 16 * 1024;
+    constexpr size_t maxChunk = 256 * 1024;
+
+    chunkhash_t hash(const unsigned char *data, size_t count);
+    std::string hex(const chunkhash_t &hash);
+    // Parses what hex() wrote; false if `str` isn't a hash.
+    bool fromHex(const std::string &str, chunkhash_t &out);
+
+    // Reads `fd` from its current position to the end and calls `onchunk` for
+    // every chunk in order; returning false from it stops the scan early.
+    PxResult::Result<void> scan(int fd, std::function<bool(off_t offset, const unsigned char *data, size_t count)> onchunk);
+}
+
+// The list of chunks an image is made of, published beside it as <image>.idx.
+struct ChunkIndex {
+    struct Chunk {
+        off_t offset;
+        size_t length;
+        chunkhash_t hash;
+    };
+
+    // Appended to an image's name to get its index.
+    static constexpr const char *suffix = ".idx";
+
+    off_t size = 0;
+    std::vector<Chunk> chunks;
+
+    PxResult::Result<void> load(std::string path);
+    PxResult::Result<void> save(std::string path);
+    // Chunks the image at `image`.
+    PxResult::Result<void> build(std::string image);
+    // Downloads the index from the first of `sources` that has it to `dest` and loads it.
+    PxResult::Result<void> fetch(std::vector<std::string> sources, std::string dest);
+};
+
+class ChunkCache;
+
+struct deltastats_t {
+    off_t reused;
+    off_t cached;
+    off_t fetched;
+    size_t requests;
+};
+
+// Rebuilds the image described by `index` at `dest`. Chunks found in any of
+// the `seeds` (files or block devices, like the running root partition) are
+// copied from there; the rest are downloaded from `sources` (the image on each
+// mirror, best first) as ranged requests of neighbouring chunks, unless
+// `cache` has them from an earlier run; what is downloaded is added to it,
+// even when the download fails part way. Only delta updates use the cache;
+// a whole-image download never goes through it. Every chunk is checked
+// against its hash, and the finished file is passed through `verifier` if
+// there is one.
+PxResult::Result<deltastats_t> fetchDelta(std::vector<std::string> sources, const ChunkIndex &index, std::vector<std::string> seeds,
+    std::string dest, size_t maxConcurrent, std::shared_ptr<PxDownload::StreamVerifier> verifier = NULL, ChunkCache *cache = NULL);
+
+#endif
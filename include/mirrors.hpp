@@ -0,0 +1,59 @@
+#ifndef PXOS_MIRRORS
+#define PXOS_MIRRORS
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <PxResult.hpp>
+#include <PxDownload.hpp>
+
+// The repository's mirrors, best first. Each one's latency comes from probing
+// all of them at once; throughput is learned from real downloads, since a
+// probe is too small to say anything about it. Both are kept in a cache file,
+// so the mirrors are only probed again once the ranking gets old or a mirror
+// fails.
+class MirrorList {
+private:
+    struct mirror_t {
+        std::string url;
+        // time to the first byte of a probe, in microseconds; -1 if it didn't answer
+        curl_off_t latency = -1;
+        // bytes per second over real downloads; 0 until one has been measured
+        double throughput = 0;
+        // when the latency was measured; 0 means it needs probing again
+        time_t probed = 0;
+    };
+
+    std::vector<mirror_t> mirrors;
+    std::string cachePath;
+    time_t maxAge;
+    bool dirty = false;
+
+    double cost(const mirror_t &m);
+    void sort();
+    void load();
+    PxResult::Result<void> probe(std::string file);
+    mirror_t *find(const std::string &url);
+public:
+    // A mirror that hasn't answered a probe within this many milliseconds is taken as down.
+    static constexpr long probeTimeout = 5000;
+    // Mirrors are compared on how long they would take to deliver this much.
+    static constexpr double referenceSize = 16 * 1024 * 1024;
+    // Downloads smaller than this say too little about throughput to count.
+    static constexpr curl_off_t minSample = 1024 * 1024;
+
+    // `maxAge` is how many seconds a ranking is trusted for.
+    MirrorList(std::vector<std::string> urls, std::string cachePath, time_t maxAge);
+
+    // Ranks the mirrors, probing them for `file` unless the cached ranking is still good.
+    PxResult::Result<void> rank(std::string file);
+    // URLs of `file` on every mirror, best first.
+    std::vector<std::string> urls(std::string file);
+    // Moves the mirror `url` belongs to to the back, and has it probed again next time.
+    void fail(const std::string &url);
+    // Learns from a finished download which mirrors failed it and how fast the rest were.
+    void record(PxDownload::Subdownload &sdl);
+    PxResult::Result<void> save();
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef PXOS_MOUNTPLAN
+#define PXOS_MOUNTPLAN
+
+#include <map>
+#include <string>
+#include <vector>
+#include <PxResult.hpp>
+
+// The filesystems mounted into a root before chrooting into it. A plan is
+// written as space-separated TARGET:TYPE:SOURCE[:OPTIONS] entries:
+//   - TARGET is a path inside the root.
+//   - TYPE is a filesystem type, "bind" or "rbind" to bind SOURCE's tree,
+//     or "auto" to probe the device.
+//   - SOURCE may be @NAME, which stands for a value handed to parse().
+//   - OPTIONS are comma-separated, as for mount(8).
+//
+// Every filesystem is first set up detached with the new mount API
+// (fsopen/fsmount, or open_tree for binds). Nothing is attached until all
+// of them are ready. Kernels without that API get plain mount(2) calls.
+// Teardown is the reverse of the attach order, done in-process. Mounts
+// that aren't nested in each other are unmounted in parallel.
+class MountPlan {
+public:
+    struct Entry {
+        std::string target;
+        std::string type;
+        std::string source;
+        std::string options;
+    };
+
+    // What the boot files have always been generated with.
+    static constexpr const char *defaultPlan =
+        "/run:tmpfs:tmpfs /tmp:tmpfs:tmpfs /proc:proc:proc /sys:sysfs:sysfs /dev:devtmpfs:devtmpfs "
+        "/boot:bind:/boot /root:bind:/root /var:bind:/var /etc:bind:/etc /data:auto:@data";
+
+    std::vector<Entry> entries;
+
+    PxResult::Result<void> parse(std::string text, const std::map<std::string, std::string> &vars);
+    // Binds `to` wherever the plan binds `source`.
+    void redirect(std::string source, std::string to);
+    // Creates any missing targets and mounts every entry under `root`. If
+    // one fails, whatever was already mounted is taken down again.
+    PxResult::Result<void> mount(std::string root);
+    PxResult::Result<void> unmount();
+    ~MountPlan();
+private:
+    // absolute targets, in the order they were attached
+    std::vector<std::string> attached;
+};
+
+// Unmounts `target`, detaching it lazily if something still has it busy.
+PxResult::Result<void> unmountPath(std::string target);
+
+#endif
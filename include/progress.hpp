@@ -0,0 +1,55 @@
+#ifndef PXOS_PROGRESS
+#define PXOS_PROGRESS
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// Machine-readable progress for whatever runs pxos unattended: one JSON
+// object per line, written to a file descriptor. Writing never blocks. The
+// descriptor is made non-blocking, and what it won't take yet is kept in a
+// bounded buffer for the next write. Progress updates that don't fit are
+// dropped, since a newer one follows; every other event is always kept.
+class ProgressStream {
+private:
+    int fd = -1;
+    std::string pending;
+    size_t dropped = 0;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    std::string currentPhase;
+    std::chrono::steady_clock::time_point phaseStarted;
+    // latest byte count of everything reported during the current phase
+    std::map<std::string, long long> phaseBytes;
+
+    double elapsed();
+    void flush();
+    void write(std::string fields, bool droppable);
+    void endPhase();
+public:
+    // Environment variable naming the descriptor to write events to.
+    static constexpr const char *fdVariable = "PXOS_PROGRESS_FD";
+    // Most unwritten output kept around before progress updates start being dropped.
+    static constexpr size_t maxPending = 64 * 1024;
+
+    ~ProgressStream();
+
+    // Starts writing events to `fd`.
+    bool open(int fd);
+    bool enabled() {
+        return fd >= 0;
+    }
+
+    // Ends the current phase, reporting how long it took and how much it
+    // transferred, and starts the next one.
+    void phase(std::string name);
+    // Where `item` (a URL or a device) has got to. Rates are in bytes per second.
+    void progress(const std::string &item, long long bytes, long long total, double rate, bool done = false);
+    // A one-off event with string fields, like the outcome of a version check.
+    void event(std::string name, std::vector<std::pair<std::string, std::string>> fields);
+};
+
+extern ProgressStream progress;
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PXOS_RAWIMAGE
+#define PXOS_RAWIMAGE
+
+#include <string>
+#include <PxResult.hpp>
+#include <PxLog.hpp>
+
+class LogWriteTask : public PxLog::LogTask {
+public:
+    std::string stats;
+    LogWriteTask(std::string name) {
+        me = name;
+        terse = "write "+name;
+    }
+    std::string repr() override {
+        switch (status) {
+            case PxLog::Success:
+                return "Wrote "+me+" ("+stats+")";
+            case PxLog::Partial:
+                return "Cancelled writing "+me+" ("+stats+")";
+            case PxLog::Fail:
+                return "Failed to write "+me+" ("+stats+")";
+            case PxLog::Pending:
+                return "Writing "+me+"... ("+stats+")";
+        }
+        return me;
+    }
+};
+
+// Size of each direct write to the device; a multiple of any sector size.
+constexpr size_t rawWriteSize = 4 * 1024 * 1024;
+// Runs of zeroes are looked for at this granularity and punched out instead of written.
+constexpr size_t rawZeroBlock = 64 * 1024;
+
+// Whether `image` is a raw ext2/3/4 filesystem image rather than a tarball.
+bool isRawImage(std::string image);
+
+// Copies the raw filesystem image at `image` onto the block device `device`
+// with O_DIRECT writes, turning all-zero blocks into punched holes instead of
+// writing them. Everything is then read back from the device, bypassing the
+// page cache, and checked against a hash of the image.
+PxResult::Result<void> writeRawImage(std::string image, std::string device);
+
+#endif
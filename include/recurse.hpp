@@ -6,12 +6,65 @@
 #include <string>
 #include <PxResult.hpp>
 
+#include <sys/stat.h>
+#include <thread>
+
+// An entry visited by fswalk. `dirfd` is the open directory containing it
+// and `name` its name there, ready for the *at() calls; for the walk root
+// they are AT_FDCWD and the path that was passed in, and `rel` is empty.
+struct fsentry_t {
+    int dirfd;
+    const char *name;
+    const std::string &rel;
+    const struct stat &st;
+};
+
 typedef std::function<PxResult::Result<void>(std::string path, std::string relpath, struct stat& st)> fsrhnd_t;
+typedef std::function<PxResult::Result<void>(const fsentry_t &entry)> fswhnd_t;
 PxResult::Result<void> fcopy(std::string pathin, std::string pathout, struct stat& st);
+// Walks a tree without recursing on the stack. fenter sees every entry before
+// its children, fexit after all of them. With threads > 1, subdirectories
+// are walked in parallel and the callbacks must be thread-safe.
+// Without statEntries, entries whose type getdents reports only get st_mode
+// filled in, which saves a syscall per entry for callers that just need the type.
+PxResult::Result<void> fswalk(std::string path, fswhnd_t fenter, fswhnd_t fexit, size_t threads = 1, bool statEntries = true);
 PxResult::Result<void> fsrecurse(std::string path, std::string pathrel, fsrhnd_t fenter, fsrhnd_t fexit);
-PxResult::Result<void> mergedir(std::string to, std::string from, bool replace);
-PxResult::Result<void> removerecursedir(std::string dir);
+// Brings `to` in line with the defaults in `from`, skipping anything that is
+// already identical. With `replace`, differing files are overwritten. Without
+// it, local edits are kept; if `base` holds the previous version's defaults,
+// files nobody touched are updated and edited ones get a .pxnew beside them.
+PxResult::Result<void> mergedir(std::string to, std::string from, bool replace, size_t threads = 1, std::string base = "");
+PxResult::Result<void> removerecursedir(std::string dir, size_t threads = 1);
+
+struct removestats_t {
+    size_t entries;
+    double seconds;
+};
+PxResult::Result<removestats_t> removetree(std::string dir, size_t threads = 1);
+
+// Gets directories out of the way immediately by renaming them into a trash
+// directory on the same filesystem, and deletes them on a background thread
+// until finish() is called.
+class DeferredRemove {
+private:
+    std::string trash;
+    size_t dirs = 0;
+    size_t threads = 1;
+    std::thread worker;
+    PxResult::Result<void> result;
+    removestats_t stats = {0, 0};
+public:
+    DeferredRemove() {}
+    ~DeferredRemove();
+
+    PxResult::Result<void> start(std::string trashdir, size_t threads = 1);
+    PxResult::Result<void> add(std::string dir);
+    // Begins deleting everything added so far in the background.
+    void run();
+    PxResult::Result<void> finish();
+};
 
 #define FHND_NONE (fsrhnd_t)[](auto _, auto _2, auto _3) { return PxResult::Null; }
+#define FWHND_NONE (fswhnd_t)[](const fsentry_t &_) { return PxResult::Null; }
 
 #endif
\ No newline at end of file
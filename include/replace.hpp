@@ -3,7 +3,20 @@
 
 #include <string>
 #include <PxResult.hpp>
+#include <PxOSConfig.hpp>
 
-PxResult::Result<void> replace(std::string replace_with);
+// Installs the image at `replace_with` on the inactive root and switches to
+// it, with the update settings in `osconf`.
+PxResult::Result<void> replace(std::string replace_with, const PxOSConfig::OSConfig &osconf);
+
+// replace() in two steps, so only the second has to happen in a maintenance
+// window. stage() installs `image` on the inactive root and builds its
+// initramfs images into the boot cache, leaving the running system alone,
+// and records `version` as staged in /data/partitions. commit() merges the
+// new /boot, /etc and /var defaults into the running system, so edits made
+// since staging are kept, and switches to the staged root. It returns the
+// version it switched to, or ENOENT if nothing is staged.
+PxResult::Result<void> stage(std::string image, std::string version, const PxOSConfig::OSConfig &osconf);
+PxResult::Result<std::string> commit(const PxOSConfig::OSConfig &osconf);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#ifndef PXOS_TRACE
+#define PXOS_TRACE
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <PxResult.hpp>
+
+// Scoped timing of where an update spends its time. A span runs from where
+// it is declared to the end of its scope, or to an earlier finish(), like
+// PxDefer's DEFER. Each span records:
+//   - wall time
+//   - CPU time of the process, plus any children it waited for
+//   - read and write syscalls and storage bytes, from /proc/self/io
+//   - any byte count the code hands it
+// CPU and I/O are process-wide, so they include other threads' work during
+// the span. While tracing is off, a span costs one branch.
+namespace Trace {
+    struct counters_t {
+        // microseconds of user and system time
+        int64_t cpu;
+        // read and write syscalls
+        int64_t syscalls;
+        // bytes that actually went to or came from storage
+        int64_t ioBytes;
+    };
+
+    class Span {
+    private:
+        std::string name;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+        counters_t startCounters;
+        int64_t bytes = 0;
+    public:
+        Span(std::string name);
+        ~Span();
+
+        // Counts data the span processed, for its throughput in the summary.
+        void addBytes(int64_t count) {
+            bytes += count;
+        }
+        // Ends the span now instead of at the end of its scope.
+        void finish();
+    };
+
+    // Starts recording spans. At exit, a summary is logged and, if `path`
+    // is set, a Chrome trace (also readable by Perfetto) is written there.
+    void enable(std::string path = "");
+    bool enabled();
+    // What the process has used so far; a span is the difference of two of these.
+    counters_t sample();
+    // Logs the summary and writes the trace file; called at exit once enabled.
+    PxResult::Result<void> report();
+}
+
+#define TRACE(name, label) Trace::Span name(label)
+
+#endif
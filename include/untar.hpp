@@ -0,0 +1,166 @@
+#ifndef PXOS_UNTAR
+#define PXOS_UNTAR
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <unordered_set>
+#include <sys/stat.h>
+#include <PxResult.hpp>
+#include <PxLog.hpp>
+#include <PxDownload.hpp>
+#include <workpool.hpp>
+
+class LogExtractTask : public PxLog::LogTask {
+public:
+    std::string stats;
+    LogExtractTask(std::string name) {
+        me = name;
+        terse = "extract "+name;
+    }
+    std::string repr() override {
+        switch (status) {
+            case PxLog::Success:
+                return "Extracted "+me+" ("+stats+")";
+            case PxLog::Partial:
+                return "Cancelled extracting "+me+" ("+stats+")";
+            case PxLog::Fail:
+                return "Failed to extract "+me+" ("+stats+")";
+            case PxLog::Pending:
+                return "Extracting "+me+"... ("+stats+")";
+        }
+        return me;
+    }
+};
+
+// Unpacks a tar stream (ustar, GNU long names and pax headers, including
+// SCHILY.xattr records) into a directory, preserving ownership, modes,
+// timestamps, links, device nodes and xattrs like `tar xpf --xattrs`.
+//
+// Data is pushed in with update() in whatever chunks are available, so
+// the same extractor can be fed from an mmap of the image or attached to
+// a PxDownload::Subdownload as its StreamVerifier.
+//
+// With more than one thread and contiguous input, the calling thread only
+// decodes headers and creates directories; files, symlinks and nodes are
+// created by a WorkPool, hard links once it has drained, and directory
+// modes and mtimes last of all.
+class TarExtractor : public PxDownload::StreamVerifier {
+public:
+    struct Entry {
+        std::string path;
+        std::string linkpath;
+        char type = '0';
+        mode_t mode = 0;
+        uid_t uid = 0;
+        gid_t gid = 0;
+        off_t size = 0;
+        struct timespec mtime = {0, 0};
+        unsigned int devmajor = 0;
+        unsigned int devminor = 0;
+        std::vector<std::pair<std::string, std::string>> xattrs;
+    };
+
+    // Size of the buffer file data is collected in before it's written out.
+    static constexpr size_t writeSize = 1024 * 1024;
+private:
+    enum State { Header, Meta, Data, Skip, Padding, End };
+
+    std::string dest;
+    int rootfd = -1;
+    mode_t oldmask = 022;
+    State state = Header;
+    char hdr[512];
+    size_t hdrlen = 0;
+    off_t remaining = 0;
+    size_t padding = 0;
+    std::string meta;
+    char metaType = 0;
+
+    Entry cur;
+    // overrides picked up from pax/GNU headers, for the next entry and for all of them
+    std::vector<std::pair<std::string, std::string>> paxNext;
+    std::vector<std::pair<std::string, std::string>> paxGlobal;
+    std::string longName;
+    std::string longLink;
+
+    int outfd = -1;
+    char *wbuf = NULL;
+    size_t wlen = 0;
+    off_t woff = 0;
+
+    // directories get their final mode and mtime once everything inside them exists
+    std::vector<Entry> dirs;
+
+    PxResult::Result<void> result;
+
+    PxResult::Result<void> processHeader();
+    PxResult::Result<void> processMeta();
+    PxResult::Result<void> begin();
+    PxResult::Result<void> writeData(const char *data, size_t count);
+    PxResult::Result<void> flush();
+    PxResult::Result<void> finishFile();
+    PxResult::Result<void> applyMeta(int fd, const Entry &e, bool isLink);
+
+    // used by the parallel writers
+    std::unique_ptr<WorkPool> pool;
+    std::vector<std::pair<Entry, const char*>> batch;
+    off_t batchBytes = 0;
+    std::vector<Entry> links;
+    bool capturing = false;
+    const char *dataStart = NULL;
+    std::mutex errorLock;
+    std::atomic<bool> failed = false;
+    PxResult::Result<void> workerError;
+
+    // every path in the archive, when syncing
+    std::unordered_set<std::string> seen;
+    PxResult::Result<bool> reuse(const Entry &e);
+
+    PxResult::Result<void> createNode(const Entry &e);
+    PxResult::Result<void> writeFile(const Entry &e, const char *data);
+    PxResult::Result<void> makeLink(const Entry &e);
+    void queue(const Entry &e, const char *data);
+    void flushBatch();
+public:
+    // Number of writer threads. More than one only takes effect with
+    // contiguous input: every update() must continue the same buffer as
+    // the last one, and that buffer must stay valid until final().
+    size_t threads = 1;
+    bool contiguous = false;
+    // Sync into an existing tree: entries that already match the archive
+    // are left alone, and final() removes whatever the archive doesn't
+    // have, apart from the top-level names in `keep`.
+    bool incremental = false;
+    std::vector<std::string> keep;
+
+    // progress reporting
+    LogExtractTask *tsk = NULL;
+    int logid;
+    off_t total = -1;
+    off_t consumed = 0;
+    size_t entries = 0;
+    std::atomic<size_t> reused = 0;
+    size_t pruned = 0;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point lastDraw;
+
+    TarExtractor(std::string dest) : dest(dest) {}
+    ~TarExtractor();
+
+    PxResult::Result<void> open();
+    PxResult::Result<void> update(const char *data, size_t count) override;
+    PxResult::Result<void> final() override;
+
+    void initTask(std::string name);
+    void updateTask(bool force = false);
+};
+
+// Extracts the tar image at `image` into `dest`, reading it through an mmap.
+// Compressed images are handed to tar(1), which can decompress them.
+// With `sync`, `dest` already holds an older tree which is updated in place:
+// only what differs is rewritten, and anything the image doesn't have is
+// removed, apart from the top-level names in `keep`.
+PxResult::Result<void> extractImage(std::string image, std::string dest, bool sync = false, std::vector<std::string> keep = {});
+
+#endif
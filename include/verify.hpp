@@ -0,0 +1,94 @@
+#ifndef PXOS_VERIFY
+#define PXOS_VERIFY
+
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include <PxResult.hpp>
+#include <PxDownload.hpp>
+#include <delta.hpp>
+#include <workpool.hpp>
+
+// Checks a download against a detached signature by streaming it into
+// `gpg --verify` as it arrives. The signature itself must be downloaded
+// first, so the verifier stays unready until `signature` is done.
+class GpgStreamVerifier : public PxDownload::StreamVerifier {
+private:
+    std::shared_ptr<PxDownload::Subdownload> signature;
+    std::string sigpath;
+    pid_t pid = -1;
+    int pipefd = -1;
+    PxResult::Result<void> spawn();
+public:
+    GpgStreamVerifier(std::shared_ptr<PxDownload::Subdownload> signature, std::string sigpath)
+        : signature(signature), sigpath(sigpath) {}
+    ~GpgStreamVerifier();
+
+    bool ready() override;
+    PxResult::Result<void> update(const char *data, size_t count) override;
+    PxResult::Result<void> final() override;
+};
+
+// A hash of a file that can be computed on as many cores as there are: the
+// file is cut into fixed-size leaves, each hashed on its own, and the root
+// is the hash of the file's size followed by every leaf hash in order.
+// SHA-256 is used for both, which OpenSSL runs on the CPU's SHA extensions.
+namespace TreeHash {
+    // Default leaf size for new manifests.
+    constexpr size_t leafSize = 1024 * 1024;
+
+    chunkhash_t root(off_t size, const std::vector<chunkhash_t> &leaves);
+    // Hashes the files at `paths` together on `pool`, reading each leaf with its own pread.
+    PxResult::Result<std::vector<chunkhash_t>> files(std::vector<std::string> paths, size_t leaf, WorkPool &pool);
+}
+
+// The signed list of a release's files, published beside the image as
+// <image>.manifest with a detached signature in <image>.manifest.sig.
+struct Manifest {
+    struct File {
+        off_t size;
+        chunkhash_t root;
+    };
+
+    static constexpr const char *suffix = ".manifest";
+    static constexpr const char *sigSuffix = ".manifest.sig";
+
+    size_t leaf = TreeHash::leafSize;
+    // by file name, without any directory
+    std::map<std::string, File> files;
+
+    // Reads the manifest in `text`, but only if `sig` is a valid signature
+    // of it by the public key in `keypath`; EBADMSG if not.
+    PxResult::Result<void> loadSigned(const std::string &text, const std::string &sig, std::string keypath);
+    PxResult::Result<void> save(std::string path);
+    // Checks the files `names` in `dir` against their entries, hashing all of them at once.
+    PxResult::Result<void> check(std::string dir, std::vector<std::string> names, size_t threads);
+};
+
+// Checks `sig` over `data` with the public key (PEM) in `keypath`. Ed25519
+// keys are what the repo tooling expects, but any key type OpenSSL can
+// verify with its default digest works.
+PxResult::Result<void> verifySignature(const std::string &data, const std::string &sig, std::string keypath);
+
+// Checks a download against its manifest entry while it arrives. Full
+// leaves are handed to a pool of threads, so hashing keeps up with any
+// link; final() puts the root together and compares it.
+class TreeHashVerifier : public PxDownload::StreamVerifier {
+private:
+    Manifest::File expected;
+    size_t leaf;
+    std::vector<chunkhash_t> leaves;
+    std::vector<unsigned char> current;
+    off_t seen = 0;
+    // last, so its workers are done before the leaves they write to go away
+    WorkPool pool;
+    void submit();
+public:
+    TreeHashVerifier(Manifest::File expected, size_t leaf, size_t threads);
+
+    PxResult::Result<void> update(const char *data, size_t count) override;
+    PxResult::Result<void> final() override;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef PXOS_WORKPOOL
+#define PXOS_WORKPOOL
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads sharing work through per-thread deques. Tasks
+// submitted by a worker go to the front of its own deque, so it keeps
+// working depth-first on what it just discovered. Idle workers steal from
+// the back of the others' deques.
+class WorkPool {
+public:
+    typedef std::function<void()> task_t;
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex idleLock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t queued = 0;
+    size_t pending = 0;
+    size_t next = 0;
+    bool stopping = false;
+
+    // the pool the calling thread works for, NULL outside any pool, and the
+    // index of the queue it owns there
+    inline static thread_local WorkPool *currentPool = NULL;
+    inline static thread_local size_t currentIndex = 0;
+
+    bool take(size_t self, task_t &out) {
+        for (size_t n = 0; n < queues.size(); n++) {
+            auto &q = *queues[(self + n) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty()) continue;
+            if (n == 0) {
+                out = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            } else {
+                out = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        currentPool = this;
+        currentIndex = self;
+        while (true) {
+            task_t task;
+            if (take(self, task)) {
+                {
+                    std::lock_guard<std::mutex> guard(idleLock);
+                    queued--;
+                }
+                task();
+                std::lock_guard<std::mutex> guard(idleLock);
+                if (--pending == 0) idle.notify_all();
+                else idle.notify_one();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(idleLock);
+            wake.wait(guard, [this]() { return queued > 0 || stopping; });
+            if (stopping && queued == 0) return;
+        }
+    }
+public:
+    WorkPool(size_t threads) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([this, i]() { run(i); });
+        }
+    }
+    ~WorkPool() {
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &i : workers) i.join();
+    }
+
+    size_t size() {
+        return workers.size();
+    }
+
+    void submit(task_t task) {
+        size_t target;
+        bool local = currentPool == this;
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+            target = local ? currentIndex : next++ % queues.size();
+            queued++;
+            pending++;
+        }
+        {
+            std::lock_guard<std::mutex> guard(queues[target]->lock);
+            if (local) queues[target]->tasks.push_front(std::move(task));
+            else queues[target]->tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    // Blocks until at most `limit` submitted tasks are unfinished; lets a
+    // producer outside the pool keep the backlog bounded.
+    void waitBelow(size_t limit) {
+        std::unique_lock<std::mutex> guard(idleLock);
+        idle.wait(guard, [&]() { return pending <= limit; });
+    }
+
+    // Blocks until every submitted task, including ones submitted by other tasks, is done.
+    void wait() {
+        waitBelow(0);
+    }
+};
+
+#endif
@@ -0,0 +1,935 @@
+#include <PxDownload.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxState.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace PxDownload {
+    static inline bool headerIs(const std::string &line, const char *name) {
+        size_t len = strlen(name);
+        return line.length() > len && line[len] == ':' && strncasecmp(line.c_str(), name, len) == 0;
+    }
+
+    // One share handle for the whole process, so a file, its signature and the version
+    // check all go over the same connection instead of each doing its own handshake.
+    struct SharedCache {
+        CURLSH *share;
+        std::mutex locks[CURL_LOCK_DATA_LAST];
+
+        SharedCache() {
+            curl_global_init(CURL_GLOBAL_DEFAULT);
+            share = curl_share_init();
+            if (share == NULL) return;
+            curl_lock_function lock = [](CURL *_, curl_lock_data data, curl_lock_access _2, void *_self) {
+                ((SharedCache*)_self)->locks[data].lock();
+            };
+            curl_unlock_function unlock = [](CURL *_, curl_lock_data data, void *_self) {
+                ((SharedCache*)_self)->locks[data].unlock();
+            };
+            curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+            curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+            curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        }
+        ~SharedCache() {
+            if (share != NULL) curl_share_cleanup(share);
+        }
+    };
+
+    void setupHandle(CURL *curl) {
+        static SharedCache cache;
+        if (cache.share != NULL) curl_easy_setopt(curl, CURLOPT_SHARE, cache.share);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        // wait to see whether a connection being set up can carry this request too, rather than opening another
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    void Timing::add(CURL *curl) {
+        curl_off_t namelookup = 0, connected = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connected);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+        long connects = 0;
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+        curl_off_t size = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+
+        dns += namelookup;
+        connect += std::max((curl_off_t)0, connected - namelookup);
+        // plain HTTP has no TLS handshake, and appconnect stays 0
+        if (appconnect > 0) tls += std::max((curl_off_t)0, appconnect - connected);
+        wait += std::max((curl_off_t)0, starttransfer - pretransfer);
+        transfer += std::max((curl_off_t)0, total - starttransfer);
+        bytes += size;
+        requests++;
+        connections += connects;
+    }
+
+    std::string Timing::repr() {
+        auto ms = [](curl_off_t us) { return std::to_string(us / 1000)+" ms"; };
+        return "dns "+ms(dns)+", connect "+ms(connect)+", tls "+ms(tls)+", first byte "+ms(wait)+
+            ", transfer "+ms(transfer)+" over "+std::to_string(requests)+" requests, "+std::to_string(connections)+" new connections";
+    }
+
+    // Bytes received on every interface except loopback, or -1 if they can't be read.
+    static curl_off_t networkReceived() {
+        std::ifstream dev("/proc/net/dev");
+        if (!dev) return -1;
+
+        curl_off_t total = 0;
+        std::string line;
+        while (std::getline(dev, line)) {
+            auto colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            if (PxFunction::trim(line.substr(0, colon)) == "lo") continue;
+            std::istringstream fields(line.substr(colon + 1));
+            curl_off_t rx = 0;
+            if (fields >> rx) total += rx;
+        }
+        return total;
+    }
+
+    Throttle::Throttle(Limits lim) : lim(lim), current(lim.rate) {
+        lastRefill = lastSample = std::chrono::steady_clock::now();
+        tokens = burst();
+    }
+
+    double Throttle::burst() {
+        // a quarter second's worth keeps the rate smooth without pausing on every callback
+        return std::max(current / 4., 64. * 1024.);
+    }
+
+    void Throttle::sample(std::chrono::steady_clock::time_point now) {
+        if (now - lastSample < std::chrono::milliseconds(sampleInterval) && sampledTotal >= 0) return;
+        double elapsed = std::chrono::duration<double>(now - lastSample).count();
+        curl_off_t total = networkReceived();
+        if (total < 0) return;
+
+        if (sampledTotal >= 0 && elapsed > 0) {
+            double ours = (received - sampledReceived) / elapsed;
+            double other = (total - sampledTotal) / elapsed - ours;
+            // protocol overhead on our own traffic shouldn't count as someone else's
+            bool busy = other > std::max((double)lim.idleThreshold, ours / 10);
+            current = busy ? (lim.rate > 0 ? std::min(lim.rate, lim.idleRate) : lim.idleRate) : lim.rate;
+            tokens = std::min(tokens, burst());
+        }
+        sampledTotal = total;
+        sampledReceived = received;
+        lastSample = now;
+    }
+
+    bool Throttle::admit(Segment *seg, size_t count) {
+        bool outranked = std::any_of(paused.begin(), paused.end(), [&](auto *i) {
+            return i->parent->priority > seg->parent->priority;
+        });
+        // the bucket may go into debt by one callback's worth, which the next refill pays off
+        if (outranked || (current > 0 && tokens <= 0)) {
+            paused.push_back(seg);
+            return false;
+        }
+        if (current > 0) tokens -= count;
+        received += count;
+        return true;
+    }
+
+    void Throttle::wake() {
+        auto now = std::chrono::steady_clock::now();
+        if (lim.idleOnly) sample(now);
+        double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+        lastRefill = now;
+        if (current > 0) tokens = std::min(tokens + current * elapsed, burst());
+
+        if (paused.empty()) return;
+        auto queue = std::move(paused);
+        paused.clear();
+        std::stable_sort(queue.begin(), queue.end(), [](auto *a, auto *b) {
+            return a->parent->priority > b->parent->priority;
+        });
+
+        // unpausing can deliver data straight away, which takes tokens and may pause it again
+        size_t i = 0;
+        for (; i < queue.size(); i++) {
+            if (current > 0 && tokens <= 0) break;
+            curl_easy_pause(queue[i]->curl, CURLPAUSE_CONT);
+        }
+        paused.insert(paused.end(), queue.begin() + i, queue.end());
+    }
+
+    long Throttle::wait() {
+        if (paused.empty()) return -1;
+        if (current <= 0 || tokens > 0) return 0;
+        return (long)std::ceil(-tokens * 1000. / current) + 1;
+    }
+
+    Segment::Segment(Subdownload *parent, Kind kind, curl_off_t offset, curl_off_t length)
+        : parent(parent), kind(kind), mirror(parent->mirror), offset(offset), length(length) {
+        curl = curl_easy_init();
+        if (curl == NULL) return;
+
+        setupHandle(curl);
+        curl_easy_setopt(curl, CURLOPT_URL, parent->sources[mirror].c_str());
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, this);
+
+        curl_write_callback wfunc = [](char *data, size_t _, size_t count, void *_current) -> size_t {
+            return ((Segment*)_current)->onwrite(data, count);
+        };
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, wfunc);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+
+        curl_write_callback hfunc = [](char *data, size_t _, size_t count, void *_current) -> size_t {
+            return ((Segment*)_current)->onheader(data, count);
+        };
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, hfunc);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+
+        if (kind == Probe) {
+            curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+            return;
+        }
+
+        if (kind == Range) {
+            auto range = std::to_string(offset)+"-"+std::to_string(offset+length-1);
+            curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+        } else if (offset > 0) {
+            // an open-ended range rather than CURLOPT_RESUME_FROM_LARGE, which makes curl
+            // bail out on the full 200 response we want when If-Range doesn't match
+            curl_easy_setopt(curl, CURLOPT_RANGE, (std::to_string(offset)+"-").c_str());
+        }
+
+        // if the file changed since we learned its validator, the server sends all of it instead of a range
+        auto valid = parent->validator();
+        if ((kind == Range || offset > 0) && !valid.empty()) {
+            headers = curl_slist_append(headers, ("If-Range: "+valid).c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        }
+    }
+
+    Segment::~Segment() {
+        if (curl != NULL) curl_easy_cleanup(curl);
+        if (headers != NULL) curl_slist_free_all(headers);
+    }
+
+    size_t Segment::onheader(char *data, size_t count) {
+        std::string line(data, count);
+        if (headerIs(line, "Accept-Ranges")) {
+            acceptRanges = PxFunction::trim(line.substr(14)) == "bytes";
+        } else if (headerIs(line, "ETag")) {
+            etag = PxFunction::trim(line.substr(5));
+        } else if (headerIs(line, "Last-Modified")) {
+            lastModified = PxFunction::trim(line.substr(14));
+        }
+        return count;
+    }
+
+    size_t Segment::onwrite(char *data, size_t count) {
+        if (discard) return count;
+        // curl hands the same data back once we unpause, so nothing may have been done with it yet
+        if (parent->throttle != NULL && !parent->throttle->admit(this, count)) return CURL_WRITEFUNC_PAUSE;
+        if (!checkedResponse) {
+            // a server that ignores our Range header would otherwise scribble the whole file at our offset
+            long response;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
+            if (kind == Whole && offset > 0 && response == 416) {
+                // we already have everything; finish() sorts this out, the body is just an error page
+                discard = true;
+            } else if (kind == Whole && offset > 0 && response == 200) {
+                // If-Range didn't match, so the file changed under us and what we kept is useless
+                parent->restart();
+                offset = 0;
+                written = 0;
+            } else if ((kind == Range || offset > 0) ? response != 206 : response != 200) {
+                result = PxResult::FResult("PxDownload::Segment::onwrite (unexpected response)", EINVAL);
+                retryable = true;
+                return 0;
+            }
+            if (kind == Whole) {
+                parent->etag = etag;
+                parent->lastModified = lastModified;
+            }
+            checkedResponse = true;
+            if (discard) return count;
+        }
+
+        if (length >= 0 && written + (curl_off_t)count > length) {
+            result = PxResult::FResult("PxDownload::Segment::onwrite (too much data)", EMSGSIZE);
+            retryable = true;
+            return 0;
+        }
+
+        size_t done = 0;
+        while (done < count) {
+            ssize_t res = pwrite(parent->fd, data + done, count - done, offset + written + done);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                result = PxResult::FResult("PxDownload::Segment::onwrite / pwrite", errno);
+                return 0;
+            }
+            done += res;
+        }
+
+        parent->feed(this, data, count);
+        written += count;
+        parent->addWritten(this, count);
+        return count;
+    }
+
+    void Segment::finish(CURLcode code) {
+        parent->timing.add(curl);
+        parent->mirrorTiming[mirror].add(curl);
+        if (result.eno) return;
+
+        // from here on, anything that goes wrong is down to the server or the network
+        retryable = true;
+        if (code != CURLE_OK) {
+            result = PxResult::FResult("PxDownload::Download::perform / curl_multi_perform", EINVAL);
+            return;
+        }
+
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
+
+        // resuming a file we already have completely
+        if (kind == Whole && offset > 0 && response == 416 && offset == parent->expected) return;
+
+        long want = (kind == Range || offset > 0) ? 206 : 200;
+        if (response != want) {
+            result = PxResult::FResult("PxDownload::Download::perform / curl_multi_perform", EINVAL);
+            return;
+        }
+
+        if (kind == Range && written != length) {
+            result = PxResult::FResult("PxDownload::Segment::finish (short range)", EIO);
+            return;
+        }
+        retryable = false;
+    }
+
+    Subdownload::~Subdownload() {
+        if (fd >= 0) close(fd);
+    }
+
+    PxResult::Result<void> Subdownload::bindOutput(std::string dest, bool resume) {
+        if (fd >= 0) close(fd);
+        this->dest = dest;
+        this->resume = resume;
+        // with only some ranges wanted, the rest of the file belongs to someone else
+        bool keep = resume || !wanted.empty();
+        fd = open(dest.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (keep ? 0 : O_TRUNC), 0644);
+        if (fd < 0) return PxResult::FResult("PxDownload::Subdownload::bindOutput / open", errno);
+
+        if (!resume) {
+            remove((dest+stateSuffix).c_str());
+            return PxResult::Null;
+        }
+
+        if (loadState().eno) {
+            // nothing trustworthy to resume from
+            restart();
+        }
+        return PxResult::Null;
+    }
+
+    PxResult::Result<void> Subdownload::loadState() {
+        auto res = PxState::fget(dest+stateSuffix);
+        PXASSERTM(res, "PxDownload::Subdownload::loadState");
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) return PxResult::FResult("PxDownload::Subdownload::loadState / fstat", errno);
+
+        std::string url;
+        saved.clear();
+        try {
+            for (auto &line : PxFunction::split(res.assert(), "\n")) {
+                auto eq = line.find('=');
+                if (eq == std::string::npos) continue;
+                auto key = line.substr(0, eq);
+                auto value = line.substr(eq+1);
+
+                if (key == "URL") url = value;
+                else if (key == "ETAG") etag = value;
+                else if (key == "LASTMODIFIED") lastModified = value;
+                else if (key == "SIZE") expected = std::stoll(value);
+                else if (key == "PART") {
+                    auto fields = PxFunction::split(value, ":");
+                    if (fields.size() != 3) continue;
+                    PartState part = { std::stoll(fields[0]), std::stoll(fields[1]), std::stoll(fields[2]) };
+                    // never trust bytes that aren't actually in the file
+                    part.written = std::max((curl_off_t)0, std::min(part.written, (curl_off_t)st.st_size - part.offset));
+                    saved.push_back(part);
+                }
+            }
+        } catch (std::exception &e) {
+            return PxResult::FResult("PxDownload::Subdownload::loadState (corrupt state)", EINVAL);
+        }
+
+        // the mirrors may have been ranked differently last time
+        if (std::find(sources.begin(), sources.end(), url) == sources.end() || validator().empty())
+            return PxResult::FResult("PxDownload::Subdownload::loadState (stale state)", ESTALE);
+
+        return PxResult::Null;
+    }
+
+    PxResult::Result<void> Subdownload::checkpoint() {
+        if (!resume) return PxResult::Null;
+        lastCheckpoint = stats.down;
+
+        // only record bytes once they are safely on disk
+        if (fdatasync(fd) != 0) return PxResult::FResult("PxDownload::Subdownload::checkpoint / fdatasync", errno);
+
+        std::string state = "URL="+source+"\n"
+            "ETAG="+etag+"\n"
+            "LASTMODIFIED="+lastModified+"\n"
+            "SIZE="+std::to_string(expected)+"\n";
+        auto addPart = [&](curl_off_t offset, curl_off_t length, curl_off_t written) {
+            state += "PART="+std::to_string(offset)+":"+std::to_string(length)+":"+std::to_string(written)+"\n";
+        };
+        for (auto &i : carried) addPart(i.offset, i.length, i.written);
+        for (auto &i : parts) {
+            if (i->kind != Segment::Probe) addPart(i->offset, i->length, i->written);
+        }
+
+        auto tmp = dest+stateSuffix+".new";
+        PXASSERTM(PxState::fput(tmp, state), "PxDownload::Subdownload::checkpoint");
+        if (rename(tmp.c_str(), (dest+stateSuffix).c_str()) != 0)
+            return PxResult::FResult("PxDownload::Subdownload::checkpoint / rename", errno);
+        return PxResult::Null;
+    }
+
+    void Subdownload::restart() {
+        if (fd >= 0 && ftruncate(fd, 0) != 0) {
+            PxLog::log.warn("Failed to truncate "+dest+": "+strerror(errno));
+        }
+        saved.clear();
+        carried.clear();
+        // whatever earlier requests wrote is gone too
+        for (auto &i : parts) i->written = 0;
+        etag = lastModified = "";
+        expected = -1;
+        stats.down = resumedBytes = lastCheckpoint = 0;
+        if (verified > 0 && verifier) {
+            // the verifier has already seen data we just threw away
+            result = PxResult::FResult("PxDownload::Subdownload::restart (file changed during verification)", ESTALE);
+        }
+    }
+
+    std::string Subdownload::validator() {
+        return etag.empty() ? lastModified : etag;
+    }
+
+    curl_off_t Subdownload::savedPrefix() {
+        auto sorted = saved;
+        std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) { return a.offset < b.offset; });
+
+        curl_off_t prefix = 0;
+        for (auto &i : sorted) {
+            if (i.offset > prefix) break;
+            prefix = std::max(prefix, i.offset + i.written);
+        }
+        return prefix;
+    }
+
+    Segment *Subdownload::newSegment(Segment::Kind kind, curl_off_t offset, curl_off_t length) {
+        parts.push_back(std::make_unique<Segment>(this, kind, offset, length));
+        outstanding++;
+        return parts.back().get();
+    }
+
+    // Starts a single stream, continuing after whatever contiguous data we already have.
+    Segment *Subdownload::resumeWhole() {
+        curl_off_t prefix = savedPrefix();
+        carried.clear();
+        saved.clear();
+        if (prefix > 0) carried.push_back({0, prefix, prefix});
+        stats.down = resumedBytes = lastCheckpoint = prefix;
+        return newSegment(Segment::Whole, prefix);
+    }
+
+    std::vector<Segment*> Subdownload::start() {
+        done = false;
+        result = PxResult::Null;
+        started = std::chrono::steady_clock::now();
+
+        if (fd < 0) {
+            result = PxResult::FResult("PxDownload::Subdownload::start (no output bound)", EBADF);
+            done = dirty = true;
+            return {};
+        }
+
+        if (!wanted.empty()) {
+            std::vector<Segment*> out;
+            stats.total = 0;
+            for (auto &i : wanted) {
+                out.push_back(newSegment(Segment::Range, i.offset, i.length));
+                stats.total += i.length;
+            }
+            return out;
+        }
+
+        if (segments > 1) return { newSegment(Segment::Probe) };
+        return { resumeWhole() };
+    }
+
+    std::vector<Segment*> Subdownload::planRanges(curl_off_t size) {
+        curl_off_t count = std::min((curl_off_t)segments, size / Download::minSegmentSize);
+        if (count < 2) return { newSegment(Segment::Whole) };
+
+        // reserve the space up front so every range can write straight to its offset
+        int err = fallocate(fd, 0, 0, size);
+        if (err != 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) err = ftruncate(fd, size);
+        if (err != 0) {
+            result = PxResult::FResult("PxDownload::Subdownload::planRanges / fallocate", errno);
+            return {};
+        }
+
+        expected = size;
+        stats.total = size;
+
+        std::vector<Segment*> out;
+        curl_off_t step = size / count;
+        for (curl_off_t i = 0; i < count; i++) {
+            curl_off_t off = i * step;
+            curl_off_t len = i == count-1 ? size - off : step;
+            out.push_back(newSegment(Segment::Range, off, len));
+        }
+        return out;
+    }
+
+    std::vector<Segment*> Subdownload::resumeRanges() {
+        std::vector<Segment*> out;
+        carried.clear();
+        stats.down = 0;
+        for (auto &i : saved) {
+            if (i.written > 0) {
+                carried.push_back({i.offset, i.written, i.written});
+                stats.down += i.written;
+            }
+            if (i.written < i.length) {
+                out.push_back(newSegment(Segment::Range, i.offset + i.written, i.length - i.written));
+            }
+        }
+        saved.clear();
+        stats.total = expected;
+        resumedBytes = lastCheckpoint = stats.down;
+        return out;
+    }
+
+    PxResult::Result<void> Subdownload::verify() {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return PxResult::FResult("PxDownload::Subdownload::verify / fstat", errno);
+        if (expected >= 0 && st.st_size != expected)
+            return PxResult::FResult("PxDownload::Subdownload::verify (size mismatch)", EIO);
+        if (fdatasync(fd) != 0) return PxResult::FResult("PxDownload::Subdownload::verify / fdatasync", errno);
+        return PxResult::Null;
+    }
+
+    bool Subdownload::failover(Segment *seg) {
+        if (!seg->retryable || result.eno) return false;
+        // a server that answers but can't do HEAD is handled by falling back to one stream
+        if (seg->kind == Segment::Probe && (seg->response == 405 || seg->response == 501)) return false;
+
+        // several requests can fail on the same mirror; only the first moves the download on
+        if (seg->mirror == mirror) {
+            if (mirror + 1 >= sources.size()) return false;
+            mirror++;
+            PxLog::log.warn("Switching "+source+" to "+sources[mirror]+" ("+seg->result.funcName+")");
+        }
+        return true;
+    }
+
+    // Picks up where a failed request left off, on whichever mirror is current now.
+    Segment *Subdownload::retry(Segment *seg) {
+        if (seg->kind == Segment::Probe) return newSegment(Segment::Probe);
+
+        if (seg->kind == Segment::Range) {
+            curl_off_t rest = seg->length - seg->written;
+            // the failed request now only claims what it actually wrote
+            seg->length = seg->written;
+            return newSegment(Segment::Range, seg->offset + seg->written, rest);
+        }
+
+        // without a validator, nothing tells us the next mirror has the same file to continue
+        if (validator().empty()) {
+            restart();
+            return newSegment(Segment::Whole);
+        }
+        return newSegment(Segment::Whole, seg->offset + seg->written);
+    }
+
+    std::vector<Segment*> Subdownload::segmentDone(Segment *seg) {
+        outstanding--;
+        dirty = true;
+        std::vector<Segment*> next;
+
+        if (seg->result.eno) {
+            if (failover(seg)) {
+                next.push_back(retry(seg));
+            } else if (seg->kind == Segment::Probe) {
+                // servers that can't answer HEAD can still serve the file as one stream
+                next.push_back(resumeWhole());
+            } else if (!result.eno) {
+                result = seg->result;
+            }
+        } else if (seg->kind == Segment::Probe) {
+            curl_off_t size = -1;
+            curl_easy_getinfo(seg->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+
+            bool unchanged = !saved.empty() && size == expected &&
+                (!seg->etag.empty() ? seg->etag == etag : (!seg->lastModified.empty() && seg->lastModified == lastModified));
+            bool rangedBefore = !saved.empty() && std::all_of(saved.begin(), saved.end(), [](auto &i) { return i.length >= 0; });
+
+            if (!unchanged) restart();
+            etag = seg->etag;
+            lastModified = seg->lastModified;
+
+            if (unchanged && rangedBefore && seg->acceptRanges) {
+                next = resumeRanges();
+            } else if (seg->acceptRanges && size > 0 && saved.empty()) {
+                next = planRanges(size);
+            } else {
+                next.push_back(resumeWhole());
+            }
+        } else if (seg->kind == Segment::Whole && seg->response != 416) {
+            curl_off_t size = -1;
+            curl_easy_getinfo(seg->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+            if (size >= 0) expected = seg->offset + size;
+        }
+
+        if (outstanding == 0 && next.empty()) {
+            if (!result.eno) result = verify();
+            done = true;
+            if (!result.eno) result = finalize();
+        }
+        if (resume && seg->kind != Segment::Probe) {
+            auto res = checkpoint();
+            if (res.eno) PxLog::log.warn("Failed to save download state for "+dest+": "+res.funcName+": "+strerror(res.eno));
+        }
+        return next;
+    }
+
+    void Subdownload::addWritten(Segment *seg, curl_off_t count) {
+        stats.down += count;
+        if (stats.total < 0 && seg->kind == Segment::Whole) {
+            curl_off_t size = -1;
+            curl_easy_getinfo(seg->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+            if (size >= 0) stats.total = seg->offset + size;
+        }
+        dirty = true;
+
+        if (resume && stats.down - lastCheckpoint >= checkpointInterval) {
+            auto res = checkpoint();
+            if (res.eno) PxLog::log.warn("Failed to save download state for "+dest+": "+res.funcName+": "+strerror(res.eno));
+        }
+    }
+
+    curl_off_t Subdownload::contiguous() {
+        std::vector<PartState> have = carried;
+        for (auto &i : parts) {
+            if (i->kind != Segment::Probe) have.push_back({i->offset, i->length, i->written});
+        }
+        std::sort(have.begin(), have.end(), [](auto &a, auto &b) { return a.offset < b.offset; });
+
+        curl_off_t prefix = 0;
+        for (auto &i : have) {
+            if (i.offset > prefix) break;
+            prefix = std::max(prefix, i.offset + i.written);
+        }
+        return prefix;
+    }
+
+    void Subdownload::feed(Segment *seg, const char *data, size_t count) {
+        if (!verifier || result.eno || !verifier->ready()) return;
+
+        curl_off_t pos = seg->offset + seg->written;
+        if (pos < verified || seg->offset > verified) return;
+        if (pos > verified) {
+            // this segment just became the front one; pick up what it wrote before that from disk
+            auto res = catchUp();
+            if (res.eno || pos != verified) {
+                if (res.eno) result = res;
+                return;
+            }
+        }
+
+        auto res = verifier->update(data, count);
+        if (res.eno) {
+            result = res;
+            return;
+        }
+        verified += count;
+    }
+
+    PxResult::Result<void> Subdownload::catchUp() {
+        if (!verifier || !verifier->ready()) return PxResult::Null;
+
+        curl_off_t upto = contiguous();
+        std::vector<char> buf;
+        while (verified < upto) {
+            if (buf.empty()) buf.resize(1024 * 1024);
+            size_t want = std::min((curl_off_t)buf.size(), upto - verified);
+            ssize_t res = pread(fd, buf.data(), want, verified);
+            if (res < 0 && errno == EINTR) continue;
+            if (res < 0) return PxResult::FResult("PxDownload::Subdownload::catchUp / pread", errno);
+            if (res == 0) return PxResult::FResult("PxDownload::Subdownload::catchUp / pread", EIO);
+
+            PXASSERTM(verifier->update(buf.data(), res), "PxDownload::Subdownload::catchUp");
+            verified += res;
+        }
+        return PxResult::Null;
+    }
+
+    PxResult::Result<void> Subdownload::finalize() {
+        if (!verifier || finalized || !done || result.eno || !verifier->ready()) return PxResult::Null;
+        finalized = true;
+
+        PXASSERTM(catchUp(), "PxDownload::Subdownload::finalize");
+        PXASSERTM(verifier->final(), "PxDownload::Subdownload::finalize");
+        return PxResult::Null;
+    }
+
+    void Subdownload::updateTask() {
+        if (tsk == NULL) return;
+
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        if (elapsed > 0) stats.speed = (stats.down - resumedBytes) / elapsed;
+
+        std::vector<std::string> strstats = {};
+
+        float spd = std::floor(stats.speed / 1024. / 1024. * 10.)/10.;
+        strstats.push_back(std::to_string(spd)+" MiB/s");
+
+        if (stats.total > 0) {
+            strstats.push_back(std::to_string((int)std::round((float)stats.down * 100. / (float)stats.total))+"%");
+        }
+
+        tsk->stats = PxFunction::join(strstats, ", ");
+        dirty = false;
+
+        // a file isn't finished until its verifier has seen all of it
+        if (done && (result.eno || !verifier || finalized)) {
+            if (result.eno) {
+                PxLog::log.completeTask(logid, PxLog::Fail);
+            } else {
+                PxLog::log.completeTask(logid, PxLog::Success);
+            }
+            tsk = NULL;
+        }
+    }
+
+    Fetcher::Fetcher() {
+        curl = curl_easy_init();
+        if (curl != NULL) setupHandle(curl);
+    }
+
+    Fetcher::~Fetcher() {
+        if (curl != NULL) curl_easy_cleanup(curl);
+        if (headers != NULL) curl_slist_free_all(headers);
+    }
+
+    PxResult::Result<Response> Fetcher::get(std::string url, std::string etag) {
+        if (curl == NULL) return PxResult::FResult("PxDownload::Fetcher::get / curl_easy_init", ENOMEM);
+
+        current = Response();
+        if (headers != NULL) curl_slist_free_all(headers);
+        headers = NULL;
+        if (!etag.empty()) headers = curl_slist_append(headers, ("If-None-Match: "+etag).c_str());
+
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+        curl_write_callback wfunc = [](char *data, size_t _, size_t count, void *_current) -> size_t {
+            auto *res = (Response*)_current;
+            // returning short makes curl abort the transfer
+            if (res->body.size() + count > maxBody) return 0;
+            res->body.append(data, count);
+            return count;
+        };
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, wfunc);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &current);
+
+        curl_write_callback hfunc = [](char *data, size_t _, size_t count, void *_current) -> size_t {
+            auto *res = (Response*)_current;
+            std::string line(data, count);
+            if (headerIs(line, "ETag")) {
+                res->etag = PxFunction::trim(line.substr(5));
+            } else if (headerIs(line, "Last-Modified")) {
+                res->lastModified = PxFunction::trim(line.substr(14));
+            }
+            return count;
+        };
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, hfunc);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &current);
+
+        CURLcode code = curl_easy_perform(curl);
+        if (code == CURLE_WRITE_ERROR && current.body.size() >= maxBody)
+            return PxResult::FResult("PxDownload::Fetcher::get (response too large)", EMSGSIZE);
+        if (code != CURLE_OK) return PxResult::FResult("PxDownload::Fetcher::get / curl_easy_perform", EINVAL);
+
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &current.status);
+        timing = Timing();
+        timing.add(curl);
+        if (logTimings) PxLog::log.info("Timing for "+url+": "+timing.repr());
+        return current;
+    }
+
+    Download::Download(size_t maxConcurrent) : maxConcurrent(maxConcurrent == 0 ? 1 : maxConcurrent) {
+        multi = curl_multi_init();
+        // several files from the same server can then share one HTTP/2 connection
+        if (multi != NULL) curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+
+    Download::~Download() {
+        curl_multi_cleanup(multi);
+    }
+
+    PxResult::Result<void> Download::perform() {
+        if (multi == NULL) return PxResult::FResult("PxDownload::Download::perform / curl_multi_init", ENOMEM);
+
+        std::deque<Segment*> pending;
+        size_t active = 0;
+
+        Throttle throttle(limits);
+        DEFER(detach_throttle, for (auto &i : downloads) i->throttle = NULL);
+
+        for (auto &i : downloads) {
+            i->initTask();
+            if (throttle.enabled()) i->throttle = &throttle;
+            for (auto seg : i->start()) pending.push_back(seg);
+        }
+        // signatures and the like are small and needed first, so they don't queue behind images
+        std::stable_sort(pending.begin(), pending.end(), [](auto *a, auto *b) {
+            return a->parent->priority > b->parent->priority;
+        });
+
+        PxJob::JobServer js;
+        js.AddJob(std::make_shared<PxJob::OscJob>(&PxLog::log));
+
+        auto lastDraw = std::chrono::steady_clock::now() - std::chrono::milliseconds(redrawInterval);
+        auto redraw = [&](bool force) {
+            auto now = std::chrono::steady_clock::now();
+            if (!force && now - lastDraw < std::chrono::milliseconds(redrawInterval)) return;
+            lastDraw = now;
+
+            js.tick();
+            for (auto &i : downloads) {
+                if (!i->dirty) continue;
+                i->updateTask();
+                if (onProgress) onProgress(*i);
+            }
+            PxLog::log.top();
+            PxLog::log.printTasks();
+        };
+
+        // hands a finished segment back to its download and queues whatever it needs next
+        auto complete = [&](Segment *seg) {
+            for (auto next : seg->parent->segmentDone(seg)) {
+                // follow-ups (ranges after a probe) go first so the file already in progress finishes sooner
+                pending.push_front(next);
+            }
+        };
+
+        int running = 0;
+        while (!pending.empty() || active > 0) {
+            // keep up to maxConcurrent transfers attached to the multi handle
+            while (!pending.empty() && active < maxConcurrent) {
+                auto next = pending.front();
+                pending.pop_front();
+
+                if (next->parent->result.eno) {
+                    // another part of this file already failed, don't bother
+                    next->result = next->parent->result;
+                    complete(next);
+                    continue;
+                }
+                if (next->curl == NULL) {
+                    next->result = PxResult::FResult("PxDownload::Download::perform / curl_easy_init", ENOMEM);
+                    complete(next);
+                    continue;
+                }
+                if (curl_multi_add_handle(multi, next->curl) != CURLM_OK) {
+                    next->result = PxResult::FResult("PxDownload::Download::perform / curl_multi_add_handle", EINVAL);
+                    complete(next);
+                    continue;
+                }
+                active++;
+            }
+
+            CURLMcode mres = curl_multi_perform(multi, &running);
+            if (mres != CURLM_OK) {
+                return PxResult::FResult("PxDownload::Download::perform / curl_multi_perform", EINVAL);
+            }
+
+            bool finished = false;
+            int queued;
+            CURLMsg *msg;
+            while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+                if (msg->msg != CURLMSG_DONE) continue;
+
+                Segment *seg;
+                CURL *easy = msg->easy_handle;
+                CURLcode code = msg->data.result;
+                curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char**)&seg);
+                curl_multi_remove_handle(multi, easy);
+                active--;
+
+                seg->finish(code);
+                complete(seg);
+                finished = true;
+            }
+
+            redraw(finished);
+            throttle.wake();
+
+            if (active == 0 && pending.empty()) break;
+            if (finished) continue;
+
+            // sleep until there is socket activity, curl's own timeout expires, it's time to
+            // redraw, or the bucket has refilled enough for a paused transfer to go on
+            long timeout = redrawInterval;
+            long refill = throttle.wait();
+            if (refill >= 0) timeout = std::min(timeout, refill);
+            mres = curl_multi_poll(multi, NULL, 0, timeout, NULL);
+            if (mres != CURLM_OK) {
+                return PxResult::FResult("PxDownload::Download::perform / curl_multi_poll", EINVAL);
+            }
+        }
+
+        // verifiers that were still waiting on another file (like a signature) can finish now
+        for (auto &i : downloads) {
+            if (!i->verifier || i->result.eno || i->finalized) continue;
+            if (!i->verifier->ready()) {
+                i->result = PxResult::FResult("PxDownload::Download::perform (could not verify "+i->source+")", ENODATA);
+            } else {
+                i->result = i->finalize();
+            }
+            i->dirty = true;
+        }
+
+        redraw(true);
+
+        if (logTimings) {
+            for (auto &i : downloads) {
+                if (i->timing.requests > 0) PxLog::log.info("Timing for "+i->source+": "+i->timing.repr());
+            }
+        }
+
+        for (auto &i : downloads) {
+            PXASSERT(i->result);
+        }
+
+        return PxResult::Null;
+    }
+}
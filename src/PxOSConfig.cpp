@@ -1,26 +1,51 @@
 #include <PxOSConfig.hpp>
 #include <PxDefer.hpp>
 #include <PxMount.hpp>
+#include <PxLog.hpp>
+#include <PxFunction.hpp>
+#include <trace.hpp>
 #include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <blkid/blkid.h>
+#include <rawimage.hpp>
+#include <mountplan.hpp>
 
 namespace PxOSConfig {
-    PxResult::Result<void> InitializeNew(conf &cfg) {
-        // Resolve the current opposite
-        auto opposite = mnt_resolve_spec(cfg.oppositePart().c_str(), NULL);
-        if (opposite == NULL)
-            return PxResult::FResult("PxOSConfig::SwitchPart (no such partition)", ENODEV);
-
-        DEFER(free_opposite, free(opposite));
+    // Whether the filesystem on `dev` can have a new image synced onto it:
+    // fsck must find it clean (or safely fix it) and it must carry the current layout version.
+    static bool reusable(std::string dev) {
+        TRACE(span, "fsck");
+        int status = system(("fsck.ext4 -p "+dev+" >/dev/null 2>&1").c_str());
+        // 0 is clean and 1 is fixed; anything else needs a human or a new filesystem
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) > 1) {
+            PxLog::log.info("The inactive root failed its filesystem check, recreating it.");
+            return false;
+        }
 
-        // Create a new filesystem
-        std::string cmd = "mkfs.ext4 -qF " + (std::string)opposite;
-        if (system(cmd.c_str()) != 0) {
-            return PxResult::FResult("PxOSConfig::InitializeNew / mkfs", EINVAL);
+        char dir[] = "/tmp/px-layout.XXXXXX";
+        if (mkdtemp(dir) == NULL) return false;
+        DEFER(remove_dir, rmdir(dir));
+        if (PxMount::Mount(dev, dir, "", "ro").eno) return false;
+        auto version = PxState::fget((std::string)dir+"/"+layoutFile);
+        // falls back to a lazy detach, so the device isn't left mounted under /tmp
+        auto umres = unmountPath(dir);
+        if (umres.eno) {
+            PxLog::log.warn("Failed to unmount the inactive root: "+umres.funcName+": "+strerror(umres.eno));
+            return false;
         }
 
-        // Get the UUID of the new partition and store it.
+        if (version.eno || PxFunction::trim(version.assert()) != std::to_string(layoutVersion)) {
+            PxLog::log.info("The inactive root has an older layout, recreating it.");
+            return false;
+        }
+        return true;
+    }
 
+    // Points the config at the opposite partition by the UUID of its new filesystem.
+    static PxResult::Result<void> recordUUID(conf &cfg, const char *opposite) {
         std::string uuid;
         {
             const char* uuidchr;
@@ -47,4 +72,57 @@ namespace PxOSConfig {
 
         return PxResult::Null;
     }
+
+    PxResult::Result<bool> InitializeNew(conf &cfg, bool incremental) {
+        // Resolve the current opposite
+        auto opposite = mnt_resolve_spec(cfg.oppositePart().c_str(), NULL);
+        if (opposite == NULL)
+            return PxResult::FResult("PxOSConfig::SwitchPart (no such partition)", ENODEV);
+
+        DEFER(free_opposite, free(opposite));
+
+        // Keep the existing filesystem if it's sound, since the image only has to be synced onto it then
+        if (incremental && reusable(opposite)) return true;
+
+        // Create a new filesystem
+        TRACE(mkfs, "mkfs");
+        std::string cmd = "mkfs.ext4 -qF " + (std::string)opposite;
+        if (system(cmd.c_str()) != 0) {
+            return PxResult::FResult("PxOSConfig::InitializeNew / mkfs", EINVAL);
+        }
+        mkfs.finish();
+
+        // Get the UUID of the new partition and store it.
+        PXASSERTM(recordUUID(cfg, opposite), "PxOSConfig::InitializeNew");
+        return false;
+    }
+
+    PxResult::Result<void> InitializeFromImage(conf &cfg, std::string image) {
+        auto opposite = mnt_resolve_spec(cfg.oppositePart().c_str(), NULL);
+        if (opposite == NULL)
+            return PxResult::FResult("PxOSConfig::InitializeFromImage (no such partition)", ENODEV);
+
+        DEFER(free_opposite, free(opposite));
+
+        PXASSERTM(writeRawImage(image, opposite), "PxOSConfig::InitializeFromImage");
+
+        // grow the filesystem to the partition, and give it a UUID of its own, since
+        // every root written from this image would otherwise share one
+        std::string dev = opposite;
+        // e2fsck exits with 1 after fixing something, which is fine here; for the others 1 is a failure
+        std::pair<std::string, int> cmds[] = {
+            { "e2fsck -fp "+dev+" >/dev/null", 1 },
+            { "resize2fs "+dev+" >/dev/null 2>&1", 0 },
+            { "tune2fs -U random "+dev+" >/dev/null", 0 },
+        };
+        for (auto &[cmd, worst] : cmds) {
+            TRACE(span, cmd.substr(0, cmd.find(' ')));
+            int status = system(cmd.c_str());
+            if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) > worst)
+                return PxResult::FResult("PxOSConfig::InitializeFromImage / system "+cmd.substr(0, cmd.find(' ')), EINVAL);
+        }
+
+        PXASSERTM(recordUUID(cfg, opposite), "PxOSConfig::InitializeFromImage");
+        return PxResult::Null;
+    }
 }
\ No newline at end of file
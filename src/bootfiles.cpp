@@ -0,0 +1,425 @@
+#include <bootfiles.hpp>
+#include <delta.hpp>
+#include <recurse.hpp>
+#include <trace.hpp>
+#include <workpool.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxLog.hpp>
+#include <PxState.hpp>
+#include <blkid/blkid.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// entries of each kind kept in the cache; one per root partition
+static constexpr size_t keepEntries = 2;
+// name of the file describing a cache entry
+static constexpr const char *entryName = "entry";
+// files mkinitcpio writes into an image itself, so the root's copies say
+// nothing about it; /etc/fstab, for one, is rewritten by every update
+static const std::vector<std::string> generatedFiles = {
+    "etc/fstab", "etc/mtab", "etc/ld.so.cache", "etc/ld.so.conf",
+    "etc/passwd", "etc/group", "etc/shadow", "etc/nsswitch.conf",
+};
+
+static std::string quote(const std::string &str) {
+    std::string out = "'";
+    for (char c : str) {
+        if (c == '\'') out += "'\\''";
+        else out += c;
+    }
+    return out+"'";
+}
+
+static PxResult::Result<std::string> readAll(int fd) {
+    std::string out;
+    char buf[65536];
+    while (true) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0) return PxResult::FResult("readAll / read", errno);
+        if (len == 0) return out;
+        out.append(buf, len);
+    }
+}
+
+static PxResult::Result<void> copyTo(std::string from, std::string to) {
+    // fcopy keeps the mode; mkinitcpio makes images 0600, since they can hold keyfiles
+    struct stat st;
+    if (stat(from.c_str(), &st) != 0) return PxResult::FResult("copyTo / stat "+from, errno);
+
+    // written beside the target and renamed over it, so a crash never leaves half an image
+    auto tmp = to+".px-tmp";
+    PXASSERTM(fcopy(from, tmp, st), "copyTo");
+
+    int out = open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+    if (out < 0) return PxResult::FResult("copyTo / open "+tmp, errno);
+    DEFER(close_out, close(out));
+    PXASSERTM(PxFunction::wrap("fsync", fsync(out)), "copyTo");
+    close_out.finish();
+    PXASSERTM(PxFunction::wrap("rename", rename(tmp.c_str(), to.c_str())), "copyTo");
+    return PxResult::Null;
+}
+
+// Appends a line per entry of the tree at `path` to `out`, in a fixed
+// order: its path, type and either its contents' hash or, with
+// `metadataOnly`, its size and mtime. A missing path gets a line too.
+static PxResult::Result<void> describe(std::string &out, std::string path, bool metadataOnly) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        out += path+"\tmissing\n";
+        return PxResult::Null;
+    }
+
+    std::map<std::string, std::string> lines;
+    PXASSERTM(fswalk(path, [&](const fsentry_t &entry) -> PxResult::Result<void> {
+        auto &st = entry.st;
+        std::string line;
+        if (S_ISDIR(st.st_mode)) {
+            line = "dir";
+        } else if (S_ISLNK(st.st_mode)) {
+            char buf[4096];
+            ssize_t len = readlinkat(entry.dirfd, entry.name, buf, sizeof(buf));
+            if (len < 0) return PxResult::FResult("describe / readlinkat "+entry.rel, errno);
+            line = "link "+std::string(buf, len);
+        } else if (metadataOnly || !S_ISREG(st.st_mode)) {
+            line = std::to_string(st.st_mode)+" "+std::to_string(st.st_size)+" "+
+                std::to_string(st.st_mtim.tv_sec)+"."+std::to_string(st.st_mtim.tv_nsec);
+        } else {
+            int fd = openat(entry.dirfd, entry.name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) return PxResult::FResult("describe / openat "+entry.rel, errno);
+            DEFER(close_fd, close(fd));
+            auto data = readAll(fd);
+            PXASSERTM(data, "describe");
+            line = std::to_string(st.st_mode)+" "+Chunker::hex(Chunker::hash((const unsigned char*)data.assert().data(), data.assert().size()));
+        }
+        lines[entry.rel] = line;
+        return PxResult::Null;
+    }, [](const fsentry_t &) -> PxResult::Result<void> { return PxResult::Null; }), "describe "+path);
+
+    for (auto &[rel, line] : lines) out += path+"/"+rel+"\t"+line+"\n";
+    return PxResult::Null;
+}
+
+static std::string keyOf(const std::string &description) {
+    return Chunker::hex(Chunker::hash((const unsigned char*)description.data(), description.size()));
+}
+
+// The filesystem UUID of `spec`, which is a device or a UUID=/LABEL= tag; empty if it has none.
+static std::string fsUUID(std::string spec) {
+    char *dev = blkid_evaluate_spec(spec.c_str(), NULL);
+    if (dev == NULL) return "";
+    DEFER(free_dev, free(dev));
+
+    blkid_probe probe = blkid_new_probe_from_filename(dev);
+    if (probe == NULL) return "";
+    DEFER(free_probe, blkid_free_probe(probe));
+
+    const char *uuid;
+    size_t len;
+    if (blkid_do_probe(probe) != 0 || blkid_probe_lookup_value(probe, "UUID", &uuid, &len) != 0 || len < 2) return "";
+    return std::string(uuid, len - 1);
+}
+
+// Runs `cmd` and returns what it wrote to stdout.
+static PxResult::Result<std::string> capture(std::string cmd) {
+    FILE *pipe = popen(cmd.c_str(), "r");
+    if (pipe == NULL) return PxResult::FResult("capture / popen", errno);
+    auto out = readAll(fileno(pipe));
+    int status = pclose(pipe);
+    PXASSERTM(out, "capture");
+    if (status != 0) return PxResult::FResult("capture ("+cmd+")", EINVAL);
+    return out.assert();
+}
+
+struct preset_t {
+    std::string name;
+    // cache key, or empty if what the preset builds can't be cached
+    std::string key;
+    // paths inside the root of the images it builds
+    std::vector<std::string> images;
+};
+
+// Reads which images a preset builds. Only plain initramfs images are
+// cached; a preset building a UKI, or with paths worked out by the shell,
+// is always regenerated.
+static bool readPreset(const std::string &text, preset_t &preset) {
+    std::vector<std::string> names;
+    std::map<std::string, std::string> values;
+    for (auto line : PxFunction::split(text, "\n")) {
+        line = PxFunction::trim(line);
+        auto eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == std::string::npos) continue;
+        auto key = line.substr(0, eq);
+        auto value = line.substr(eq+1);
+        value.erase(std::remove_if(value.begin(), value.end(), [](char c) { return c == '"' || c == '\'' || c == '(' || c == ')'; }), value.end());
+
+        if (key == "PRESETS") {
+            for (auto &i : PxFunction::split(value, " ")) if (!i.empty()) names.push_back(i);
+        } else {
+            values[key] = value;
+        }
+    }
+
+    for (auto &i : names) {
+        if (values.count(i+"_uki") && !values[i+"_uki"].empty()) return false;
+        auto &image = values[i+"_image"];
+        if (image.empty() || image[0] != '/' || image.find('$') != std::string::npos) return false;
+        preset.images.push_back(image);
+    }
+    return !preset.images.empty();
+}
+
+// Drops all but the newest entries whose names start with `prefix`.
+static void evict(std::string cacheDir, std::string prefix) {
+    std::vector<std::pair<int64_t, std::string>> found;
+    std::error_code ec;
+    for (auto &i : std::filesystem::directory_iterator(cacheDir, ec)) {
+        auto name = i.path().filename().string();
+        struct stat st;
+        // the key has to make up the rest of the name, or "linux-" would also match "linux-lts-"
+        if (!PxFunction::startsWith(name, prefix) || name.size() != prefix.size() + 64) continue;
+        if (stat(i.path().c_str(), &st) != 0) continue;
+        found.push_back({ (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, i.path() });
+    }
+    std::sort(found.begin(), found.end(), [](auto &a, auto &b) { return a.first > b.first; });
+    for (size_t i = keepEntries; i < found.size(); i++) std::filesystem::remove_all(found[i].second, ec);
+}
+
+// Copies the files of the entry at `dir` into `root`, if it is there and
+// the sources it was built from are unchanged; false on a miss.
+static bool restore(std::string root, std::string dir) {
+    auto res = PxState::fget(dir+"/"+entryName);
+    if (res.eno) return false;
+
+    std::vector<std::string> files;
+    try {
+        for (auto &line : PxFunction::split(res.assert(), "\n")) {
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            auto key = line.substr(0, eq);
+            auto value = line.substr(eq+1);
+
+            if (key == "FILE") {
+                files.push_back(value);
+            } else if (key == "SOURCE") {
+                // SIZE:MTIME:PATH, with the path last since it may have colons
+                auto fields = PxFunction::split(value, ":");
+                if (fields.size() < 3) return false;
+                std::vector<std::string> rest(fields.begin() + 2, fields.end());
+                auto path = PxFunction::join(rest, ":");
+                // entries made before these were left out still list them
+                if (PxFunction::contains(generatedFiles, path)) continue;
+                struct stat st;
+                if (lstat((root+"/"+path).c_str(), &st) != 0) return false;
+                if (st.st_size != std::stoll(fields[0]) || st.st_mtime != std::stoll(fields[1])) return false;
+            }
+        }
+    } catch (std::exception &e) {
+        return false;
+    }
+    if (files.empty()) return false;
+
+    for (auto &i : files) {
+        auto copyres = copyTo(dir+"/"+std::filesystem::path(i).filename().string(), root+i);
+        if (copyres.eno) {
+            PxLog::log.warn("Failed to restore "+i+" from the boot cache: "+copyres.funcName+": "+strerror(copyres.eno));
+            return false;
+        }
+    }
+    // most recently used entries are the ones kept
+    utimensat(AT_FDCWD, dir.c_str(), NULL, 0);
+    return true;
+}
+
+// Keeps `files` (paths inside `root`) in the entry at `dir`, along with
+// `sources`, the files in the root they were made from.
+static PxResult::Result<void> store(std::string root, std::string dir, const std::vector<std::string> &files, const std::vector<std::string> &sources) {
+    // built beside the entry and renamed into place, so a half-written one is never used
+    auto tmp = dir+".px-tmp";
+    std::error_code ec;
+    std::filesystem::remove_all(tmp, ec);
+    PXASSERTM(PxFunction::wrap("mkdir", mkdir(tmp.c_str(), 0700)), "store");
+    DEFER(remove_tmp, std::filesystem::remove_all(tmp, ec));
+
+    std::string entry;
+    for (auto &i : files) {
+        PXASSERTM(copyTo(root+i, tmp+"/"+std::filesystem::path(i).filename().string()), "store");
+        entry += "FILE="+i+"\n";
+    }
+    for (auto &i : sources) {
+        struct stat st;
+        if (lstat((root+"/"+i).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        entry += "SOURCE="+std::to_string(st.st_size)+":"+std::to_string(st.st_mtime)+":"+i+"\n";
+    }
+    PXASSERTM(PxState::fput(tmp+"/"+entryName, entry), "store");
+
+    std::filesystem::remove_all(dir, ec);
+    PXASSERTM(PxFunction::wrap("rename", rename(tmp.c_str(), dir.c_str())), "store");
+    remove_tmp.cancel();
+    return PxResult::Null;
+}
+
+// The files an initramfs was built from, as paths inside the root.
+static PxResult::Result<std::vector<std::string>> listImage(std::string root, std::string image) {
+    auto res = capture("chroot "+quote(root)+" lsinitcpio "+quote(image)+" 2>/dev/null");
+    PXASSERTM(res, "listImage");
+    std::vector<std::string> out;
+    for (auto &line : PxFunction::split(res.assert(), "\n")) {
+        size_t start = line.find_first_not_of("./");
+        if (start == std::string::npos) continue;
+        auto path = line.substr(start);
+        if (!PxFunction::contains(generatedFiles, path)) out.push_back(path);
+    }
+    return out;
+}
+
+static PxResult::Result<void> generateInitramfs(std::string root, std::string cacheDir) {
+    std::vector<preset_t> presets;
+    std::error_code ec;
+    for (auto &i : std::filesystem::directory_iterator(root+"/etc/mkinitcpio.d", ec)) {
+        if (i.path().extension() != ".preset") continue;
+        presets.push_back({ .name = i.path().stem() });
+    }
+    std::sort(presets.begin(), presets.end(), [](auto &a, auto &b) { return a.name < b.name; });
+
+    std::vector<preset_t*> build;
+    if (!cacheDir.empty()) {
+        TRACE(span, "initramfs cache key");
+        // what every image depends on; the module tree is too big to read, but its metadata changes with it
+        std::string common;
+        for (auto &i : {"/etc/mkinitcpio.conf", "/etc/mkinitcpio.conf.d", "/etc/initcpio", "/usr/lib/initcpio", "/usr/bin/mkinitcpio"})
+            PXASSERTM(describe(common, root+i, false), "generateInitramfs");
+        PXASSERTM(describe(common, root+"/usr/lib/modules", true), "generateInitramfs");
+        std::vector<std::string> kernels;
+        for (auto &i : std::filesystem::directory_iterator(root+"/boot", ec)) {
+            if (PxFunction::startsWith(i.path().filename().string(), "vmlinuz")) kernels.push_back(i.path());
+        }
+        std::sort(kernels.begin(), kernels.end());
+        for (auto &i : kernels) PXASSERTM(describe(common, i, false), "generateInitramfs");
+
+        for (auto &i : presets) {
+            auto path = root+"/etc/mkinitcpio.d/"+i.name+".preset";
+            auto text = PxState::fget(path);
+            if (text.eno || !readPreset(text.assert(), i)) continue;
+            auto description = common;
+            PXASSERTM(describe(description, path, false), "generateInitramfs");
+            i.key = keyOf(description);
+        }
+    }
+
+    for (auto &i : presets) {
+        if (!i.key.empty() && restore(root, cacheDir+"/initramfs-"+i.name+"-"+i.key)) {
+            PxLog::log.info("Reusing the cached initramfs for "+i.name+".");
+            continue;
+        }
+        build.push_back(&i);
+    }
+    if (build.empty()) return PxResult::Null;
+
+    TRACE(span, "mkinitcpio");
+    // each run works in its own temporary directory, so presets don't get in each other's way
+    std::vector<int> status(build.size());
+    {
+        WorkPool pool(build.size());
+        for (size_t i = 0; i < build.size(); i++) {
+            pool.submit([&, i]() {
+                status[i] = system(("chroot "+quote(root)+" mkinitcpio -p "+quote(build[i]->name)+" >/dev/null").c_str());
+            });
+        }
+        pool.wait();
+    }
+    for (size_t i = 0; i < build.size(); i++) {
+        if (status[i] != 0) return PxResult::FResult("generateInitramfs / mkinitcpio -p "+build[i]->name, EINVAL);
+    }
+    span.finish();
+
+    for (auto *i : build) {
+        if (i->key.empty()) continue;
+
+        std::vector<std::string> sources;
+        bool complete = true;
+        for (auto &image : i->images) {
+            auto res = listImage(root, image);
+            if (res.eno) {
+                complete = false;
+                break;
+            }
+            auto listed = res.assert();
+            sources.insert(sources.end(), listed.begin(), listed.end());
+        }
+        // without knowing what went into it, the image can't be told apart from a stale one later
+        if (!complete) continue;
+        std::sort(sources.begin(), sources.end());
+        sources.erase(std::unique(sources.begin(), sources.end()), sources.end());
+
+        auto prefix = cacheDir+"/initramfs-"+i->name+"-";
+        auto res = store(root, prefix+i->key, i->images, sources);
+        if (res.eno) PxLog::log.warn("Failed to cache the initramfs for "+i->name+": "+res.funcName+": "+strerror(res.eno));
+        evict(cacheDir, "initramfs-"+i->name+"-");
+    }
+    return PxResult::Null;
+}
+
+static PxResult::Result<void> generateGrubConfig(std::string root, std::string rootDevice, std::string cacheDir) {
+    static const std::string config = "/boot/grub/grub.cfg";
+
+    std::string key;
+    auto uuid = fsUUID(rootDevice);
+    // grub.cfg finds the root by UUID, so without one it can't be reused
+    if (!cacheDir.empty() && !uuid.empty()) {
+        TRACE(span, "grub cache key");
+        std::string description = "ROOT="+uuid+"\n";
+        for (auto &i : {"/etc/default/grub", "/etc/grub.d", "/usr/share/grub/grub-mkconfig_lib", "/usr/bin/grub-mkconfig"})
+            PXASSERTM(describe(description, root+i, false), "generateGrubConfig");
+
+        // the scripts only look at which kernels and images are there, not at what's in them
+        std::vector<std::string> names;
+        std::error_code ec;
+        for (auto &i : std::filesystem::directory_iterator(root+"/boot", ec)) {
+            if (!i.is_directory(ec)) names.push_back(i.path().filename());
+        }
+        std::sort(names.begin(), names.end());
+        for (auto &i : names) description += "/boot/"+i+"\n";
+        key = keyOf(description);
+
+        if (restore(root, cacheDir+"/grub-"+key)) {
+            PxLog::log.info("Reusing the cached GRUB config.");
+            return PxResult::Null;
+        }
+    }
+
+    TRACE(span, "grub-mkconfig");
+    if (system(("chroot "+quote(root)+" grub-mkconfig -o "+config+" >/dev/null").c_str()) != 0)
+        return PxResult::FResult("generateGrubConfig / grub-mkconfig", EINVAL);
+    span.finish();
+
+    if (key.empty()) return PxResult::Null;
+    auto res = store(root, cacheDir+"/grub-"+key, { config }, {});
+    if (res.eno) PxLog::log.warn("Failed to cache the GRUB config: "+res.funcName+": "+strerror(res.eno));
+    evict(cacheDir, "grub-");
+    return PxResult::Null;
+}
+
+PxResult::Result<void> generateBootFiles(std::string root, std::string rootDevice, std::string cacheDir, bool grub) {
+    if (!cacheDir.empty()) {
+        auto mkdir_res = PxFunction::wrap("mkdir", mkdir(cacheDir.c_str(), 0700));
+        if (mkdir_res.eno != EEXIST && mkdir_res.eno) {
+            PxLog::log.warn("Not caching boot files: "+cacheDir+": "+strerror(mkdir_res.eno));
+            cacheDir = "";
+        }
+    }
+
+    // GRUB lists the images, so they have to be in place first
+    PXASSERTM(generateInitramfs(root, cacheDir), "generateBootFiles");
+    if (grub) PXASSERTM(generateGrubConfig(root, rootDevice, cacheDir), "generateBootFiles");
+    return PxResult::Null;
+}
@@ -0,0 +1,217 @@
+#include <chunkcache.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxLog.hpp>
+#include <PxState.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fcntl.h>
+#include <unordered_set>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string ChunkCache::pathOf(const std::string &hex) {
+    return dir+"/"+hex.substr(0, 2)+"/"+hex;
+}
+
+void ChunkCache::drop(const std::string &hex) {
+    auto it = entries.find(hex);
+    if (it == entries.end()) return;
+    remove(pathOf(hex).c_str());
+    total -= it->second.length;
+    entries.erase(it);
+    dirty = true;
+}
+
+PxResult::Result<void> ChunkCache::open() {
+    if (!enabled()) return PxResult::Null;
+
+    auto mkdir_res = PxFunction::wrap("mkdir", mkdir(dir.c_str(), 0700));
+    if (mkdir_res.eno != EEXIST) PXASSERTM(mkdir_res, "ChunkCache::open");
+
+    entries.clear();
+    total = 0;
+    auto res = PxState::fget(dir+"/"+indexName);
+    // without an index, whatever chunk files are there are taken in below
+    if (!res.eno) {
+        try {
+            for (auto &line : PxFunction::split(res.assert(), "\n")) {
+                auto eq = line.find('=');
+                if (eq == std::string::npos) continue;
+                auto key = line.substr(0, eq);
+                auto value = line.substr(eq+1);
+
+                if (key == "CLOCK") clock = std::stoull(value);
+                else if (key == "CHUNK") {
+                    auto fields = PxFunction::split(value, ":");
+                    if (fields.size() != 3 || fields[0].length() != 64) continue;
+                    entry_t entry = { std::stoull(fields[1]), std::stoull(fields[2]) };
+                    entries[fields[0]] = entry;
+                    total += entry.length;
+                }
+            }
+        } catch (std::exception &e) {
+            PxLog::log.warn("Ignoring corrupt chunk cache index in "+dir);
+            entries.clear();
+            total = 0;
+        }
+    }
+    reconcile();
+
+    // the limit may have shrunk since the last run
+    evict();
+    return PxResult::Null;
+}
+
+void ChunkCache::reconcile() {
+    std::unordered_set<std::string> present;
+    std::error_code ec;
+    for (auto &sub : std::filesystem::directory_iterator(dir, ec)) {
+        auto subname = sub.path().filename().string();
+        if (subname.size() != 2 || !sub.is_directory(ec)) continue;
+        for (auto &file : std::filesystem::directory_iterator(sub.path(), ec)) {
+            auto hex = file.path().filename().string();
+            auto size = file.file_size(ec);
+            chunkhash_t hash;
+            bool valid = !ec && Chunker::fromHex(hex, hash) && hex.substr(0, 2) == subname && size > 0 && size <= Chunker::maxChunk;
+            auto it = entries.find(hex);
+            if (valid && it != entries.end() && it->second.length == size) {
+                present.insert(hex);
+                continue;
+            }
+
+            // written before a crash, or while the index was missing: the data is
+            // checked when it's read anyway, so it's kept, as the first to go
+            if (valid && it == entries.end()) {
+                entries[hex] = { size, 0 };
+                total += size;
+                present.insert(hex);
+                dirty = true;
+                continue;
+            }
+            // half-written, misnamed, or not the size the index says
+            if (it != entries.end()) {
+                total -= it->second.length;
+                entries.erase(it);
+            }
+            std::filesystem::remove(file.path(), ec);
+            dirty = true;
+        }
+    }
+
+    // and entries whose file is gone are forgotten
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (present.count(it->first)) {
+            it++;
+            continue;
+        }
+        total -= it->second.length;
+        it = entries.erase(it);
+        dirty = true;
+    }
+}
+
+bool ChunkCache::get(const chunkhash_t &hash, size_t length, std::vector<unsigned char> &buf) {
+    auto hex = Chunker::hex(hash);
+    auto it = entries.find(hex);
+    if (it == entries.end() || it->second.length != length) return false;
+
+    int fd = ::open(pathOf(hex).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        drop(hex);
+        return false;
+    }
+    DEFER(close_fd, close(fd));
+
+    buf.resize(length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t res = read(fd, buf.data() + done, length - done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) break;
+        done += res;
+    }
+    if (done != length || Chunker::hash(buf.data(), length) != hash) {
+        PxLog::log.warn("Dropping damaged chunk "+hex+" from the cache");
+        drop(hex);
+        return false;
+    }
+
+    it->second.used = ++clock;
+    dirty = true;
+    return true;
+}
+
+PxResult::Result<void> ChunkCache::put(const chunkhash_t &hash, const std::vector<unsigned char> &data) {
+    if (!enabled() || (off_t)data.size() > limit) return PxResult::Null;
+
+    auto hex = Chunker::hex(hash);
+    auto it = entries.find(hex);
+    if (it != entries.end()) {
+        it->second.used = ++clock;
+        dirty = true;
+        return PxResult::Null;
+    }
+
+    auto sub = dir+"/"+hex.substr(0, 2);
+    auto mkdir_res = PxFunction::wrap("mkdir", mkdir(sub.c_str(), 0700));
+    if (mkdir_res.eno != EEXIST) PXASSERTM(mkdir_res, "ChunkCache::put");
+
+    // written under a temporary name so a crash never leaves a short chunk behind its real name
+    auto path = pathOf(hex);
+    auto tmp = path+".new";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return PxResult::FResult("ChunkCache::put / open", errno);
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t res = write(fd, data.data() + done, data.size() - done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) {
+            int err = errno;
+            close(fd);
+            remove(tmp.c_str());
+            return PxResult::FResult("ChunkCache::put / write", err);
+        }
+        done += res;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) != 0) return PxResult::FResult("ChunkCache::put / rename", errno);
+
+    entries[hex] = { data.size(), ++clock };
+    total += data.size();
+    dirty = true;
+    evict();
+    return PxResult::Null;
+}
+
+void ChunkCache::evict() {
+    if (total <= limit) return;
+
+    // go a little below the limit so the next few puts don't each have to sort everything again
+    off_t target = limit - limit / 10;
+    std::vector<std::pair<uint64_t, std::string>> order;
+    for (auto &i : entries) order.push_back({ i.second.used, i.first });
+    std::sort(order.begin(), order.end());
+
+    for (auto &i : order) {
+        if (total <= target) break;
+        drop(i.second);
+    }
+}
+
+PxResult::Result<void> ChunkCache::save() {
+    if (!enabled() || !dirty) return PxResult::Null;
+
+    std::string out = "CLOCK="+std::to_string(clock)+"\n";
+    for (auto &i : entries) {
+        out += "CHUNK="+i.first+":"+std::to_string(i.second.length)+":"+std::to_string(i.second.used)+"\n";
+    }
+
+    auto tmp = dir+"/"+indexName+".new";
+    PXASSERTM(PxState::fput(tmp, out), "ChunkCache::save");
+    if (rename(tmp.c_str(), (dir+"/"+indexName).c_str()) != 0)
+        return PxResult::FResult("ChunkCache::save / rename", errno);
+    dirty = false;
+    return PxResult::Null;
+}
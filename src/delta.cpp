@@ -0,0 +1,387 @@
+#include <delta.hpp>
+#include <chunkcache.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxLog.hpp>
+#include <PxState.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+
+namespace Chunker {
+    // a boundary is wherever these bits of the rolling hash are all zero, which
+    // happens once every 64KiB on average
+    static constexpr uint64_t boundaryMask = 0xffffULL << 48;
+
+    // random values for each byte; fixed so every build cuts at the same places
+    static const std::array<uint64_t, 256> &gear() {
+        static std::array<uint64_t, 256> table = []() {
+            std::array<uint64_t, 256> out;
+            uint64_t state = 0x70786f732d636463ULL;
+            for (auto &i : out) {
+                // splitmix64
+                uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                i = z ^ (z >> 31);
+            }
+            return out;
+        }();
+        return table;
+    }
+
+    // length of the chunk starting at `data`; `count` is only below maxChunk at the end of the stream
+    static size_t boundary(const unsigned char *data, size_t count) {
+        if (count <= minChunk) return count;
+        size_t end = std::min(count, maxChunk);
+        auto &table = gear();
+
+        uint64_t h = 0;
+        for (size_t i = minChunk; i < end; i++) {
+            h = (h << 1) + table[data[i]];
+            if ((h & boundaryMask) == 0) return i + 1;
+        }
+        return end;
+    }
+
+    chunkhash_t hash(const unsigned char *data, size_t count) {
+        chunkhash_t out;
+        EVP_Digest(data, count, out.data(), NULL, EVP_sha256(), NULL);
+        return out;
+    }
+
+    bool fromHex(const std::string &str, chunkhash_t &out) {
+        if (str.length() != out.size() * 2) return false;
+        auto digit = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            return -1;
+        };
+        for (size_t i = 0; i < out.size(); i++) {
+            int hi = digit(str[i*2]), lo = digit(str[i*2+1]);
+            if (hi < 0 || lo < 0) return false;
+            out[i] = hi << 4 | lo;
+        }
+        return true;
+    }
+
+    std::string hex(const chunkhash_t &hash) {
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (auto i : hash) {
+            out += digits[i >> 4];
+            out += digits[i & 15];
+        }
+        return out;
+    }
+
+    PxResult::Result<void> scan(int fd, std::function<bool(off_t offset, const unsigned char *data, size_t count)> onchunk) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        std::vector<unsigned char> buf(32 * maxChunk);
+        size_t have = 0;
+        off_t offset = 0;
+        bool eof = false;
+
+        while (!eof || have > 0) {
+            while (!eof && have < buf.size()) {
+                ssize_t res = read(fd, buf.data() + have, buf.size() - have);
+                if (res < 0 && errno == EINTR) continue;
+                if (res < 0) return PxResult::FResult("Chunker::scan / read", errno);
+                if (res == 0) eof = true;
+                have += res;
+            }
+
+            size_t pos = 0;
+            while (have - pos >= maxChunk || (eof && pos < have)) {
+                size_t len = boundary(buf.data() + pos, have - pos);
+                if (!onchunk(offset, buf.data() + pos, len)) return PxResult::Null;
+                pos += len;
+                offset += len;
+            }
+
+            memmove(buf.data(), buf.data() + pos, have - pos);
+            have -= pos;
+        }
+        return PxResult::Null;
+    }
+}
+
+PxResult::Result<void> ChunkIndex::load(std::string path) {
+    auto res = PxState::fget(path);
+    PXASSERTM(res, "ChunkIndex::load");
+
+    size = 0;
+    chunks.clear();
+    off_t expected = -1;
+    try {
+        for (auto &line : PxFunction::split(res.assert(), "\n")) {
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            auto key = line.substr(0, eq);
+            auto value = line.substr(eq+1);
+
+            if (key == "SIZE") expected = std::stoll(value);
+            else if (key == "CHUNK") {
+                auto fields = PxFunction::split(value, ":");
+                Chunk chunk = { size, 0, {} };
+                if (fields.size() != 2 || !Chunker::fromHex(fields[0], chunk.hash))
+                    return PxResult::FResult("ChunkIndex::load (corrupt index)", EINVAL);
+                chunk.length = std::stoull(fields[1]);
+                if (chunk.length == 0 || chunk.length > Chunker::maxChunk)
+                    return PxResult::FResult("ChunkIndex::load (corrupt index)", EINVAL);
+                size += chunk.length;
+                chunks.push_back(chunk);
+            }
+        }
+    } catch (std::exception &e) {
+        return PxResult::FResult("ChunkIndex::load (corrupt index)", EINVAL);
+    }
+
+    if (expected != size) return PxResult::FResult("ChunkIndex::load (size mismatch)", EINVAL);
+    return PxResult::Null;
+}
+
+PxResult::Result<void> ChunkIndex::save(std::string path) {
+    std::string out = "SIZE="+std::to_string(size)+"\n";
+    for (auto &i : chunks) {
+        out += "CHUNK="+Chunker::hex(i.hash)+":"+std::to_string(i.length)+"\n";
+    }
+    PXASSERTM(PxState::fput(path, out), "ChunkIndex::save");
+    return PxResult::Null;
+}
+
+PxResult::Result<void> ChunkIndex::build(std::string image) {
+    int fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return PxResult::FResult("ChunkIndex::build / open", errno);
+    DEFER(close_fd, close(fd));
+
+    size = 0;
+    chunks.clear();
+    PXASSERTM(Chunker::scan(fd, [&](off_t offset, const unsigned char *data, size_t count) {
+        chunks.push_back({ offset, count, Chunker::hash(data, count) });
+        size += count;
+        return true;
+    }), "ChunkIndex::build");
+    return PxResult::Null;
+}
+
+PxResult::Result<void> ChunkIndex::fetch(std::vector<std::string> sources, std::string dest) {
+    PxDownload::Download dl(1);
+    auto sdl = dl.add(sources);
+    PXASSERTM(sdl->bindOutput(dest), "ChunkIndex::fetch");
+    PXASSERTM(dl.perform(), "ChunkIndex::fetch");
+    PXASSERTM(load(dest), "ChunkIndex::fetch");
+    return PxResult::Null;
+}
+
+static std::string hashKey(const chunkhash_t &hash) {
+    return std::string((const char*)hash.data(), hash.size());
+}
+
+static PxResult::Result<void> readChunk(int fd, off_t offset, size_t length, std::vector<unsigned char> &buf) {
+    buf.resize(length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t res = pread(fd, buf.data() + done, length - done, offset + done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return PxResult::FResult("readChunk / pread", errno);
+        if (res == 0) return PxResult::FResult("readChunk / pread", EIO);
+        done += res;
+    }
+    return PxResult::Null;
+}
+
+static PxResult::Result<void> writeChunk(int fd, off_t offset, const std::vector<unsigned char> &buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t res = pwrite(fd, buf.data() + done, buf.size() - done, offset + done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return PxResult::FResult("writeChunk / pwrite", errno);
+        done += res;
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<deltastats_t> fetchDelta(std::vector<std::string> sources, const ChunkIndex &index, std::vector<std::string> seeds,
+    std::string dest, size_t maxConcurrent, std::shared_ptr<PxDownload::StreamVerifier> verifier, ChunkCache *cache) {
+    deltastats_t stats = {0, 0, 0, 0};
+
+    // the same chunk can appear more than once in an image; each copy is filled from the first
+    std::unordered_map<std::string, std::vector<size_t>> byHash;
+    std::unordered_set<size_t> lengths;
+    for (size_t i = 0; i < index.chunks.size(); i++) {
+        byHash[hashKey(index.chunks[i].hash)].push_back(i);
+        lengths.insert(index.chunks[i].length);
+    }
+
+    struct location_t {
+        int fd;
+        off_t offset;
+    };
+    std::unordered_map<std::string, location_t> found;
+    std::vector<int> seedfds;
+    DEFER(close_seeds, for (auto i : seedfds) close(i));
+
+    for (auto &seed : seeds) {
+        if (found.size() == byHash.size()) break;
+        int fd = open(seed.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            PxLog::log.warn("Can't reuse data from "+seed+": "+strerror(errno));
+            continue;
+        }
+        seedfds.push_back(fd);
+
+        PxLog::log.info("Looking for reusable data in "+seed+"...");
+        auto res = Chunker::scan(fd, [&](off_t offset, const unsigned char *data, size_t count) {
+            // only chunks of a length we need are worth hashing
+            if (!lengths.count(count)) return true;
+            auto key = hashKey(Chunker::hash(data, count));
+            if (byHash.count(key) && !found.count(key)) found[key] = { fd, offset };
+            return found.size() < byHash.size();
+        });
+        if (res.eno) PxLog::log.warn("Stopped reading "+seed+" early: "+res.funcName+": "+strerror(res.eno));
+    }
+
+    std::vector<size_t> missing;
+    for (auto &i : byHash) {
+        if (!found.count(i.first)) missing.push_back(i.second[0]);
+    }
+
+    int fd = open(dest.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return PxResult::FResult("fetchDelta / open", errno);
+    DEFER(close_fd, close(fd));
+    if (ftruncate(fd, index.size) != 0) return PxResult::FResult("fetchDelta / ftruncate", errno);
+    // chunk files put() writes are only evicted once they are in the index, so it is saved however this returns
+    DEFER(save_cache, if (cache != NULL) {
+        auto res = cache->save();
+        if (res.eno) PxLog::log.warn("Failed to save the chunk cache index: "+res.funcName+": "+strerror(res.eno));
+    });
+
+    // chunks kept from an earlier download don't have to come over the network again
+    if (cache != NULL) {
+        std::vector<unsigned char> buf;
+        std::vector<size_t> uncached;
+        for (auto id : missing) {
+            auto &chunk = index.chunks[id];
+            if (!cache->get(chunk.hash, chunk.length, buf)) {
+                uncached.push_back(id);
+                continue;
+            }
+            for (auto other : byHash[hashKey(chunk.hash)]) {
+                PXASSERTM(writeChunk(fd, index.chunks[other].offset, buf), "fetchDelta");
+                stats.cached += chunk.length;
+            }
+        }
+        missing = uncached;
+    }
+
+    // fetches the given chunks, merging neighbours into ranges of up to minSegmentSize
+    auto download = [&](std::vector<size_t> ids) -> PxResult::Result<void> {
+        if (ids.empty()) return PxResult::Null;
+        std::sort(ids.begin(), ids.end());
+
+        PxDownload::Download dl(maxConcurrent);
+        auto sdl = dl.add(sources);
+        for (auto i : ids) {
+            auto &chunk = index.chunks[i];
+            auto *last = sdl->wanted.empty() ? NULL : &sdl->wanted.back();
+            if (last != NULL && last->offset + last->length == chunk.offset &&
+                last->length + (curl_off_t)chunk.length <= PxDownload::Download::minSegmentSize) {
+                last->length += chunk.length;
+            } else {
+                sdl->wanted.push_back({ chunk.offset, (curl_off_t)chunk.length, 0 });
+            }
+        }
+        stats.requests += sdl->wanted.size();
+
+        PXASSERTM(sdl->bindOutput(dest), "fetchDelta");
+        PXASSERTM(dl.perform(), "fetchDelta");
+        return PxResult::Null;
+    };
+
+    // local chunks are copied while the missing ones download; a seed that is
+    // in use (like the running root) may have changed since it was scanned
+    std::vector<size_t> stale;
+    PxResult::Result<void> copyResult;
+    std::thread copier([&]() {
+        std::vector<unsigned char> buf;
+        for (auto &i : found) {
+            auto &ids = byHash[i.first];
+            auto &first = index.chunks[ids[0]];
+            auto res = readChunk(i.second.fd, i.second.offset, first.length, buf);
+            if (res.eno || Chunker::hash(buf.data(), buf.size()) != first.hash) {
+                stale.push_back(ids[0]);
+                continue;
+            }
+            for (auto id : ids) {
+                res = writeChunk(fd, index.chunks[id].offset, buf);
+                if (res.eno) {
+                    copyResult = res;
+                    return;
+                }
+                stats.reused += first.length;
+            }
+        }
+    });
+
+    auto dlres = download(missing);
+    copier.join();
+    if (!dlres.eno && !copyResult.eno && !stale.empty()) {
+        dlres = download(stale);
+        missing.insert(missing.end(), stale.begin(), stale.end());
+    }
+
+    // downloaded chunks are checked here, and copied to wherever else they appear;
+    // when a transfer failed, whatever did arrive intact is still cached for the retry
+    std::vector<unsigned char> buf;
+    PxResult::Result<void> checkResult;
+    for (auto id : missing) {
+        auto &chunk = index.chunks[id];
+        PXASSERTM(readChunk(fd, chunk.offset, chunk.length, buf), "fetchDelta");
+        if (Chunker::hash(buf.data(), buf.size()) != chunk.hash) {
+            if (!dlres.eno && !checkResult.eno)
+                checkResult = PxResult::FResult("fetchDelta (chunk at "+std::to_string(chunk.offset)+" doesn't match the index)", EIO);
+            continue;
+        }
+
+        for (auto other : byHash[hashKey(chunk.hash)]) {
+            if (other == id) continue;
+            PXASSERTM(writeChunk(fd, index.chunks[other].offset, buf), "fetchDelta");
+        }
+        stats.fetched += chunk.length;
+
+        if (cache != NULL) {
+            auto res = cache->put(chunk.hash, buf);
+            if (res.eno) PxLog::log.warn("Failed to cache a chunk: "+res.funcName+": "+strerror(res.eno));
+        }
+    }
+    PXASSERT(dlres);
+    PXASSERTM(copyResult, "fetchDelta");
+    PXASSERT(checkResult);
+
+    if (fdatasync(fd) != 0) return PxResult::FResult("fetchDelta / fdatasync", errno);
+
+    if (verifier) {
+        buf.resize(1024 * 1024);
+        for (off_t off = 0; off < index.size;) {
+            size_t want = std::min((off_t)buf.size(), index.size - off);
+            ssize_t res = pread(fd, buf.data(), want, off);
+            if (res < 0 && errno == EINTR) continue;
+            if (res < 0) return PxResult::FResult("fetchDelta / pread", errno);
+            if (res == 0) return PxResult::FResult("fetchDelta / pread", EIO);
+            PXASSERTM(verifier->update((const char*)buf.data(), res), "fetchDelta");
+            off += res;
+        }
+        PXASSERTM(verifier->final(), "fetchDelta");
+    }
+
+    PxLog::log.info("Rebuilt "+dest+": "+std::to_string(stats.reused / 1024 / 1024)+" MiB reused, "+
+        std::to_string(stats.cached / 1024 / 1024)+" MiB from cache, "+std::to_string(stats.fetched / 1024 / 1024)+" MiB downloaded in "+std::to_string(stats.requests)+" requests");
+    return stats;
+}
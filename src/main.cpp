@@ -7,17 +7,37 @@
 #include <cstring>
 #include <filesystem>
 #include <libmount/libmount.h>
+#include <linux/ioprio.h>
 #include <string>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <PxOSConfig.hpp>
 #include <replace.hpp>
 #include <vector>
 #include <PxDownload.hpp>
+#include <verify.hpp>
+#include <delta.hpp>
+#include <chunkcache.hpp>
+#include <mountplan.hpp>
+#include <mirrors.hpp>
+#include <progress.hpp>
+#include <trace.hpp>
+#include <map>
+#include <thread>
 
 typedef PxResult::Result<void>(*action_t)(std::vector<std::string> &additionalArgs);
 
 PxOSConfig::OSConfig osconf;
+// set by --yes and --check-only
+bool assumeYes = false;
+bool checkOnly = false;
+
+// Exit status of --check-only when there is an update, as with dnf check-update.
+constexpr int updateAvailable = 100;
+// Exit status of a command that failed, so callers can tell it from "no update".
+constexpr int commandFailed = 1;
 
 struct command_t {
     std::string name;
@@ -26,26 +46,93 @@ struct command_t {
     action_t action;
 };
 
-PxResult::Result<bool> CheckUpdates(std::string &version, std::string &old_version) {
+size_t confNumber(PxConfig::conf &cnf, std::string key, size_t def) {
+    auto value = PxFunction::trim(cnf.QuickRead(key));
+    if (value.empty()) return def;
+    try {
+        return std::stoul(value);
+    } catch (std::exception &e) {
+        PxLog::log.warn("Ignoring invalid value for "+key+": "+value);
+        return def;
+    }
+}
+
+// Sets the I/O scheduling class of this process from a value like "idle" or
+// "best-effort:7". Threads started afterwards inherit it.
+PxResult::Result<void> setIoPriority(std::string value) {
+    auto fields = PxFunction::split(value, ":");
+    auto name = PxFunction::trim(fields[0]);
+    int cls;
+    if (name == "realtime") cls = IOPRIO_CLASS_RT;
+    else if (name == "best-effort") cls = IOPRIO_CLASS_BE;
+    else if (name == "idle") cls = IOPRIO_CLASS_IDLE;
+    else return PxResult::FResult("setIoPriority (unknown class "+name+")", EINVAL);
+
+    // the idle class has no levels
+    int level = 0;
+    if (fields.size() > 1 && cls != IOPRIO_CLASS_IDLE) {
+        try {
+            level = std::stoi(fields[1]);
+        } catch (std::exception &e) {
+            level = -1;
+        }
+        if (level < 0 || level > 7) return PxResult::FResult("setIoPriority (bad level "+fields[1]+")", EINVAL);
+    }
+
+    // glibc has no wrapper for ioprio_set
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(cls, level)) != 0)
+        return PxResult::FResult("setIoPriority / ioprio_set", errno);
+    return PxResult::Null;
+}
+
+// The last version string the repo sent, with its ETag, so an unchanged one costs a 304.
+const std::string versionCache = "/var/cache/pxos-version";
+
+// How the mirrors ranked last time, so they aren't probed on every run.
+const std::string mirrorCache = "/var/cache/pxos-mirrors";
+
+PxResult::Result<bool> CheckUpdates(MirrorList &mirrors, std::string &version, std::string &old_version) {
     auto pxos_curversionres = PxState::fget("/lib/parallaxos-version");
     PXASSERTM(pxos_curversionres, "CheckUpdates");
     old_version = pxos_curversionres.assert();
     old_version = PxFunction::trim(old_version);
 
-    DEFER(verfile, {
-        if (std::filesystem::exists("/var/tmp/newver")) {
-            remove("/var/tmp/newver");
+    std::string cachedEtag, cachedVersion;
+    auto cacheres = PxState::fget(versionCache);
+    if (!cacheres.eno) {
+        for (auto &line : PxFunction::split(cacheres.assert(), "\n")) {
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            if (line.substr(0, eq) == "ETAG") cachedEtag = line.substr(eq+1);
+            else if (line.substr(0, eq) == "VERSION") cachedVersion = line.substr(eq+1);
         }
-    });
-
-    if (system(("curl -so /var/tmp/newver "+osconf.repo+"/"+osconf.branch).c_str()) != 0) {
-        return PxResult::FResult("CheckUpdates / system", EINVAL);
     }
+    if (cachedVersion.empty()) cachedEtag = "";
+
+    // the first mirror with an answer wins; the rest are only asked if it fails
+    PxDownload::Fetcher fetcher;
+    PxResult::Result<PxDownload::Response> res = PxResult::FResult("CheckUpdates (no mirrors)", EINVAL);
+    for (auto &url : mirrors.urls(osconf.branch)) {
+        res = fetcher.get(url, cachedEtag);
+        if (!res.eno && (res.assert().status == 200 || res.assert().status == 304)) break;
+        if (!res.eno) res = PxResult::FResult("CheckUpdates ("+url+" answered "+std::to_string(res.assert().status)+")", EINVAL);
+        PxLog::log.warn("Version check failed on "+url+": "+res.funcName+": "+strerror(res.eno));
+        mirrors.fail(url);
+    }
+    PXASSERTM(res, "CheckUpdates");
+    auto response = res.assert();
 
-    auto pxos_newversionres = PxState::fget("/var/tmp/newver");
-    PXASSERTM(pxos_newversionres, "CheckUpdates");
-    version = pxos_newversionres.assert();
-    version = PxFunction::trim(version);
+    if (response.status == 304) {
+        version = cachedVersion;
+    } else {
+        version = PxFunction::trim(response.body);
+        if (!response.etag.empty()) {
+            // only a cache; failing to write it just means a full response next time
+            PxState::fput(versionCache, "ETAG="+response.etag+"\nVERSION="+version+"\n");
+        } else {
+            remove(versionCache.c_str());
+        }
+    }
     
     return version != old_version;
 }
@@ -60,72 +147,322 @@ PxResult::Result<void> clear_fetch_files(const std::vector<std::string> &keep) {
     return PxResult::Null;
 }
 
+// Fetches the signed manifest of `image` from the first mirror that has one
+// and checks it: ENOENT if no mirror does, EBADMSG if its signature is wrong.
+PxResult::Result<void> fetchManifest(MirrorList &mirrors, std::string image, Manifest &manifest) {
+    PxDownload::Fetcher fetcher;
+    auto texts = mirrors.urls(image+Manifest::suffix);
+    auto sigs = mirrors.urls(image+Manifest::sigSuffix);
+    for (size_t i = 0; i < texts.size(); i++) {
+        auto text = fetcher.get(texts[i]);
+        if (text.eno || text.assert().status != 200) continue;
+        // the signature has to come from the same mirror, or it may be for another build
+        auto sig = fetcher.get(sigs[i]);
+        if (sig.eno || sig.assert().status != 200) continue;
+        PXASSERTM(manifest.loadSigned(text.assert().body, sig.assert().body, osconf.signingKey), "fetchManifest");
+        return PxResult::Null;
+    }
+    return PxResult::FResult("fetchManifest (no mirror has a manifest)", ENOENT);
+}
+
+// Checks for a new version and reports what it found. With --check-only,
+// exits here if there is one.
+PxResult::Result<bool> checkForUpdate(MirrorList &mirrors, std::string &version, std::string &old_version) {
+    progress.phase("check");
+    TRACE(check_span, "check");
+    PxResult::Result<bool> upd = CheckUpdates(mirrors, version, old_version);
+    PXASSERT(upd);
+    check_span.finish();
+
+    bool shouldUpdate = upd.assert();
+    progress.event("check", {{"current", old_version}, {"available", version}, {"update", shouldUpdate ? "yes" : "no"}});
+
+    if (shouldUpdate && checkOnly) {
+        PxLog::log.info("A new version is available ("+old_version+" -> "+version+").");
+        progress.event("result", {{"status", "available"}, {"version", version}});
+        exit(updateAvailable);
+    } else if (!shouldUpdate) {
+        PxLog::log.info("No updates available.");
+        progress.event("result", {{"status", "current"}, {"version", old_version}});
+    }
+    return shouldUpdate;
+}
+
+// Downloads the image of `version` into /var/tmp/px-dl, checking it as it
+// arrives, and returns its path. EBADMSG if it doesn't match its signature.
+PxResult::Result<std::string> fetchImage(MirrorList &mirrors, std::string version) {
+    std::string image = "pxos-" + version + ".img";
+    std::string sig = image + ".sig";
+    std::string imagePath = "/var/tmp/px-dl/" + image;
+    
+    {
+        auto mkdir_res = PxFunction::wrap("mkdir", mkdir("/var/tmp/px-dl", 0644));
+        if (mkdir_res.eno != EEXIST)
+            PXASSERT(mkdir_res);
+    }
+
+    // keep partial downloads from an interrupted run, along with their resume state
+    std::vector<std::string> toKeep;
+    for (auto &fetch : {sig, image}) {
+        toKeep.push_back(fetch);
+        toKeep.push_back(fetch + PxDownload::Subdownload::stateSuffix);
+    }
+    PXASSERT(clear_fetch_files(toKeep));
+
+    progress.phase("download");
+    size_t hashThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    // with a signed manifest, files are checked in-process on every core instead of by gpg
+    Manifest manifest;
+    bool inProcess = false;
+    if (access(osconf.signingKey.c_str(), R_OK) == 0) {
+        auto res = fetchManifest(mirrors, image, manifest);
+        if (!res.eno && !manifest.files.count(image)) res = PxResult::FResult("fetchManifest ("+image+" isn't listed)", EBADMSG);
+        if (res.eno == EBADMSG) {
+            PxLog::log.error("Failed to match signature! ("+res.funcName+")");
+            return PxResult::FResult(res.funcName, EBADMSG);
+        }
+        inProcess = !res.eno;
+        if (!inProcess) PxLog::log.info("No signed manifest available, checking signatures with gpg.");
+    }
+
+    std::map<std::string, std::shared_ptr<PxDownload::Subdownload>> fetched;
+    auto verifierFor = [&](std::string file) -> std::shared_ptr<PxDownload::StreamVerifier> {
+        if (inProcess && manifest.files.count(file))
+            return std::make_shared<TreeHashVerifier>(manifest.files[file], manifest.leaf, hashThreads);
+        if (!inProcess && fetched.count(file+".sig"))
+            return std::make_shared<GpgStreamVerifier>(fetched[file+".sig"], "/var/tmp/px-dl/"+file+".sig");
+        return NULL;
+    };
+    auto fetch = [&](std::vector<std::string> files) -> PxResult::Result<void> {
+        TRACE(span, "download");
+        PxDownload::Download dl(osconf.parallelDownloads);
+        for (auto &file : files) {
+            // only the image is big enough to be worth splitting into ranges
+            auto sdl = dl.add(mirrors.urls(file), PxFunction::endsWith(file, ".img") ? osconf.downloadSegments : 1);
+            if (PxFunction::endsWith(file, ".sig")) sdl->priority = 1;
+            PXASSERTM(sdl->bindOutput("/var/tmp/px-dl/"+file, true), "download");
+            fetched[file] = sdl;
+        }
+
+        // each signed file is checked as it downloads instead of being read back afterwards
+        for (auto &file : files) fetched[file]->verifier = verifierFor(file);
+        auto res = dl.perform();
+        for (auto &file : files) {
+            mirrors.record(*fetched[file]);
+            span.addBytes(fetched[file]->stats.down);
+        }
+        return res;
+    };
+
+    // with a chunk index, most of the new image can come from the running system
+    ChunkIndex index;
+    bool delta = index.fetch(mirrors.urls(image+ChunkIndex::suffix), imagePath+ChunkIndex::suffix).eno == 0;
+    if (!delta) PxLog::log.info("No chunk index available, downloading the whole image.");
+    // the index decides what gets copied into the image, so it has to be the signed one
+    if (delta && inProcess && manifest.check("/var/tmp/px-dl", { image+ChunkIndex::suffix }, hashThreads).eno) {
+        PxLog::log.warn("The chunk index doesn't match the manifest, downloading the whole image.");
+        delta = false;
+    }
+
+    // signatures come first so they are in hand by the time image data starts arriving
+    std::vector<std::string> files;
+    if (!inProcess) files.push_back(sig);
+    if (!delta) files.push_back(image);
+    auto dlres = fetch(files);
+    if (delta && !dlres.eno) {
+        PxOSConfig::conf c("/data/partitions");
+        PXASSERT(c.readConf());
+
+        // a retried or repeated update finds what it downloaded last time here
+        ChunkCache cache(osconf.chunkCache, (off_t)osconf.chunkCacheSize * 1024 * 1024);
+        auto cacheres = cache.open();
+        if (cacheres.eno) {
+            PxLog::log.warn("Not using the chunk cache: "+cacheres.funcName+": "+strerror(cacheres.eno));
+        }
+
+        // the running root is usually recorded as UUID=..., which open() can't take
+        std::vector<std::string> seeds;
+        auto seed = mnt_resolve_spec(c.curPart().c_str(), NULL);
+        if (seed != NULL) {
+            seeds.push_back(seed);
+            free(seed);
+        } else {
+            PxLog::log.warn("Can't find the running root ("+c.curPart()+"), nothing can be reused from it.");
+        }
+
+        progress.phase("delta");
+        TRACE(span, "delta");
+        auto res = fetchDelta(mirrors.urls(image), index, seeds, imagePath, osconf.parallelDownloads,
+            verifierFor(image), cacheres.eno ? NULL : &cache);
+        if (!res.eno) span.addBytes(index.size);
+        span.finish();
+        if (res.eno && res.eno != EBADMSG) {
+            PxLog::log.warn("Delta update failed ("+res.funcName+": "+strerror(res.eno)+"), downloading the whole image.");
+            dlres = fetch({ image });
+        } else if (res.eno) {
+            dlres = PxResult::FResult(res.funcName, res.eno);
+        }
+    }
+    remove((imagePath+ChunkIndex::suffix).c_str());
+
+    if (dlres.eno == EBADMSG) {
+        PxLog::log.error("Failed to match signature!");
+        // don't resume from a bad image next time
+        PXASSERT(clear_fetch_files({}));
+        return PxResult::FResult(dlres.funcName, EBADMSG);
+    }
+    PXASSERTM(dlres, "download");
+    return imagePath;
+}
+
 PxResult::Result<void> cmd_update(std::vector<std::string> &extra_args) {
     if (geteuid() != 0) {
         PxLog::log.error("Must be root!");
-        exit(1);
+        return PxResult::FResult("cmd_update (must be root)", EPERM);
     }
-    std::string old_version, version;
-    PxResult::Result<bool> upd = CheckUpdates(version, old_version);
+    MirrorList mirrors(osconf.repos, mirrorCache, (time_t)osconf.mirrorProbeInterval * 60 * 60);
+    PXASSERT(mirrors.rank(osconf.branch));
+    DEFER(save_mirrors, {
+        auto res = mirrors.save();
+        if (res.eno) PxLog::log.warn("Failed to save the mirror ranking: "+res.funcName+": "+strerror(res.eno));
+    });
 
-    bool shouldUpdate = upd.assert();
+    std::string old_version, version;
+    auto upd = checkForUpdate(mirrors, version, old_version);
+    PXASSERT(upd);
+    if (!upd.assert()) return PxResult::Null;
 
-    if (shouldUpdate) {
+    bool hasConfirmed = assumeYes;
+    if (!assumeYes) {
         std::cout << "\x1b[1mA new version is available (" << old_version << " -> " << version << "). Update? [Y/n] \x1b[0m";
 
         bool isValid = false;
-        bool hasConfirmed = false;
         std::string userConfirm;
         do {
-            std::getline(std::cin, userConfirm);
+            // nobody left to answer; don't take that as a yes
+            if (!std::getline(std::cin, userConfirm)) {
+                PxLog::log.info("No answer on standard input; use --yes to update unattended.");
+                break;
+            }
             userConfirm = PxFunction::trim(userConfirm);
             isValid = PxFunction::contains({"", "y", "n", "Y", "N"}, userConfirm);
             hasConfirmed = PxFunction::contains({"", "y", "Y"}, userConfirm);
         } while (!isValid);
+    }
 
+    if (!hasConfirmed) {
+        PxLog::log.info("Operation was not confirmed.");
+        progress.event("result", {{"status", "declined"}});
+        exit(1);
+    }
 
-        if (!hasConfirmed) {
-            PxLog::log.info("Operation was not confirmed.");
-            exit(1);
-        }
-
-        std::vector<std::string> toFetch = { "pxos-" + version + ".img", "pxos-" + version + ".img.sig" };
-        std::vector<std::string> toVerify = { "pxos-" + version + ".img.sig" };
-        
-        {
-            auto mkdir_res = PxFunction::wrap("mkdir", mkdir("/var/tmp/px-dl", 0644));
-            if (mkdir_res.eno != EEXIST)
-                PXASSERT(mkdir_res);
-        }
+    // already installed by `pxos stage`, so only the switch is left
+    PxOSConfig::conf c("/data/partitions");
+    PXASSERT(c.readConf());
+    if (c.staged == version) {
+        progress.phase("install");
+        TRACE(install_span, "commit");
+        PXASSERT(commit(osconf));
+        install_span.finish();
+        PxLog::log.info("Finished update.");
+        progress.event("result", {{"status", "updated"}, {"version", version}});
+        return PxResult::Null;
+    }
 
-        PXASSERT(clear_fetch_files(toFetch));
-        {
-            PxDownload::Download dl;
-            for (auto &fetch : toFetch) {
-                auto sdl = dl.add(osconf.repo+"/"+fetch);
-                sdl->bindOutput("/var/tmp/px-dl/"+fetch);
-            }
-            PXASSERTM(dl.perform(), "download");
-        }
+    auto imageres = fetchImage(mirrors, version);
+    PXASSERT(imageres);
 
-        PxLog::log.info("Verifying signatures...");
-        for (auto &sig : toVerify) {
-            if (system(("gpg --homedir /etc/pxos-gpg --verify /var/tmp/px-dl/"+sig).c_str()) != 0) {
-                PxLog::log.error("Failed to match signature!");
-                return PxResult::Null;
-            }
-        }
+    progress.phase("install");
+    TRACE(install_span, "install");
+    PXASSERT(replace(imageres.assert(), osconf));
+    PXASSERT(clear_fetch_files({}));
+    install_span.finish();
+    PxLog::log.info("Finished update.");
+    progress.event("result", {{"status", "updated"}, {"version", version}});
+    return PxResult::Null;
+}
+PxResult::Result<void> cmd_stage(std::vector<std::string> &extra_args) {
+    // nobody is waiting on this, so the running system goes first
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0) PxLog::log.warn("Failed to lower the CPU priority: "+(std::string)strerror(errno));
+    auto ioprio = setIoPriority("idle");
+    if (ioprio.eno) PxLog::log.warn("Failed to lower the I/O priority: "+ioprio.funcName+": "+strerror(ioprio.eno));
+
+    MirrorList mirrors(osconf.repos, mirrorCache, (time_t)osconf.mirrorProbeInterval * 60 * 60);
+    PXASSERT(mirrors.rank(osconf.branch));
+    DEFER(save_mirrors, {
+        auto res = mirrors.save();
+        if (res.eno) PxLog::log.warn("Failed to save the mirror ranking: "+res.funcName+": "+strerror(res.eno));
+    });
 
-        PXASSERT(replace("/var/tmp/px-dl/pxos-"+version+".img"));
-        PXASSERT(clear_fetch_files({}));
-        PxLog::log.info("Finished update.");
-    } else {
-        PxLog::log.info("No updates available.");
+    std::string old_version, version;
+    auto upd = checkForUpdate(mirrors, version, old_version);
+    PXASSERT(upd);
+    if (!upd.assert()) return PxResult::Null;
+
+    PxOSConfig::conf c("/data/partitions");
+    PXASSERT(c.readConf());
+    if (c.staged == version) {
+        PxLog::log.info(version+" is already staged; run \"pxos commit\" to switch to it.");
+        progress.event("result", {{"status", "staged"}, {"version", version}});
+        return PxResult::Null;
     }
+
+    auto imageres = fetchImage(mirrors, version);
+    PXASSERT(imageres);
+
+    progress.phase("stage");
+    TRACE(stage_span, "stage");
+    PXASSERT(stage(imageres.assert(), version, osconf));
+    PXASSERT(clear_fetch_files({}));
+    stage_span.finish();
+    PxLog::log.info("Staged "+version+"; run \"pxos commit\" to switch to it.");
+    progress.event("result", {{"status", "staged"}, {"version", version}});
+    return PxResult::Null;
+}
+PxResult::Result<void> cmd_commit(std::vector<std::string> &extra_args) {
+    progress.phase("commit");
+    TRACE(span, "commit");
+    auto res = commit(osconf);
+    if (res.eno == ENOENT) PxLog::log.info("Nothing is staged; run \"pxos stage\" first.");
+    PXASSERT(res);
+    span.finish();
+    PxLog::log.info("Finished update to "+res.assert()+".");
+    progress.event("result", {{"status", "updated"}, {"version", res.assert()}});
     return PxResult::Null;
 }
 PxResult::Result<void> cmd_replace(std::vector<std::string> &extra_args) {
-    return replace(extra_args[0]);
+    return replace(extra_args[0], osconf);
+}
+PxResult::Result<void> cmd_manifest(std::vector<std::string> &extra_args) {
+    if (extra_args.empty()) return PxResult::FResult("cmd_manifest (no files given)", EINVAL);
+
+    TRACE(span, "manifest");
+    WorkPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    auto res = TreeHash::files(extra_args, TreeHash::leafSize, pool);
+    PXASSERT(res);
+
+    Manifest manifest;
+    for (size_t i = 0; i < extra_args.size(); i++) {
+        struct stat st;
+        if (stat(extra_args[i].c_str(), &st) != 0) return PxResult::FResult("cmd_manifest / stat", errno);
+        manifest.files[std::filesystem::path(extra_args[i]).filename()] = { st.st_size, res.assert()[i] };
+        span.addBytes(st.st_size);
+    }
+
+    auto path = extra_args[0]+Manifest::suffix;
+    PXASSERT(manifest.save(path));
+    PxLog::log.info("Wrote "+path+"; sign it with: openssl pkeyutl -sign -rawin -inkey KEY -in "+path+" -out "+extra_args[0]+Manifest::sigSuffix);
+    return PxResult::Null;
+}
+PxResult::Result<void> cmd_index(std::vector<std::string> &extra_args) {
+    if (extra_args.empty()) return PxResult::FResult("cmd_index (no image given)", EINVAL);
+
+    ChunkIndex index;
+    PXASSERT(index.build(extra_args[0]));
+    PXASSERT(index.save(extra_args[0]+ChunkIndex::suffix));
+    PxLog::log.info("Wrote "+std::to_string(index.chunks.size())+" chunks to "+extra_args[0]+ChunkIndex::suffix);
+    return PxResult::Null;
 }
 
 std::vector<command_t> commands = {
@@ -135,23 +472,49 @@ std::vector<command_t> commands = {
         .needsRoot = true,
         .action = cmd_update
     },
+    {
+        .name = "stage",
+        .help = "Download an update and install it on the inactive root at low priority, ready to commit",
+        .needsRoot = true,
+        .action = cmd_stage
+    },
+    {
+        .name = "commit",
+        .help = "Switch to the update installed by stage",
+        .needsRoot = true,
+        .action = cmd_commit
+    },
     {
         .name = "replace",
         .help = "Replace the current image",
         .needsRoot = true,
         .action = cmd_replace
+    },
+    {
+        .name = "manifest",
+        .help = "Write the signed-manifest contents for an image and the files released with it",
+        .needsRoot = false,
+        .action = cmd_manifest
+    },
+    {
+        .name = "index",
+        .help = "Write the chunk index for delta updates next to an image",
+        .needsRoot = false,
+        .action = cmd_index
     }
 };
 
 int main(int argc, const char* argv[]) {
     PxArg::SelectArgument command("COMMAND", "Command to run", false);
     PxArg::Argument help("help", 'h', "Print help");
+    PxArg::Argument yes("yes", 'y', "Update without asking for confirmation");
+    PxArg::Argument check("check-only", 'c', "Only check for an update; exits with 100 if there is one, 1 on errors");
 
     for (auto &i : commands) {
         command.addOption(i.name, i.help);
     }
 
-    PxArg::ArgParser parser({&command}, {&help});
+    PxArg::ArgParser parser({&command}, {&help, &yes, &check});
 
     auto extra_argsres = parser.parseArgs(PxFunction::vectorize(argc, argv));
 
@@ -167,30 +530,87 @@ int main(int argc, const char* argv[]) {
     }
 
     auto extra_args = extra_argsres.assert();
+    assumeYes = yes.active;
+    checkOnly = check.active;
+
+    // an orchestrator passes a descriptor here to follow along in JSON
+    if (getenv(ProgressStream::fdVariable) != NULL) {
+        int fd = -1;
+        try {
+            fd = std::stoi(getenv(ProgressStream::fdVariable));
+        } catch (std::exception &e) {}
+        if (fd < 0 || !progress.open(fd)) {
+            PxLog::log.warn((std::string)"Ignoring "+ProgressStream::fdVariable+", it isn't an open descriptor.");
+        }
+    }
 
     // load config
 
     auto confres = PxConfig::ReadConfig("/etc/pxos.conf");
     if (confres.eno) {
         PxLog::log.error("Failed to load config: "+confres.funcName+": "+strerror(confres.eno));
-        exit(1);
+        progress.event("result", {{"status", "error"}, {"error", confres.funcName+": "+strerror(confres.eno)}});
+        return commandFailed;
     }
     PxConfig::conf baseconf = confres.assert();
 
+    // several mirrors can be given, separated by spaces
+    std::vector<std::string> repos;
+    for (auto &i : PxFunction::split(baseconf.QuickRead("repo"), " ")) {
+        if (!PxFunction::trim(i).empty()) repos.push_back(PxFunction::trim(i));
+    }
+
     osconf = {
-        .repo = baseconf.QuickRead("repo"),
-        .branch = baseconf.QuickRead("branch")
+        .repos = repos,
+        .branch = baseconf.QuickRead("branch"),
+        .parallelDownloads = confNumber(baseconf, "parallel_downloads", 8),
+        .downloadSegments = confNumber(baseconf, "download_segments", 4),
+        .incrementalUpdates = confNumber(baseconf, "incremental_updates", 1) != 0,
+        .chunkCache = baseconf.QuickRead("chunk_cache"),
+        .chunkCacheSize = confNumber(baseconf, "chunk_cache_size", 2048),
+        .mirrorProbeInterval = confNumber(baseconf, "mirror_probe_interval", 24),
+        .signingKey = PxFunction::trim(baseconf.QuickRead("signing_key")),
+        .bootCache = baseconf.QuickRead("boot_cache"),
+        .chrootMounts = PxFunction::trim(baseconf.QuickRead("chroot_mounts"))
     };
+    if (osconf.signingKey.empty()) osconf.signingKey = "/etc/pxos-sign.pem";
+    if (osconf.chunkCache.empty()) osconf.chunkCache = "/data/pxos-cache";
+    if (osconf.bootCache.empty()) osconf.bootCache = "/data/pxos-boot-cache";
+    if (osconf.chrootMounts.empty()) osconf.chrootMounts = MountPlan::defaultPlan;
+    PxDownload::logTimings = confNumber(baseconf, "log_timings", 0) != 0;
+    if (confNumber(baseconf, "trace", 0) != 0) {
+        Trace::enable(PxFunction::trim(baseconf.QuickRead("trace_file")));
+    }
+    if (progress.enabled()) {
+        PxDownload::onProgress = [](PxDownload::Subdownload &sdl) {
+            progress.progress(sdl.source, sdl.stats.down, sdl.stats.total, sdl.stats.speed, sdl.done);
+        };
+    }
+    PxDownload::limits = {
+        .rate = (curl_off_t)confNumber(baseconf, "rate_limit", 0) * 1024,
+        .idleOnly = confNumber(baseconf, "idle_only", 0) != 0,
+        .idleThreshold = (curl_off_t)confNumber(baseconf, "idle_threshold", 256) * 1024,
+        .idleRate = (curl_off_t)confNumber(baseconf, "idle_rate", 64) * 1024
+    };
+
+    auto ioprio = PxFunction::trim(baseconf.QuickRead("io_priority"));
+    if (!ioprio.empty()) {
+        auto res = setIoPriority(ioprio);
+        if (res.eno) PxLog::log.warn("Ignoring io_priority: "+res.funcName+": "+strerror(res.eno));
+    }
 
     for (auto &i : commands) {
         if (i.name == command.value) {
             if (i.needsRoot && geteuid() != 0) {
                 PxLog::log.error("Must be root!");
-                exit(1);
+                progress.event("result", {{"status", "error"}, {"error", "must be root"}});
+                return commandFailed;
             }
             auto res = i.action(extra_args);
             if (res.eno) {
-                PxLog::log.error("Error: " + res.funcName + ": " + strerror(errno));
+                PxLog::log.error("Error: " + res.funcName + ": " + strerror(res.eno));
+                progress.event("result", {{"status", "error"}, {"error", res.funcName+": "+strerror(res.eno)}});
+                return commandFailed;
             }
             goto end;
         }
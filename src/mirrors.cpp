@@ -0,0 +1,192 @@
+#include <mirrors.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxLog.hpp>
+#include <PxState.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+MirrorList::MirrorList(std::vector<std::string> urls, std::string cachePath, time_t maxAge)
+    : cachePath(cachePath), maxAge(maxAge) {
+    for (auto &i : urls) {
+        mirror_t m;
+        m.url = i;
+        mirrors.push_back(m);
+    }
+}
+
+MirrorList::mirror_t *MirrorList::find(const std::string &url) {
+    for (auto &i : mirrors) {
+        if (PxFunction::startsWith(url, i.url+"/")) return &i;
+    }
+    return NULL;
+}
+
+double MirrorList::cost(const mirror_t &m) {
+    if (m.latency < 0) return std::numeric_limits<double>::infinity();
+    // a mirror that hasn't been downloaded from yet gets the benefit of the doubt
+    double seconds = m.latency / 1e6;
+    if (m.throughput > 0) seconds += referenceSize / m.throughput;
+    return seconds;
+}
+
+void MirrorList::sort() {
+    // stable, so mirrors nothing is known about keep the order they were configured in
+    std::stable_sort(mirrors.begin(), mirrors.end(), [&](auto &a, auto &b) { return cost(a) < cost(b); });
+}
+
+void MirrorList::load() {
+    auto res = PxState::fget(cachePath);
+    if (res.eno) return;
+
+    try {
+        for (auto &line : PxFunction::split(res.assert(), "\n")) {
+            if (!PxFunction::startsWith(line, "MIRROR=")) continue;
+            // the URL goes last, since it has colons of its own
+            auto fields = PxFunction::split(line.substr(7), ":");
+            if (fields.size() < 4) continue;
+            std::vector<std::string> rest(fields.begin() + 3, fields.end());
+            auto url = PxFunction::join(rest, ":");
+
+            for (auto &i : mirrors) {
+                if (i.url != url) continue;
+                i.probed = std::stoll(fields[0]);
+                i.latency = std::stoll(fields[1]);
+                i.throughput = std::stod(fields[2]);
+            }
+        }
+    } catch (std::exception &e) {
+        PxLog::log.warn("Ignoring corrupt mirror ranking in "+cachePath);
+        for (auto &i : mirrors) i = { .url = i.url };
+    }
+}
+
+PxResult::Result<void> MirrorList::probe(std::string file) {
+    CURLM *multi = curl_multi_init();
+    if (multi == NULL) return PxResult::FResult("MirrorList::probe / curl_multi_init", ENOMEM);
+    DEFER(cleanup_multi, curl_multi_cleanup(multi));
+
+    std::vector<CURL*> handles;
+    DEFER(cleanup_handles,
+        for (auto i : handles) {
+            curl_multi_remove_handle(multi, i);
+            curl_easy_cleanup(i);
+        }
+    );
+
+    PxLog::log.info("Probing "+std::to_string(mirrors.size())+" mirrors...");
+    for (size_t i = 0; i < mirrors.size(); i++) {
+        mirrors[i].latency = -1;
+        mirrors[i].probed = time(NULL);
+
+        CURL *curl = curl_easy_init();
+        if (curl == NULL) return PxResult::FResult("MirrorList::probe / curl_easy_init", ENOMEM);
+        handles.push_back(curl);
+
+        // probes go through the shared connection cache, so the winner's connection is already open for the download
+        PxDownload::setupHandle(curl);
+        curl_easy_setopt(curl, CURLOPT_URL, (mirrors[i].url+"/"+file).c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, probeTimeout);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, (char*)&mirrors[i]);
+        if (curl_multi_add_handle(multi, curl) != CURLM_OK)
+            return PxResult::FResult("MirrorList::probe / curl_multi_add_handle", EINVAL);
+    }
+
+    int running = 1;
+    while (running > 0) {
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+            return PxResult::FResult("MirrorList::probe / curl_multi_perform", EINVAL);
+
+        int queued;
+        CURLMsg *msg;
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE || msg->data.result != CURLE_OK) continue;
+
+            mirror_t *m;
+            long response = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&m);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response);
+            // a mirror missing the file is as good as down
+            if (response >= 400) continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &m->latency);
+        }
+
+        if (running > 0 && curl_multi_poll(multi, NULL, 0, 100, NULL) != CURLM_OK)
+            return PxResult::FResult("MirrorList::probe / curl_multi_poll", EINVAL);
+    }
+
+    dirty = true;
+    return PxResult::Null;
+}
+
+PxResult::Result<void> MirrorList::rank(std::string file) {
+    // with one mirror there is nothing to choose
+    if (mirrors.size() < 2) return PxResult::Null;
+
+    load();
+    time_t now = time(NULL);
+    bool stale = std::any_of(mirrors.begin(), mirrors.end(), [&](auto &i) {
+        return i.probed == 0 || now - i.probed > maxAge || i.probed > now;
+    });
+    if (stale) PXASSERTM(probe(file), "MirrorList::rank");
+    sort();
+
+    auto &best = mirrors.front();
+    if (best.latency < 0) {
+        PxLog::log.warn("No mirror answered, trying them in the configured order.");
+    } else {
+        PxLog::log.info("Using mirror "+best.url+" ("+std::to_string(best.latency / 1000)+" ms"+
+            (best.throughput > 0 ? ", "+std::to_string((int)std::round(best.throughput / 1024 / 1024))+" MiB/s" : "")+")");
+    }
+    return PxResult::Null;
+}
+
+std::vector<std::string> MirrorList::urls(std::string file) {
+    std::vector<std::string> out;
+    for (auto &i : mirrors) out.push_back(i.url+"/"+file);
+    return out;
+}
+
+void MirrorList::fail(const std::string &url) {
+    auto *m = find(url);
+    if (m == NULL) return;
+    m->latency = -1;
+    m->probed = 0;
+    dirty = true;
+    sort();
+}
+
+void MirrorList::record(PxDownload::Subdownload &sdl) {
+    for (size_t i = 0; i < sdl.sources.size(); i++) {
+        // every mirror the download moved on from failed it
+        if (i < sdl.mirror) {
+            fail(sdl.sources[i]);
+            continue;
+        }
+
+        auto *m = find(sdl.sources[i]);
+        auto &t = sdl.mirrorTiming[i];
+        if (m == NULL || t.bytes < minSample || t.transfer <= 0) continue;
+
+        // weighted towards recent downloads, but one slow run doesn't undo everything before it
+        double measured = t.bytes / (t.transfer / 1e6);
+        m->throughput = m->throughput > 0 ? (m->throughput + measured) / 2 : measured;
+        dirty = true;
+    }
+    sort();
+}
+
+PxResult::Result<void> MirrorList::save() {
+    if (!dirty || mirrors.size() < 2) return PxResult::Null;
+
+    std::string out;
+    for (auto &i : mirrors) {
+        out += "MIRROR="+std::to_string(i.probed)+":"+std::to_string(i.latency)+":"+
+            std::to_string(i.throughput)+":"+i.url+"\n";
+    }
+    PXASSERTM(PxState::fput(cachePath, out), "MirrorList::save");
+    dirty = false;
+    return PxResult::Null;
+}
@@ -0,0 +1,261 @@
+#include <mountplan.hpp>
+#include <trace.hpp>
+#include <workpool.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxLog.hpp>
+#include <blkid/blkid.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// options that are properties of the mount rather than of the filesystem
+struct mountflag_t {
+    const char *name;
+    unsigned long legacy;
+    uint64_t attr;
+};
+static const mountflag_t mountFlags[] = {
+    { "ro", MS_RDONLY, MOUNT_ATTR_RDONLY },
+    { "nosuid", MS_NOSUID, MOUNT_ATTR_NOSUID },
+    { "nodev", MS_NODEV, MOUNT_ATTR_NODEV },
+    { "noexec", MS_NOEXEC, MOUNT_ATTR_NOEXEC },
+    { "noatime", MS_NOATIME, MOUNT_ATTR_NOATIME },
+    { "nodiratime", MS_NODIRATIME, MOUNT_ATTR_NODIRATIME },
+    { "relatime", MS_RELATIME, MOUNT_ATTR_RELATIME },
+};
+
+struct options_t {
+    unsigned long legacy = 0;
+    uint64_t attr = 0;
+    // everything else, handed to the filesystem
+    std::vector<std::string> fs;
+};
+
+static options_t splitOptions(const std::string &options) {
+    options_t out;
+    for (auto &i : PxFunction::split(options, ",")) {
+        if (i.empty()) continue;
+        bool found = false;
+        for (auto &flag : mountFlags) {
+            if (i != flag.name) continue;
+            out.legacy |= flag.legacy;
+            out.attr |= flag.attr;
+            found = true;
+        }
+        if (!found) out.fs.push_back(i);
+    }
+    return out;
+}
+
+static bool isBind(const MountPlan::Entry &entry) {
+    return entry.type == "bind" || entry.type == "rbind";
+}
+
+// Turns a UUID= or LABEL= source into its device, and works out the type of an "auto" entry.
+static PxResult::Result<void> resolve(MountPlan::Entry &entry) {
+    if (isBind(entry)) return PxResult::Null;
+    bool tagged = entry.source.find('=') != std::string::npos;
+    if (!tagged && entry.type != "auto") return PxResult::Null;
+
+    char *dev = blkid_evaluate_spec(entry.source.c_str(), NULL);
+    if (dev == NULL) return PxResult::FResult("MountPlan / blkid_evaluate_spec "+entry.source, ENODEV);
+    entry.source = dev;
+    free(dev);
+    if (entry.type != "auto") return PxResult::Null;
+
+    blkid_probe probe = blkid_new_probe_from_filename(entry.source.c_str());
+    if (probe == NULL) return PxResult::FResult("MountPlan / blkid_new_probe_from_filename "+entry.source, errno);
+    DEFER(free_probe, blkid_free_probe(probe));
+
+    const char *type;
+    size_t len;
+    if (blkid_do_probe(probe) != 0 || blkid_probe_lookup_value(probe, "TYPE", &type, &len) != 0 || len < 2)
+        return PxResult::FResult("MountPlan (no filesystem on "+entry.source+")", ENODEV);
+    entry.type = std::string(type, len - 1);
+    return PxResult::Null;
+}
+
+// Sets up `entry` as a detached mount and returns its descriptor.
+static PxResult::Result<int> detached(const MountPlan::Entry &entry) {
+    auto options = splitOptions(entry.options);
+
+    if (isBind(entry)) {
+        bool recursive = entry.type == "rbind";
+        int fd = open_tree(AT_FDCWD, entry.source.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | (recursive ? AT_RECURSIVE : 0));
+        if (fd < 0) return PxResult::FResult("MountPlan / open_tree "+entry.source, errno);
+        if (options.attr != 0) {
+            struct mount_attr attr = {};
+            attr.attr_set = options.attr;
+            if (mount_setattr(fd, "", AT_EMPTY_PATH | (recursive ? AT_RECURSIVE : 0), &attr, sizeof(attr)) != 0) {
+                int err = errno;
+                close(fd);
+                return PxResult::FResult("MountPlan / mount_setattr "+entry.target, err);
+            }
+        }
+        return fd;
+    }
+
+    int fsfd = fsopen(entry.type.c_str(), FSOPEN_CLOEXEC);
+    if (fsfd < 0) return PxResult::FResult("MountPlan / fsopen "+entry.type, errno);
+    DEFER(close_fs, close(fsfd));
+
+    if (fsconfig(fsfd, FSCONFIG_SET_STRING, "source", entry.source.c_str(), 0) != 0)
+        return PxResult::FResult("MountPlan / fsconfig source "+entry.source, errno);
+    for (auto &i : options.fs) {
+        auto eq = i.find('=');
+        int res = eq == std::string::npos ?
+            fsconfig(fsfd, FSCONFIG_SET_FLAG, i.c_str(), NULL, 0) :
+            fsconfig(fsfd, FSCONFIG_SET_STRING, i.substr(0, eq).c_str(), i.substr(eq+1).c_str(), 0);
+        if (res != 0) return PxResult::FResult("MountPlan / fsconfig "+i, errno);
+    }
+    if (fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) != 0)
+        return PxResult::FResult("MountPlan / fsconfig create "+entry.target, errno);
+
+    int fd = fsmount(fsfd, FSMOUNT_CLOEXEC, options.attr);
+    if (fd < 0) return PxResult::FResult("MountPlan / fsmount "+entry.target, errno);
+    return fd;
+}
+
+// mount(2), for kernels older than the new API.
+static PxResult::Result<void> legacyMount(const MountPlan::Entry &entry, const std::string &target) {
+    auto options = splitOptions(entry.options);
+
+    if (isBind(entry)) {
+        unsigned long flags = MS_BIND | (entry.type == "rbind" ? MS_REC : 0);
+        if (::mount(entry.source.c_str(), target.c_str(), NULL, flags, NULL) != 0)
+            return PxResult::FResult("MountPlan / mount "+target, errno);
+        // a bind mount only takes its flags from a remount
+        if (options.legacy != 0 && ::mount(NULL, target.c_str(), NULL, MS_REMOUNT | MS_BIND | options.legacy, NULL) != 0)
+            return PxResult::FResult("MountPlan / remount "+target, errno);
+        return PxResult::Null;
+    }
+
+    auto data = PxFunction::join(options.fs, ",");
+    if (::mount(entry.source.c_str(), target.c_str(), entry.type.c_str(), options.legacy, data.empty() ? NULL : data.c_str()) != 0)
+        return PxResult::FResult("MountPlan / mount "+target, errno);
+    return PxResult::Null;
+}
+
+PxResult::Result<void> MountPlan::parse(std::string text, const std::map<std::string, std::string> &vars) {
+    entries.clear();
+    for (auto &i : PxFunction::split(text, " ")) {
+        if (i.empty()) continue;
+        // the options go last, since they are the only field that might have colons
+        auto fields = PxFunction::split(i, ":");
+        if (fields.size() < 3 || fields[0].empty() || fields[0][0] != '/')
+            return PxResult::FResult("MountPlan::parse (bad entry "+i+")", EINVAL);
+
+        Entry entry = { fields[0], fields[1], fields[2], "" };
+        if (fields.size() > 3) entry.options = PxFunction::join(std::vector<std::string>(fields.begin() + 3, fields.end()), ":");
+        if (PxFunction::startsWith(entry.source, "@")) {
+            auto it = vars.find(entry.source.substr(1));
+            if (it == vars.end()) return PxResult::FResult("MountPlan::parse (unknown source "+entry.source+")", EINVAL);
+            entry.source = it->second;
+        }
+        entries.push_back(entry);
+    }
+    return PxResult::Null;
+}
+
+void MountPlan::redirect(std::string source, std::string to) {
+    for (auto &i : entries) {
+        if (isBind(i) && i.source == source) i.source = to;
+    }
+}
+
+PxResult::Result<void> MountPlan::mount(std::string root) {
+    TRACE(span, "chroot mounts");
+    std::vector<Entry> resolved = entries;
+    for (auto &i : resolved) PXASSERTM(resolve(i), "MountPlan::mount");
+
+    // everything is set up detached first, so a bad entry fails before anything shows up in the root
+    std::vector<int> fds;
+    DEFER(close_fds, for (auto i : fds) close(i));
+    bool legacy = false;
+    for (auto &i : resolved) {
+        auto res = detached(i);
+        if (res.eno == ENOSYS) {
+            legacy = true;
+            break;
+        }
+        PXASSERTM(res, "MountPlan::mount");
+        fds.push_back(res.assert());
+    }
+
+    DEFER(rollback,
+        auto res = unmount();
+        if (res.eno) PxLog::log.warn("Failed to undo the chroot mounts: "+res.funcName+": "+strerror(res.eno));
+    );
+    for (size_t i = 0; i < resolved.size(); i++) {
+        auto target = root+resolved[i].target;
+        auto mkdir_res = PxFunction::wrap("mkdir", mkdir(target.c_str(), 0755));
+        if (mkdir_res.eno != EEXIST) PXASSERTM(mkdir_res, "MountPlan::mount "+target);
+
+        if (legacy) {
+            PXASSERTM(legacyMount(resolved[i], target), "MountPlan::mount");
+        } else if (move_mount(fds[i], "", AT_FDCWD, target.c_str(), MOVE_MOUNT_F_EMPTY_PATH) != 0) {
+            return PxResult::FResult("MountPlan::mount / move_mount "+target, errno);
+        }
+        attached.push_back(target);
+    }
+    rollback.cancel();
+    return PxResult::Null;
+}
+
+PxResult::Result<void> unmountPath(std::string target) {
+    if (umount2(target.c_str(), UMOUNT_NOFOLLOW) == 0) return PxResult::Null;
+    if (errno != EBUSY) return PxResult::FResult("unmountPath / umount2 "+target, errno);
+
+    // whatever holds it keeps the filesystem alive, but it's gone from the tree
+    PxLog::log.warn(target+" is busy, detaching it lazily.");
+    if (umount2(target.c_str(), UMOUNT_NOFOLLOW | MNT_DETACH) != 0)
+        return PxResult::FResult("unmountPath / umount2 "+target, errno);
+    return PxResult::Null;
+}
+
+PxResult::Result<void> MountPlan::unmount() {
+    if (attached.empty()) return PxResult::Null;
+    TRACE(span, "chroot unmounts");
+
+    PxResult::Result<void> failed = PxResult::Null;
+    std::mutex failedLock;
+    while (!attached.empty()) {
+        // a mount can go once nothing attached after it sits on or under it
+        std::vector<size_t> wave;
+        for (size_t i = 0; i < attached.size(); i++) {
+            bool covered = false;
+            for (size_t j = i + 1; j < attached.size() && !covered; j++) {
+                covered = attached[j] == attached[i] || PxFunction::startsWith(attached[j], attached[i]+"/");
+            }
+            if (!covered) wave.push_back(i);
+        }
+
+        auto run = [&](size_t i) {
+            auto res = unmountPath(attached[i]);
+            std::lock_guard<std::mutex> guard(failedLock);
+            if (res.eno && !failed.eno) failed = res;
+        };
+        if (wave.size() == 1) {
+            run(wave[0]);
+        } else {
+            WorkPool pool(wave.size());
+            for (auto i : wave) pool.submit([&, i]() { run(i); });
+            pool.wait();
+        }
+
+        for (auto it = wave.rbegin(); it != wave.rend(); it++) attached.erase(attached.begin() + *it);
+    }
+    PXASSERTM(failed, "MountPlan::unmount");
+    return PxResult::Null;
+}
+
+MountPlan::~MountPlan() {
+    auto res = unmount();
+    if (res.eno) PxLog::log.warn("Failed to undo the chroot mounts: "+res.funcName+": "+strerror(res.eno));
+}
@@ -0,0 +1,111 @@
+#include <progress.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+ProgressStream progress;
+
+static std::string quote(const std::string &str) {
+    std::string out = "\"";
+    for (unsigned char c : str) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out+"\"";
+}
+
+static std::string number(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", value);
+    return buf;
+}
+
+ProgressStream::~ProgressStream() {
+    if (!enabled()) return;
+    endPhase();
+    // one last try, still without blocking; whatever is left is lost
+    flush();
+}
+
+bool ProgressStream::open(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return false;
+    // this changes the flags for whoever shares the descriptor too, but they handed it to us for this
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    this->fd = fd;
+    return true;
+}
+
+double ProgressStream::elapsed() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+void ProgressStream::flush() {
+    while (!pending.empty()) {
+        ssize_t res = ::write(fd, pending.data(), pending.size());
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return;
+        pending.erase(0, res);
+    }
+}
+
+void ProgressStream::write(std::string fields, bool droppable) {
+    if (!enabled()) return;
+    flush();
+    if (droppable && pending.size() >= maxPending) {
+        dropped++;
+        return;
+    }
+    pending += "{\"elapsed\":"+number(elapsed())+","+fields+"}\n";
+    flush();
+}
+
+void ProgressStream::endPhase() {
+    if (currentPhase.empty()) return;
+
+    long long bytes = 0;
+    for (auto &i : phaseBytes) bytes += i.second;
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - phaseStarted).count();
+    write("\"event\":\"phase_end\",\"phase\":"+quote(currentPhase)+",\"duration\":"+number(duration)+
+        ",\"bytes\":"+std::to_string(bytes)+",\"rate\":"+number(duration > 0 ? bytes / duration : 0)+
+        ",\"dropped\":"+std::to_string(dropped), false);
+    currentPhase = "";
+    phaseBytes.clear();
+}
+
+void ProgressStream::phase(std::string name) {
+    if (!enabled()) return;
+    endPhase();
+    currentPhase = name;
+    phaseStarted = std::chrono::steady_clock::now();
+    write("\"event\":\"phase\",\"phase\":"+quote(name), false);
+}
+
+void ProgressStream::progress(const std::string &item, long long bytes, long long total, double rate, bool done) {
+    if (!enabled()) return;
+    phaseBytes[item] = bytes;
+    write("\"event\":\"progress\",\"phase\":"+quote(currentPhase)+",\"item\":"+quote(item)+
+        ",\"bytes\":"+std::to_string(bytes)+",\"total\":"+std::to_string(total)+
+        ",\"rate\":"+number(rate)+",\"done\":"+(done ? "true" : "false"), !done);
+}
+
+void ProgressStream::event(std::string name, std::vector<std::pair<std::string, std::string>> fields) {
+    if (!enabled()) return;
+    std::string out = "\"event\":"+quote(name);
+    for (auto &i : fields) out += ","+quote(i.first)+":"+quote(i.second);
+    write(out, false);
+}
@@ -0,0 +1,203 @@
+#include <rawimage.hpp>
+#include <progress.hpp>
+#include <trace.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool isRawImage(std::string image) {
+    int fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    DEFER(close_fd, close(fd));
+
+    // the ext superblock starts 1024 bytes in, with its magic 56 bytes into it
+    unsigned char magic[2];
+    if (pread(fd, magic, 2, 1024 + 56) != 2) return false;
+    return magic[0] == 0x53 && magic[1] == 0xef;
+}
+
+static PxResult::Result<size_t> readFull(int fd, unsigned char *buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = pread(fd, buf + done, count - done, offset + done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return PxResult::FResult("readFull / pread", errno);
+        if (res == 0) break;
+        done += res;
+    }
+    return done;
+}
+
+static PxResult::Result<void> writeFull(int fd, const unsigned char *buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = pwrite(fd, buf + done, count - done, offset + done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return PxResult::FResult("writeFull / pwrite", errno);
+        done += res;
+    }
+    return PxResult::Null;
+}
+
+static bool allZero(const unsigned char *buf, size_t count) {
+    // compare in words; the buffers are page aligned and counts are multiples of 8
+    auto words = (const uint64_t*)buf;
+    for (size_t i = 0; i < count / 8; i++) {
+        if (words[i] != 0) return false;
+    }
+    return true;
+}
+
+PxResult::Result<void> writeRawImage(std::string image, std::string device) {
+    int in = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return PxResult::FResult("writeRawImage / open", errno);
+    DEFER(close_in, close(in));
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct stat st;
+    if (fstat(in, &st) != 0) return PxResult::FResult("writeRawImage / fstat", errno);
+    off_t size = st.st_size;
+
+    // O_EXCL on a block device refuses it while it's mounted
+    int out = open(device.c_str(), O_RDWR | O_DIRECT | O_EXCL | O_CLOEXEC);
+    if (out < 0) return PxResult::FResult("writeRawImage / open "+device, errno);
+    DEFER(close_out, close(out));
+
+    uint64_t devsize = 0;
+    if (ioctl(out, BLKGETSIZE64, &devsize) != 0) {
+        struct stat dst;
+        if (fstat(out, &dst) != 0) return PxResult::FResult("writeRawImage / fstat "+device, errno);
+        devsize = dst.st_size;
+    }
+    if (size % 4096 != 0)
+        return PxResult::FResult("writeRawImage (image size isn't a multiple of 4096)", EINVAL);
+    if ((uint64_t)size > devsize)
+        return PxResult::FResult("writeRawImage (image is larger than "+device+")", ENOSPC);
+
+    unsigned char *buf = (unsigned char*)aligned_alloc(4096, rawWriteSize);
+    if (buf == NULL) return PxResult::FResult("writeRawImage / aligned_alloc", ENOMEM);
+    DEFER(free_buf, free(buf));
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL) return PxResult::FResult("writeRawImage / EVP_MD_CTX_new", ENOMEM);
+    DEFER(free_ctx, EVP_MD_CTX_free(ctx));
+
+    LogWriteTask *tsk = new LogWriteTask(device);
+    int logid = PxLog::log.newTask(tsk);
+    auto started = std::chrono::steady_clock::now();
+    auto lastDraw = started;
+    off_t zeroed = 0;
+    auto report = [&](off_t done, bool force) {
+        auto now = std::chrono::steady_clock::now();
+        if (!force && now - lastDraw < std::chrono::milliseconds(100)) return;
+        lastDraw = now;
+
+        std::vector<std::string> strstats;
+        auto elapsed = std::chrono::duration<double>(now - started).count();
+        progress.progress(device, done, size, elapsed > 0 ? done / elapsed : 0, force);
+        if (elapsed > 0) {
+            float spd = std::floor(done / elapsed / 1024. / 1024. * 10.)/10.;
+            strstats.push_back(std::to_string(spd)+" MiB/s");
+        }
+        strstats.push_back(std::to_string((int)std::round((float)done * 100. / (float)size))+"%");
+        strstats.push_back(std::to_string(zeroed / 1024 / 1024)+" MiB skipped");
+        tsk->stats = PxFunction::join(strstats, ", ");
+        PxLog::log.top();
+        PxLog::log.printTasks();
+    };
+    DEFER(fail_task, PxLog::log.completeTask(logid, PxLog::Fail));
+
+    // a run of zero blocks isn't written until we know where it ends
+    off_t zeroStart = -1;
+    unsigned char *zeroes = NULL;
+    DEFER(free_zeroes, free(zeroes));
+    auto flushZeroes = [&](off_t end) -> PxResult::Result<void> {
+        if (zeroStart < 0) return PxResult::Null;
+        off_t len = end - zeroStart;
+        // unlike BLKDISCARD, punching a hole guarantees the range reads back as zeroes
+        if (fallocate(out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, zeroStart, len) != 0) {
+            if (errno != EOPNOTSUPP) return PxResult::FResult("writeRawImage / fallocate", errno);
+            if (zeroes == NULL) {
+                zeroes = (unsigned char*)aligned_alloc(4096, rawWriteSize);
+                if (zeroes == NULL) return PxResult::FResult("writeRawImage / aligned_alloc", ENOMEM);
+                memset(zeroes, 0, rawWriteSize);
+            }
+            for (off_t off = zeroStart; off < end; off += rawWriteSize) {
+                PXASSERTM(writeFull(out, zeroes, std::min((off_t)rawWriteSize, end - off), off), "writeRawImage");
+            }
+        }
+        zeroed += len;
+        zeroStart = -1;
+        return PxResult::Null;
+    };
+
+    TRACE(write_span, "raw write");
+    write_span.addBytes(size);
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    for (off_t off = 0; off < size;) {
+        auto got = readFull(in, buf, std::min((off_t)rawWriteSize, size - off), off);
+        PXASSERTM(got, "writeRawImage");
+        size_t len = got.assert();
+        if (len == 0) return PxResult::FResult("writeRawImage (image shrank while writing)", EIO);
+        EVP_DigestUpdate(ctx, buf, len);
+
+        // write each run of non-zero blocks with one call
+        size_t pos = 0;
+        while (pos < len) {
+            size_t block = std::min(rawZeroBlock, len - pos);
+            if (allZero(buf + pos, block)) {
+                if (zeroStart < 0) zeroStart = off + pos;
+                pos += block;
+                continue;
+            }
+            PXASSERT(flushZeroes(off + pos));
+
+            size_t run = pos + block;
+            while (run < len && !allZero(buf + run, std::min(rawZeroBlock, len - run))) {
+                run += std::min(rawZeroBlock, len - run);
+            }
+            PXASSERTM(writeFull(out, buf + pos, run - pos, off + pos), "writeRawImage");
+            pos = run;
+        }
+        off += len;
+        report(off, false);
+    }
+    PXASSERT(flushZeroes(size));
+    if (fdatasync(out) != 0) return PxResult::FResult("writeRawImage / fdatasync", errno);
+    write_span.finish();
+
+    unsigned char want[EVP_MAX_MD_SIZE], have[EVP_MAX_MD_SIZE];
+    unsigned int wantlen, havelen;
+    EVP_DigestFinal_ex(ctx, want, &wantlen);
+
+    // read back through O_DIRECT, so this checks the device and not our own page cache
+    PxLog::log.info("Verifying "+device+"...");
+    TRACE(verify_span, "raw verify");
+    verify_span.addBytes(size);
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    for (off_t off = 0; off < size;) {
+        auto got = readFull(out, buf, std::min((off_t)rawWriteSize, size - off), off);
+        PXASSERTM(got, "writeRawImage");
+        if (got.assert() == 0) return PxResult::FResult("writeRawImage (short read from "+device+")", EIO);
+        EVP_DigestUpdate(ctx, buf, got.assert());
+        off += got.assert();
+    }
+    EVP_DigestFinal_ex(ctx, have, &havelen);
+    if (wantlen != havelen || memcmp(want, have, wantlen) != 0)
+        return PxResult::FResult("writeRawImage (data on "+device+" doesn't match the image)", EIO);
+
+    fail_task.cancel();
+    report(size, true);
+    PxLog::log.completeTask(logid, PxLog::Success);
+    return PxResult::Null;
+}
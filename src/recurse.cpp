@@ -8,7 +8,24 @@
 #include <PxState.hpp>
 #include <PxFunction.hpp>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <PxDefer.hpp>
+#include <dirent.h>
+#include <memory>
+#include <mutex>
+#include <sys/syscall.h>
+#include <workpool.hpp>
+#include <chrono>
+#include <PxLog.hpp>
 #include <recurse.hpp>
+#include <trace.hpp>
 
 static inline PxResult::Result<void> pxchown(std::string path, uid_t uid, gid_t gid) {
     return PxFunction::wrap("chown", chown(path.c_str(), uid, gid));
@@ -18,6 +35,141 @@ static inline PxResult::Result<void> pxchmod(std::string path, mode_t mode) {
     return PxFunction::wrap("chmod", chmod(path.c_str(), mode));
 }
 
+// Copies `len` bytes at `off` from one file to the same offset in another,
+// using the cheapest mechanism the kernel and filesystems allow.
+static PxResult::Result<void> copyRange(int in, int out, off_t off, off_t len) {
+    // these only get turned off once the kernel says it doesn't have them at all
+    static std::atomic<bool> haveCopyFileRange = true;
+    static std::atomic<bool> haveSendfile = true;
+
+    while (len > 0 && haveCopyFileRange) {
+        loff_t inoff = off, outoff = off;
+        ssize_t res = copy_file_range(in, &inoff, out, &outoff, len, 0);
+        if (res > 0) {
+            off += res;
+            len -= res;
+            continue;
+        }
+        if (res == 0) return PxResult::FResult("copyRange / copy_file_range (short file)", EIO);
+        if (errno == EINTR) continue;
+        if (errno == ENOSYS) haveCopyFileRange = false;
+        // EXDEV, EOPNOTSUPP and friends just mean this pair of files needs something else
+        if (errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL)
+            return PxResult::FResult("copyRange / copy_file_range", errno);
+        break;
+    }
+
+    if (len > 0 && haveSendfile) {
+        if (lseek(out, off, SEEK_SET) < 0) return PxResult::FResult("copyRange / lseek", errno);
+        while (len > 0) {
+            off_t inoff = off;
+            ssize_t res = sendfile(out, in, &inoff, len);
+            if (res > 0) {
+                off += res;
+                len -= res;
+                continue;
+            }
+            if (res == 0) return PxResult::FResult("copyRange / sendfile (short file)", EIO);
+            if (errno == EINTR) continue;
+            if (errno == ENOSYS) haveSendfile = false;
+            if (errno != ENOSYS && errno != EINVAL) return PxResult::FResult("copyRange / sendfile", errno);
+            break;
+        }
+    }
+
+    // last resort, with a fixed-size buffer no matter how big the file is
+    thread_local static char buf[128 * 1024];
+    while (len > 0) {
+        ssize_t res = pread(in, buf, std::min((off_t)sizeof(buf), len), off);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return PxResult::FResult("copyRange / pread", errno);
+        if (res == 0) return PxResult::FResult("copyRange / pread (short file)", EIO);
+
+        ssize_t done = 0;
+        while (done < res) {
+            ssize_t wres = pwrite(out, buf + done, res - done, off + done);
+            if (wres < 0 && errno == EINTR) continue;
+            if (wres < 0) return PxResult::FResult("copyRange / pwrite", errno);
+            done += wres;
+        }
+        off += res;
+        len -= res;
+    }
+    return PxResult::Null;
+}
+
+static PxResult::Result<void> copyData(int in, int out, off_t size) {
+    // a reflink shares the blocks outright, holes and all
+    if (ioctl(out, FICLONE, in) == 0) return PxResult::Null;
+
+    // only copy the parts that actually hold data, so sparse files stay sparse
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(in, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) break;
+        if (data < 0) {
+            // no hole support here, treat the rest as data
+            PXASSERTM(copyRange(in, out, pos, size - pos), "copyData");
+            pos = size;
+            break;
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0) hole = size;
+        hole = std::min(hole, size);
+
+        PXASSERTM(copyRange(in, out, data, hole - data), "copyData");
+        pos = hole;
+    }
+
+    // trailing holes don't get written, so set the length explicitly
+    if (ftruncate(out, size) != 0) return PxResult::FResult("copyData / ftruncate", errno);
+    return PxResult::Null;
+}
+
+static PxResult::Result<void> copyXattrs(int in, int out) {
+    ssize_t len = flistxattr(in, NULL, 0);
+    if (len < 0 && (errno == ENOTSUP || errno == ENOSYS)) return PxResult::Null;
+    if (len <= 0) return PxFunction::wrap("flistxattr", len);
+
+    std::string names(len, '\0');
+    len = flistxattr(in, names.data(), names.size());
+    if (len < 0) return PxResult::FResult("copyXattrs / flistxattr", errno);
+
+    std::string value;
+    for (size_t pos = 0; pos < (size_t)len; pos += strlen(names.c_str() + pos) + 1) {
+        const char *name = names.c_str() + pos;
+        ssize_t vlen = fgetxattr(in, name, NULL, 0);
+        if (vlen < 0) return PxResult::FResult("copyXattrs / fgetxattr", errno);
+        value.resize(vlen);
+        vlen = fgetxattr(in, name, value.data(), value.size());
+        if (vlen < 0) return PxResult::FResult("copyXattrs / fgetxattr", errno);
+        if (fsetxattr(out, name, value.data(), vlen, 0) != 0)
+            return PxResult::FResult("copyXattrs / fsetxattr", errno);
+    }
+    return PxResult::Null;
+}
+
+static PxResult::Result<void> copyFile(std::string pathin, std::string pathout, struct stat& st) {
+    int in = open(pathin.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0) return PxResult::FResult("copyFile / open", errno);
+    DEFER(close_in, close(in));
+
+    int out = open(pathout.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (out < 0) return PxResult::FResult("copyFile / open", errno);
+    DEFER(close_out, close(out));
+
+    PXASSERTM(copyData(in, out, st.st_size), "copyFile");
+
+    // chown before chmod, since chown drops setuid bits
+    PXASSERTM(PxFunction::wrap("fchown", fchown(out, st.st_uid, st.st_gid)), "copyFile");
+    PXASSERTM(PxFunction::wrap("fchmod", fchmod(out, st.st_mode & 07777)), "copyFile");
+    PXASSERTM(copyXattrs(in, out), "copyFile");
+
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    PXASSERTM(PxFunction::wrap("futimens", futimens(out, times)), "copyFile");
+    return PxResult::Null;
+}
+
 PxResult::Result<void> fcopy(std::string pathin, std::string pathout, struct stat& st) {
     if (S_ISDIR(st.st_mode)) {
         // not recursive copy, so just make the directory and give it the same mods.
@@ -26,76 +178,394 @@ PxResult::Result<void> fcopy(std::string pathin, std::string pathout, struct sta
         PXASSERTM(pxchown(pathout, st.st_uid, st.st_gid), "fcopy");
     }
     if (S_ISREG(st.st_mode)) {
-        // TODO: proper copy function
-        auto read_contentres = PxState::fget(pathin);
-        PXASSERTM(read_contentres, "fcopy");
-        PxState::fput(pathout, read_contentres.assert());
-
-        PXASSERTM(pxchown(pathout, st.st_uid, st.st_gid), "fcopy");
-        PXASSERTM(pxchmod(pathout, st.st_mode), "fcopy");
+        PXASSERTM(copyFile(pathin, pathout, st), "fcopy");
     }
     if (S_ISLNK(st.st_mode)) {
         char buf[4096];
-        PXASSERTM(PxFunction::wrap("readlink", readlink(pathin.c_str(), buf, 4096)), "fcopy");
-        symlink(buf, pathout.c_str());
+        ssize_t len = readlink(pathin.c_str(), buf, sizeof(buf));
+        PXASSERTM(PxFunction::wrap("readlink", len), "fcopy");
+        PXASSERTM(PxFunction::wrap("symlink", symlink(std::string(buf, len).c_str(), pathout.c_str())), "fcopy");
         // no chown or chmod, since symlinks don't have permissions
     }
     return PxResult::Null;
 }
 
-PxResult::Result<void> fsrecurse(std::string path, std::string pathrel, fsrhnd_t fenter, fsrhnd_t fexit) {
+// A directory being walked. It stays open until its own exit callback has
+// run, which happens once its listing and every subdirectory are finished.
+struct WalkNode {
+    std::shared_ptr<WalkNode> parent;
+    int fd = -1;
+    std::string name;
+    std::string rel;
     struct stat st;
-    lstat(path.c_str(), &st);
+    std::atomic<size_t> pending = 1;
+};
+
+struct WalkState {
+    fswhnd_t fenter;
+    fswhnd_t fexit;
+    bool statEntries;
+    std::unique_ptr<WorkPool> pool;
+    std::vector<std::function<void()>> stack;
+    std::atomic<bool> failed = false;
+    std::mutex errorLock;
+    PxResult::Result<void> error;
+
+    void fail(PxResult::Result<void> res) {
+        std::lock_guard<std::mutex> guard(errorLock);
+        if (!failed) error = res;
+        failed = true;
+    }
+    void spawn(std::function<void()> fn) {
+        if (pool) pool->submit(fn);
+        else stack.push_back(fn);
+    }
+};
+
+static inline std::string joinRel(const std::string &rel, const char *name) {
+    return rel.empty() ? name : rel + "/" + name;
+}
+
+static void walkComplete(WalkState &ws, std::shared_ptr<WalkNode> node) {
+    while (node && --node->pending == 0) {
+        if (!ws.failed) {
+            int parentfd = node->parent ? node->parent->fd : AT_FDCWD;
+            auto res = ws.fexit({parentfd, node->name.c_str(), node->rel, node->st});
+            if (res.eno) ws.fail(res);
+        }
+        if (node->fd >= 0) close(node->fd);
+        node->fd = -1;
+        node = node->parent;
+    }
+}
+
+static void walkDir(WalkState &ws, std::shared_ptr<WalkNode> node) {
+    if (ws.failed) return walkComplete(ws, node);
 
-    PXASSERT(fenter(path, pathrel, st));
+    int parentfd = node->parent ? node->parent->fd : AT_FDCWD;
+    node->fd = openat(parentfd, node->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (node->fd < 0) {
+        ws.fail(PxResult::FResult("fswalk / openat "+node->rel, errno));
+        return walkComplete(ws, node);
+    }
 
-    if (!S_ISDIR(st.st_mode)) {
-        return fexit(path, pathrel, st);
+    // read the whole listing first, since callbacks are free to change the directory
+    std::vector<std::string> names;
+    std::vector<mode_t> types;
+    char buf[32 * 1024];
+    while (true) {
+        long len = syscall(SYS_getdents64, node->fd, buf, sizeof(buf));
+        if (len < 0) {
+            ws.fail(PxResult::FResult("fswalk / getdents64 "+node->rel, errno));
+            return walkComplete(ws, node);
+        }
+        if (len == 0) break;
+        for (long pos = 0; pos < len;) {
+            auto ent = (struct dirent64*)(buf + pos);
+            pos += ent->d_reclen;
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+            names.push_back(ent->d_name);
+            types.push_back(ent->d_type == DT_UNKNOWN ? 0 : DTTOIF(ent->d_type));
+        }
     }
 
-    for (auto i : std::filesystem::directory_iterator(path)) {
-        if (!pathrel.empty() && !PxFunction::endsWith(pathrel, "/")) {
-            pathrel += "/";
+    for (size_t i = 0; i < names.size(); i++) {
+        if (ws.failed) break;
+        auto &name = names[i];
+
+        struct stat st;
+        if (!ws.statEntries && types[i] != 0) {
+            // the caller only needs the file type, and getdents already told us
+            st = {};
+            st.st_mode = types[i];
+        } else if (fstatat(node->fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            ws.fail(PxResult::FResult("fswalk / fstatat "+joinRel(node->rel, name.c_str()), errno));
+            break;
+        }
+
+        std::string rel = joinRel(node->rel, name.c_str());
+        auto res = ws.fenter({node->fd, name.c_str(), rel, st});
+        if (res.eno) {
+            ws.fail(res);
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            auto child = std::make_shared<WalkNode>();
+            child->parent = node;
+            child->name = name;
+            child->rel = rel;
+            child->st = st;
+            node->pending++;
+            ws.spawn([&ws, child]() { walkDir(ws, child); });
+        } else {
+            res = ws.fexit({node->fd, name.c_str(), rel, st});
+            if (res.eno) {
+                ws.fail(res);
+                break;
+            }
         }
-        PXASSERT(fsrecurse(i.path(), pathrel + i.path().filename().string(), fenter, fexit));
     }
 
-    return fexit(path, pathrel, st);
+    walkComplete(ws, node);
 }
 
-PxResult::Result<void> mergedir(std::string to, std::string from, bool replace) {
-    return fsrecurse(from, "", [from, to, replace](auto _, auto rel, auto st) -> PxResult::Result<void> {
+PxResult::Result<void> fswalk(std::string path, fswhnd_t fenter, fswhnd_t fexit, size_t threads, bool statEntries) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) return PxResult::FResult("fswalk / lstat "+path, errno);
+
+    PXASSERT(fenter({AT_FDCWD, path.c_str(), "", st}));
+    if (!S_ISDIR(st.st_mode)) return fexit({AT_FDCWD, path.c_str(), "", st});
+
+    WalkState ws;
+    ws.fenter = fenter;
+    ws.fexit = fexit;
+    ws.statEntries = statEntries;
+
+    auto root = std::make_shared<WalkNode>();
+    root->name = path;
+    root->st = st;
+
+    if (threads > 1) {
+        ws.pool = std::make_unique<WorkPool>(threads);
+        ws.spawn([&ws, root]() { walkDir(ws, root); });
+        ws.pool->wait();
+    } else {
+        // an explicit stack instead of recursion, so depth is only limited by memory
+        ws.spawn([&ws, root]() { walkDir(ws, root); });
+        while (!ws.stack.empty()) {
+            auto next = std::move(ws.stack.back());
+            ws.stack.pop_back();
+            next();
+        }
+    }
+    root.reset();
+
+    if (ws.failed) return ws.error;
+    return PxResult::Null;
+}
+
+PxResult::Result<void> fsrecurse(std::string path, std::string pathrel, fsrhnd_t fenter, fsrhnd_t fexit) {
+    auto adapt = [path, pathrel](fsrhnd_t fn) -> fswhnd_t {
+        return [path, pathrel, fn](const fsentry_t &e) {
+            struct stat st = e.st;
+            if (e.rel.empty()) return fn(path, pathrel, st);
+            return fn(path+"/"+e.rel, pathrel.empty() ? e.rel : pathrel+"/"+e.rel, st);
+        };
+    };
+    return fswalk(path, adapt(fenter), adapt(fexit));
+}
+
+static PxResult::Result<bool> sameBytes(std::string a, std::string b, off_t size) {
+    int fa = open(a.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fa < 0) return PxResult::FResult("sameBytes / open", errno);
+    DEFER(close_a, close(fa));
+    int fb = open(b.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fb < 0) return PxResult::FResult("sameBytes / open", errno);
+    DEFER(close_b, close(fb));
+
+    posix_fadvise(fa, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fb, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    thread_local static char bufa[64 * 1024], bufb[64 * 1024];
+    for (off_t off = 0; off < size;) {
+        ssize_t la = pread(fa, bufa, sizeof(bufa), off);
+        ssize_t lb = pread(fb, bufb, sizeof(bufb), off);
+        if (la < 0 || lb < 0) return PxResult::FResult("sameBytes / pread", errno);
+        if (la != lb || la == 0) return false;
+        if (memcmp(bufa, bufb, la) != 0) return false;
+        off += la;
+    }
+    return true;
+}
+
+// Whether two paths hold the same thing, ignoring ownership and mode.
+// Regular files with the same size and mtime are taken as equal, like
+// rsync's quick check; otherwise their bytes are compared, stopping at the
+// first difference.
+static PxResult::Result<bool> sameContent(std::string a, const struct stat &sta, std::string b, const struct stat &stb) {
+    if ((sta.st_mode & S_IFMT) != (stb.st_mode & S_IFMT)) return false;
+
+    if (S_ISREG(sta.st_mode)) {
+        if (sta.st_size != stb.st_size) return false;
+        if (sta.st_mtim.tv_sec == stb.st_mtim.tv_sec && sta.st_mtim.tv_nsec == stb.st_mtim.tv_nsec) return true;
+        return sameBytes(a, b, sta.st_size);
+    }
+    if (S_ISLNK(sta.st_mode)) {
+        char bufa[4096], bufb[4096];
+        ssize_t la = readlink(a.c_str(), bufa, sizeof(bufa));
+        ssize_t lb = readlink(b.c_str(), bufb, sizeof(bufb));
+        if (la < 0 || lb < 0) return PxResult::FResult("sameContent / readlink", errno);
+        return la == lb && memcmp(bufa, bufb, la) == 0;
+    }
+    if (S_ISCHR(sta.st_mode) || S_ISBLK(sta.st_mode)) return sta.st_rdev == stb.st_rdev;
+    return true;
+}
+
+// Gives `path` the ownership and mode in `want`, touching only what differs from `have`.
+static PxResult::Result<void> syncMeta(std::string path, const struct stat &want, const struct stat &have) {
+    if (S_ISLNK(have.st_mode)) return PxResult::Null;
+
+    bool chowned = false;
+    if (want.st_uid != have.st_uid || want.st_gid != have.st_gid) {
+        PXASSERTM(pxchown(path, want.st_uid, want.st_gid), "syncMeta");
+        chowned = true;
+    }
+    // chown drops setuid/setgid, so the mode has to be put back after it
+    if (chowned || (want.st_mode & 07777) != (have.st_mode & 07777)) {
+        PXASSERTM(pxchmod(path, want.st_mode & 07777), "syncMeta");
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<void> mergedir(std::string to, std::string from, bool replace, size_t threads, std::string base) {
+    TRACE(span, "merge "+to);
+    std::atomic<size_t> copied = 0, skipped = 0, kept = 0;
+
+    auto res = fswalk(from, [&](const fsentry_t &e) -> PxResult::Result<void> {
+        auto &rel = e.rel;
+        auto &st = e.st;
+        auto dest = rel.empty() ? to : to+"/"+rel;
+        auto src = rel.empty() ? from : from+"/"+rel;
+
         struct stat st2;
-        int err = lstat((to+"/"+rel).c_str(), &st2);
+        int err = lstat(dest.c_str(), &st2);
         
         if (err != 0 && errno != ENOENT) {
             return PxResult::FResult("mergedir / lstat", errno);
         }
-        if (err != 0 && errno == ENOENT) {
-            // do nothing
-        } else if (S_ISDIR(st2.st_mode) || !replace) {
-            if (!S_ISLNK(st2.st_mode)) {
-                PXASSERTM(PxFunction::wrap("chown", chown((to+"/"+rel).c_str(), st.st_uid, st.st_gid)), "mergedir");
-                PXASSERTM(PxFunction::wrap("chmod", chmod((to+"/"+rel).c_str(), st.st_mode)), "mergedir");
+
+        // what the previous version shipped, if we know it
+        struct stat stb;
+        bool haveBase = !base.empty() && lstat((base+"/"+rel).c_str(), &stb) == 0;
+
+        if (err != 0) {
+            if (haveBase && !S_ISDIR(st.st_mode)) {
+                // removed locally and unchanged upstream, so leave it removed
+                auto unchanged = sameContent(base+"/"+rel, stb, src, st);
+                PXASSERTM(unchanged, "mergedir");
+                if (unchanged.assert()) {
+                    kept++;
+                    return PxResult::Null;
+                }
             }
-            return PxResult::Null;
+        } else if (S_ISDIR(st2.st_mode)) {
+            return syncMeta(dest, st, st2);
+        } else if (S_ISDIR(st.st_mode)) {
+            if (!replace) return syncMeta(dest, st, st2);
+            PXASSERTM(PxFunction::wrap("remove", remove(dest.c_str())), "mergedir");
         } else {
-            PXASSERTM(PxFunction::wrap("remove", remove((to+"/"+rel).c_str())), "mergedir");
+            auto same = sameContent(dest, st2, src, st);
+            PXASSERTM(same, "mergedir");
+            if (same.assert()) {
+                skipped++;
+                return syncMeta(dest, st, st2);
+            }
+
+            bool untouched = false;
+            if (!replace && haveBase) {
+                auto baseSame = sameContent(base+"/"+rel, stb, dest, st2);
+                PXASSERTM(baseSame, "mergedir");
+                untouched = baseSame.assert();
+            }
+
+            if (!replace && !untouched) {
+                kept++;
+                if (!haveBase) return syncMeta(dest, st, st2);
+
+                // edited locally: keep it, and leave the new default next to it for the admin
+                auto newDefault = sameContent(base+"/"+rel, stb, src, st);
+                PXASSERTM(newDefault, "mergedir");
+                if (newDefault.assert()) return PxResult::Null;
+                remove((dest+".pxnew").c_str());
+                return fcopy(src, dest+".pxnew", const_cast<struct stat&>(st));
+            }
+            PXASSERTM(PxFunction::wrap("remove", remove(dest.c_str())), "mergedir");
         }
 
-        return fcopy(from+"/"+rel, to+"/"+rel, st);
-    }, FHND_NONE);
+        copied++;
+        return fcopy(src, dest, const_cast<struct stat&>(st));
+    }, FWHND_NONE, threads);
+    PXASSERTM(res, "mergedir");
+
+    PxLog::log.info("Merged "+from+" into "+to+": "+std::to_string(copied)+" copied, "+
+        std::to_string(skipped)+" unchanged, "+std::to_string(kept)+" kept local");
+    return PxResult::Null;
 }
 
-PxResult::Result<void> removerecursedir(std::string dir) {
-    return fsrecurse(dir, "", FHND_NONE, [](auto path, auto _, auto st) -> PxResult::Result<void> {
-        int err;
-        if (S_ISDIR(st.st_mode)) {
-            err = rmdir(path.c_str());
-        } else {
-            err = remove(path.c_str());
-        }
-        if (err) return PxResult::FResult("removerecursedir / remove", errno);
+PxResult::Result<removestats_t> removetree(std::string dir, size_t threads) {
+    std::atomic<size_t> removed = 0;
+    auto started = std::chrono::steady_clock::now();
+
+    // deleting only needs to know what is a directory, so skip stat wherever getdents has the type
+    PXASSERTM(fswalk(dir, FWHND_NONE, [&removed](const fsentry_t &e) -> PxResult::Result<void> {
+        if (unlinkat(e.dirfd, e.name, S_ISDIR(e.st.st_mode) ? AT_REMOVEDIR : 0) != 0)
+            return PxResult::FResult("removetree / unlinkat", errno);
+        removed++;
         return PxResult::Null;
+    }, threads, false), "removetree");
+
+    return removestats_t {
+        .entries = removed,
+        .seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count()
+    };
+}
+
+static void logRemoved(std::string what, removestats_t stats) {
+    auto rate = stats.seconds > 0 ? (size_t)(stats.entries / stats.seconds) : stats.entries;
+    PxLog::log.info("Removed "+what+": "+std::to_string(stats.entries)+" entries in "+
+        std::to_string((int)(stats.seconds * 1000))+" ms ("+std::to_string(rate)+" entries/s)");
+}
+
+PxResult::Result<void> removerecursedir(std::string dir, size_t threads) {
+    auto res = removetree(dir, threads);
+    PXASSERTM(res, "removerecursedir");
+    logRemoved(dir, res.assert());
+    return PxResult::Null;
+}
+
+DeferredRemove::~DeferredRemove() {
+    if (worker.joinable()) worker.join();
+}
+
+PxResult::Result<void> DeferredRemove::add(std::string dir) {
+    if (trash.empty()) return PxResult::FResult("DeferredRemove::add (no trash directory)", EINVAL);
+    if (worker.joinable()) return PxResult::FResult("DeferredRemove::add (already started)", EBUSY);
+
+    // a trash directory left by an interrupted run already holds some of these
+    // names; it's deleted along with everything else, so they are just skipped
+    struct stat st;
+    auto dest = trash+"/"+std::to_string(dirs++);
+    while (lstat(dest.c_str(), &st) == 0) dest = trash+"/"+std::to_string(dirs++);
+    PXASSERTM(PxFunction::wrap("rename", rename(dir.c_str(), dest.c_str())), "DeferredRemove::add");
+    return PxResult::Null;
+}
+
+PxResult::Result<void> DeferredRemove::start(std::string trashdir, size_t threads) {
+    trash = trashdir;
+    this->threads = threads;
+    auto res = PxFunction::wrap("mkdir", mkdir(trash.c_str(), 0700));
+    if (res.eno != EEXIST) PXASSERTM(res, "DeferredRemove::start");
+    return PxResult::Null;
+}
+
+void DeferredRemove::run() {
+    if (trash.empty() || worker.joinable()) return;
+    worker = std::thread([this]() {
+        TRACE(span, "remove old defaults");
+        auto res = removetree(trash, threads);
+        if (res.eno) result = PxResult::FResult(res.funcName, res.eno);
+        else stats = res.assert();
     });
-}
\ No newline at end of file
+}
+
+PxResult::Result<void> DeferredRemove::finish() {
+    if (trash.empty()) return PxResult::Null;
+    if (!worker.joinable()) run();
+    worker.join();
+    trash.clear();
+
+    PXASSERTM(result, "DeferredRemove::finish");
+    logRemoved("old defaults", stats);
+    return PxResult::Null;
+}
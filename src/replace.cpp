@@ -6,72 +6,112 @@
 #include <PxMount.hpp>
 #include <PxDefer.hpp>
 #include <recurse.hpp>
+#include <untar.hpp>
+#include <rawimage.hpp>
+#include <bootfiles.hpp>
+#include <mountplan.hpp>
+#include <replace.hpp>
+#include <trace.hpp>
+#include <cstring>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <thread>
+#include <algorithm>
 
-PxResult::Result<void> replace(std::string replace_with) {
-    PxLog::log.info("Initializing new system...");
-    
-    PxOSConfig::conf c("/data/partitions");
-    PXASSERT(c.readConf());
-
-    PXASSERT(PxOSConfig::InitializeNew(c));
-
-    // save it now, since the previous operation cannot be undone
-    PXASSERT(c.writeConf());
+static size_t walkThreads() {
+    return std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+}
 
+static PxResult::Result<void> mountSecond(PxOSConfig::conf &c) {
     if (!std::filesystem::is_directory("/mnt/.px-second")) {
         std::error_code ec;
         std::filesystem::create_directory("/mnt/.px-second", ec);
         if (ec) return PxResult::FResult("std::filesystem::create_directory", ec.value());
     }
 
-    std::cout << c.oppositePart() << "\n";
     PXASSERTM(PxMount::Mount(c.oppositePart(), "/mnt/.px-second"), "mount second");
+    return PxResult::Null;
+}
+
+// Puts the image on the inactive root and leaves it mounted on /mnt/.px-second.
+static PxResult::Result<void> install(std::string replace_with, PxOSConfig::conf &c, const PxOSConfig::OSConfig &osconf) {
+    // whatever was staged there is about to be overwritten
+    if (!c.staged.empty()) {
+        c.staged.clear();
+        PXASSERT(c.writeConf());
+    }
+
+    // a raw filesystem image goes onto the partition as it is, instead of being unpacked onto a new filesystem
+    bool raw = isRawImage(replace_with);
+    bool reused = false;
+    if (raw) {
+        PxLog::log.info("Writing raw image to new system...");
+        PXASSERT(PxOSConfig::InitializeFromImage(c, replace_with));
+    } else {
+        auto initres = PxOSConfig::InitializeNew(c, osconf.incrementalUpdates);
+        PXASSERT(initres);
+        reused = initres.assert();
+    }
+
+    // save it now, since the previous operation cannot be undone
+    PXASSERT(c.writeConf());
+
+    PXASSERT(mountSecond(c));
     DEFER_RV(umount_second, {
         PxLog::log.info("Cleaning up...");
-        if (system("umount -R /mnt/.px-second") != 0) {
-            return PxResult::FResult("failure", EINVAL);
-        }
+        PXASSERTM(unmountPath("/mnt/.px-second"), "umount second");
     });
 
-    PxLog::log.info("Installing image to new system...");
+    if (!raw) {
+        PxLog::log.info(reused ? "Syncing image onto the inactive system..." : "Installing image to new system...");
 
-    if (system(("tar xpf "+replace_with+" --xattrs-include=\\* -C /mnt/.px-second").c_str()) != 0) {
-        return PxResult::FResult("system", EINVAL);
+        TRACE(span, reused ? "sync image" : "extract image");
+        struct stat st;
+        if (stat(replace_with.c_str(), &st) == 0) span.addBytes(st.st_size);
+        // when syncing onto the old root, our own state next to the image has to survive
+        PXASSERTM(extractImage(replace_with, "/mnt/.px-second", reused, {"lost+found", ".px-defaults", PxOSConfig::layoutFile}), "replace");
     }
 
-    PXASSERTM(mergedir("/boot", "/mnt/.px-second/boot.def", true), "replace");
+    // only a complete install may be synced onto next time
+    PXASSERTM(PxState::fput("/mnt/.px-second/"+(std::string)PxOSConfig::layoutFile, std::to_string(PxOSConfig::layoutVersion)+"\n"), "replace");
+    umount_second.cancel();
+    return PxResult::Null;
+}
+
+// Merges the new root's defaults into the running system, generates its boot
+// files and switches to it. The new root must be mounted on /mnt/.px-second;
+// it is unmounted again before this returns.
+static PxResult::Result<void> switchTo(PxOSConfig::conf &c, const PxOSConfig::OSConfig &osconf) {
+    DEFER_RV(umount_second, {
+        PxLog::log.info("Cleaning up...");
+        PXASSERTM(unmountPath("/mnt/.px-second"), "umount second");
+    });
+
+    size_t threads = walkThreads();
 
-    // TODO: overwrite files with no changes made
-    PXASSERTM(mergedir("/etc", "/mnt/.px-second/etc.def", false), "replace");
-    PXASSERTM(mergedir("/var", "/mnt/.px-second/var.def", false), "replace");
+    PXASSERTM(mergedir("/boot", "/mnt/.px-second/boot.def", true, threads), "replace");
 
-    PXASSERTM(removerecursedir("/mnt/.px-second/etc.def"), "replace");
-    PXASSERTM(removerecursedir("/mnt/.px-second/var.def"), "replace");
-    PXASSERTM(removerecursedir("/mnt/.px-second/boot.def"), "replace");
+    // the running system's copy of its own defaults tells us which files were never edited
+    for (auto &i : {"etc", "var"}) {
+        auto base = "/.px-defaults/"+(std::string)i;
+        if (!std::filesystem::is_directory(base)) base = "";
+        PXASSERTM(mergedir("/"+(std::string)i, "/mnt/.px-second/"+(std::string)i+".def", false, threads, base), "replace");
+    }
 
-    for (auto &i : {"run", "tmp", "proc", "sys", "dev", "data", "boot", "var", "etc"}) {
-        auto newpath = "/mnt/.px-second/"+(std::string)i;
-        if (!std::filesystem::is_directory(newpath)) {
-            std::error_code ec;
-            std::filesystem::create_directory(newpath, ec);
-            if (ec) return PxResult::FResult("std::filesystem::create_directory", ec.value());
-        }
+    // the defaults this root kept from its last install aren't needed by anything
+    // now, so they are deleted while the boot files are generated
+    DeferredRemove defaults;
+    PXASSERTM(defaults.start("/mnt/.px-second/.px-trash", threads), "replace");
+    for (auto &i : {"etc", "var"}) {
+        auto kept = "/mnt/.px-second/.px-defaults/"+(std::string)i;
+        if (std::filesystem::exists(kept)) PXASSERTM(defaults.add(kept), "replace");
     }
+    defaults.run();
 
-    // TODO: unmount individually instead of using recursive unmount
-    // also probably uhhhh... maybe a little more data driven would be nice?
-    PXASSERTM(PxMount::SimpleMount("tmpfs", "/mnt/.px-second/run", "tmpfs"), "mount run");
-    PXASSERTM(PxMount::SimpleMount("tmpfs", "/mnt/.px-second/tmp", "tmpfs"), "mount tmp");
-    PXASSERTM(PxMount::SimpleMount("proc", "/mnt/.px-second/proc", "proc"), "mount proc");
-    PXASSERTM(PxMount::SimpleMount("sysfs", "/mnt/.px-second/sys", "sysfs"), "mount sys");
-    PXASSERTM(PxMount::SimpleMount("devtmpfs", "/mnt/.px-second/dev", "devtmpfs"), "mount dev");
-    PXASSERTM(PxMount::Mount("/boot", "/mnt/.px-second/boot", "", "bind"), "mount boot");
-    PXASSERTM(PxMount::Mount("/root", "/mnt/.px-second/root", "", "bind"), "mount root");
-    PXASSERTM(PxMount::Mount("/var", "/mnt/.px-second/var", "", "bind"), "mount var");
-    PXASSERTM(PxMount::Mount("/etc", "/mnt/.px-second/etc", "", "bind"), "mount etc");
-    PXASSERTM(PxMount::Mount(c.data, "/mnt/.px-second/data"), "mount data");
+    // declared after umount_second, so on failure these come down before the root does
+    MountPlan mounts;
+    PXASSERTM(mounts.parse(osconf.chrootMounts, {{"data", c.data}}), "replace");
+    PXASSERTM(mounts.mount("/mnt/.px-second"), "replace");
 
     c.switchCurrent();
     PXASSERT(c.writeConf());
@@ -81,11 +121,34 @@ PxResult::Result<void> replace(std::string replace_with) {
     });
 
     PxLog::log.info("Generating boot files...");
-    if (system("chroot /mnt/.px-second sh -c 'mkinitcpio -P >/dev/null && grub-mkconfig -o /boot/grub/grub.cfg >/dev/null'") != 0){
-        return PxResult::FResult("system", EINVAL);
-    }
+    TRACE(boot_span, "boot files");
+    PXASSERTM(generateBootFiles("/mnt/.px-second", c.curPart(), osconf.bootCache), "replace");
+    boot_span.finish();
 
     PXASSERT(switch_back.finish());
+    PXASSERTM(defaults.finish(), "replace");
+
+    // until here a failed commit can simply be run again; from here on the
+    // staged root has lost its defaults, so a failure has it installed afresh
+    DEFER(unstage, if (!c.staged.empty()) {
+        c.staged.clear();
+        auto res = c.writeConf();
+        if (res.eno) PxLog::log.warn("Failed to clear the staged version: "+res.funcName+": "+strerror(res.eno));
+    });
+
+    // the new defaults are kept as the base for the next update's merge
+    {
+        auto mkdir_res = PxFunction::wrap("mkdir", mkdir("/mnt/.px-second/.px-defaults", 0755));
+        if (mkdir_res.eno != EEXIST)
+            PXASSERTM(mkdir_res, "replace");
+    }
+    for (auto &i : {"etc", "var"}) {
+        auto kept = "/mnt/.px-second/.px-defaults/"+(std::string)i;
+        PXASSERTM(PxFunction::wrap("rename", rename(("/mnt/.px-second/"+(std::string)i+".def").c_str(), kept.c_str())), "replace");
+    }
+    PXASSERTM(removerecursedir("/mnt/.px-second/boot.def", threads), "replace");
+
+    PXASSERTM(mounts.unmount(), "replace");
     PXASSERT(umount_second.finish());
 
     auto cmd = "sed 's\1" + c.curPart() + "\1" + c.oppositePart() + "\1' /etc/fstab -i";
@@ -94,7 +157,85 @@ PxResult::Result<void> replace(std::string replace_with) {
     }
 
     c.current = c.current == "1" ? "2" : "1";
+    c.staged.clear();
     PXASSERT(c.writeConf());
+    unstage.cancel();
+
+    return PxResult::Null;
+}
+
+// Builds the new root's initramfs images into the boot cache, so the commit
+// only has to copy them out. They are built against copies of /boot and /etc,
+// merged the way the commit will merge the real ones, and thrown away afterwards.
+static PxResult::Result<void> prebuildInitramfs(PxOSConfig::conf &c, const PxOSConfig::OSConfig &osconf) {
+    TRACE(span, "prebuild initramfs");
+    size_t threads = walkThreads();
+    std::string scratch = "/mnt/.px-second/.px-stage";
+    // left over from an interrupted stage
+    if (std::filesystem::exists(scratch)) PXASSERTM(removerecursedir(scratch, threads), "prebuildInitramfs");
+    PXASSERTM(PxFunction::wrap("mkdir", mkdir(scratch.c_str(), 0700)), "prebuildInitramfs");
+
+    PXASSERTM(mergedir(scratch+"/boot", "/boot", true, threads), "prebuildInitramfs");
+    PXASSERTM(mergedir(scratch+"/boot", "/mnt/.px-second/boot.def", true, threads), "prebuildInitramfs");
+    PXASSERTM(mergedir(scratch+"/etc", "/etc", true, threads), "prebuildInitramfs");
+    auto base = std::filesystem::is_directory("/.px-defaults/etc") ? "/.px-defaults/etc" : "";
+    PXASSERTM(mergedir(scratch+"/etc", "/mnt/.px-second/etc.def", false, threads, base), "prebuildInitramfs");
+
+    {
+        MountPlan mounts;
+        PXASSERTM(mounts.parse(osconf.chrootMounts, {{"data", c.data}}), "prebuildInitramfs");
+        mounts.redirect("/boot", scratch+"/boot");
+        mounts.redirect("/etc", scratch+"/etc");
+        PXASSERTM(mounts.mount("/mnt/.px-second"), "prebuildInitramfs");
+
+        PxLog::log.info("Generating initramfs images...");
+        PXASSERTM(generateBootFiles("/mnt/.px-second", c.oppositePart(), osconf.bootCache, false), "prebuildInitramfs");
+        PXASSERTM(mounts.unmount(), "prebuildInitramfs");
+    }
 
+    PXASSERTM(removerecursedir(scratch, threads), "prebuildInitramfs");
     return PxResult::Null;
-}
\ No newline at end of file
+}
+
+PxResult::Result<void> replace(std::string replace_with, const PxOSConfig::OSConfig &osconf) {
+    PxLog::log.info("Initializing new system...");
+
+    PxOSConfig::conf c("/data/partitions");
+    PXASSERT(c.readConf());
+
+    PXASSERT(install(replace_with, c, osconf));
+    PXASSERT(switchTo(c, osconf));
+    return PxResult::Null;
+}
+
+PxResult::Result<void> stage(std::string image, std::string version, const PxOSConfig::OSConfig &osconf) {
+    PxLog::log.info("Initializing new system...");
+
+    PxOSConfig::conf c("/data/partitions");
+    PXASSERT(c.readConf());
+
+    PXASSERT(install(image, c, osconf));
+    DEFER_RV(umount_second, {
+        PxLog::log.info("Cleaning up...");
+        PXASSERTM(unmountPath("/mnt/.px-second"), "umount second");
+    });
+
+    // without a cache there is nowhere to keep them, so the commit builds them itself
+    if (!osconf.bootCache.empty()) PXASSERTM(prebuildInitramfs(c, osconf), "stage");
+    PXASSERT(umount_second.finish());
+
+    c.staged = version;
+    PXASSERT(c.writeConf());
+    return PxResult::Null;
+}
+
+PxResult::Result<std::string> commit(const PxOSConfig::OSConfig &osconf) {
+    PxOSConfig::conf c("/data/partitions");
+    PXASSERT(c.readConf());
+    if (c.staged.empty()) return PxResult::FResult("commit (nothing is staged)", ENOENT);
+    auto version = c.staged;
+
+    PXASSERT(mountSecond(c));
+    PXASSERTM(switchTo(c, osconf), "commit");
+    return version;
+}
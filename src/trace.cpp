@@ -0,0 +1,184 @@
+#include <trace.hpp>
+#include <PxLog.hpp>
+#include <PxState.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Trace {
+    struct record_t {
+        std::string name;
+        pid_t tid;
+        int64_t start;
+        int64_t duration;
+        counters_t used;
+        int64_t bytes;
+    };
+
+    static bool on = false;
+    static std::string tracePath;
+    static std::chrono::steady_clock::time_point epoch;
+    static std::mutex lock;
+    static std::vector<record_t> records;
+
+    static int64_t micros(std::chrono::steady_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    }
+
+    static int64_t ioField(const char *buf, const char *name) {
+        auto at = strstr(buf, name);
+        return at == NULL ? 0 : strtoll(at + strlen(name), NULL, 10);
+    }
+
+    counters_t sample() {
+        counters_t out = {0, 0, 0};
+
+        struct rusage self, children;
+        getrusage(RUSAGE_SELF, &self);
+        getrusage(RUSAGE_CHILDREN, &children);
+        for (auto *ru : {&self, &children}) {
+            out.cpu += (int64_t)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000 + ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+        }
+
+        // read directly rather than through PxState, since this runs twice per span
+        int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return out;
+        char buf[512];
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0) return out;
+        buf[len] = 0;
+
+        out.syscalls = ioField(buf, "syscr: ") + ioField(buf, "syscw: ");
+        out.ioBytes = ioField(buf, "read_bytes: ") + ioField(buf, "\nwrite_bytes: ");
+        return out;
+    }
+
+    Span::Span(std::string name) : name(name), active(on) {
+        if (!active) return;
+        start = std::chrono::steady_clock::now();
+        startCounters = sample();
+    }
+
+    Span::~Span() {
+        finish();
+    }
+
+    void Span::finish() {
+        if (!active) return;
+        active = false;
+
+        auto end = std::chrono::steady_clock::now();
+        auto now = sample();
+        record_t rec = {
+            .name = name,
+            .tid = gettid(),
+            .start = micros(start - epoch),
+            .duration = micros(end - start),
+            .used = {
+                now.cpu - startCounters.cpu,
+                now.syscalls - startCounters.syscalls,
+                now.ioBytes - startCounters.ioBytes
+            },
+            .bytes = bytes
+        };
+
+        std::lock_guard<std::mutex> guard(lock);
+        records.push_back(rec);
+    }
+
+    void enable(std::string path) {
+        if (on) return;
+        on = true;
+        tracePath = path;
+        epoch = std::chrono::steady_clock::now();
+        // also runs on the exit() paths, which never get back to main
+        atexit([]() {
+            auto res = report();
+            if (res.eno) PxLog::log.warn("Failed to write the trace: "+res.funcName+": "+strerror(res.eno));
+        });
+    }
+
+    bool enabled() {
+        return on;
+    }
+
+    static std::string escape(const std::string &str) {
+        std::string out;
+        for (char c : str) {
+            if (c == '"' || c == '\\') out += '\\';
+            if ((unsigned char)c >= 0x20) out += c;
+        }
+        return out;
+    }
+
+    PxResult::Result<void> report() {
+        if (!on) return PxResult::Null;
+        on = false;
+
+        std::lock_guard<std::mutex> guard(lock);
+        int64_t total = micros(std::chrono::steady_clock::now() - epoch);
+
+        struct summary_t {
+            size_t count = 0;
+            int64_t duration = 0;
+            counters_t used = {0, 0, 0};
+            int64_t bytes = 0;
+        };
+        std::map<std::string, summary_t> byName;
+        for (auto &i : records) {
+            auto &s = byName[i.name];
+            s.count++;
+            s.duration += i.duration;
+            s.used.cpu += i.used.cpu;
+            s.used.syscalls += i.used.syscalls;
+            s.used.ioBytes += i.used.ioBytes;
+            s.bytes += i.bytes;
+        }
+
+        // slowest first, since that's where to look next
+        std::vector<std::pair<std::string, summary_t>> sorted(byName.begin(), byName.end());
+        std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) { return a.second.duration > b.second.duration; });
+
+        auto ms = [](int64_t us) { return std::to_string(us / 1000)+" ms"; };
+        PxLog::log.info("Trace summary ("+ms(total)+" total):");
+        for (auto &[name, s] : sorted) {
+            std::string line = "  "+name+": "+ms(s.duration)+
+                " ("+std::to_string((int)std::round(total > 0 ? s.duration * 100. / total : 0))+"%)";
+            if (s.count > 1) line += " over "+std::to_string(s.count)+" spans";
+            line += ", cpu "+ms(s.used.cpu)+", "+std::to_string(s.used.syscalls)+" syscalls, "+
+                std::to_string(s.used.ioBytes / 1024 / 1024)+" MiB disk I/O";
+            if (s.bytes > 0 && s.duration > 0) {
+                line += ", "+std::to_string(s.bytes / 1024 / 1024)+" MiB at "+
+                    std::to_string((int)std::round(s.bytes / (s.duration / 1e6) / 1024 / 1024))+" MiB/s";
+            }
+            PxLog::log.info(line);
+        }
+
+        if (tracePath.empty()) return PxResult::Null;
+
+        // the Trace Event Format's complete events, which chrome://tracing and Perfetto both open
+        std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        pid_t pid = getpid();
+        for (size_t i = 0; i < records.size(); i++) {
+            auto &r = records[i];
+            if (i > 0) out += ",";
+            out += "\n{\"name\":\""+escape(r.name)+"\",\"cat\":\"pxos\",\"ph\":\"X\",\"pid\":"+std::to_string(pid)+
+                ",\"tid\":"+std::to_string(r.tid)+",\"ts\":"+std::to_string(r.start)+",\"dur\":"+std::to_string(r.duration)+
+                ",\"args\":{\"cpu_us\":"+std::to_string(r.used.cpu)+",\"syscalls\":"+std::to_string(r.used.syscalls)+
+                ",\"io_bytes\":"+std::to_string(r.used.ioBytes)+",\"bytes\":"+std::to_string(r.bytes)+"}}";
+        }
+        out += "\n]}\n";
+        PXASSERTM(PxState::fput(tracePath, out), "Trace::report");
+        PxLog::log.info("Wrote trace to "+tracePath);
+        return PxResult::Null;
+    }
+}
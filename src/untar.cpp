@@ -0,0 +1,733 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <PxFunction.hpp>
+#include <PxDefer.hpp>
+#include <algorithm>
+#include <atomic>
+#include <recurse.hpp>
+#include <untar.hpp>
+
+static off_t parseNumber(const char *field, size_t len) {
+    // GNU base-256 encoding for values that don't fit in octal
+    if ((unsigned char)field[0] & 0x80) {
+        off_t value = field[0] & 0x3f;
+        for (size_t i = 1; i < len; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+
+    off_t value = 0;
+    size_t i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == '\0')) i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static std::string parseString(const char *field, size_t len) {
+    return std::string(field, strnlen(field, len));
+}
+
+static inline size_t paddingFor(off_t size) {
+    return (512 - size % 512) % 512;
+}
+
+// Makes an archive path relative to the extraction root, the way tar strips
+// leading slashes. Returns false for anything that would escape the root.
+static bool normalizePath(std::string &path) {
+    std::vector<std::string> parts;
+    for (auto &i : PxFunction::split(path, "/")) {
+        if (i.empty() || i == ".") continue;
+        if (i == "..") return false;
+        parts.push_back(i);
+    }
+    path = parts.empty() ? "." : PxFunction::join(parts, "/");
+    return true;
+}
+
+TarExtractor::~TarExtractor() {
+    // workers may still be using rootfd
+    pool.reset();
+    if (outfd >= 0) close(outfd);
+    if (rootfd >= 0) close(rootfd);
+    if (rootfd >= 0 || wbuf != NULL) umask(oldmask);
+    free(wbuf);
+}
+
+PxResult::Result<void> TarExtractor::open() {
+    rootfd = ::open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd < 0) return PxResult::FResult("TarExtractor::open / open", errno);
+
+    wbuf = (char*)aligned_alloc(4096, writeSize);
+    if (wbuf == NULL) return PxResult::FResult("TarExtractor::open / aligned_alloc", ENOMEM);
+
+    if (threads > 1 && contiguous) pool = std::make_unique<WorkPool>(threads);
+
+    // entries are created with their final modes, so nothing may be masked off
+    oldmask = umask(0);
+
+    started = lastDraw = std::chrono::steady_clock::now();
+    return PxResult::Null;
+}
+
+PxResult::Result<void> TarExtractor::processHeader() {
+    bool empty = true;
+    for (size_t i = 0; i < 512 && empty; i++) empty = hdr[i] == 0;
+    if (empty) {
+        state = End;
+        return PxResult::Null;
+    }
+
+    // the checksum is computed with its own field filled with spaces
+    unsigned long sum = 0;
+    long ssum = 0;
+    for (size_t i = 0; i < 512; i++) {
+        char c = (i >= 148 && i < 156) ? ' ' : hdr[i];
+        sum += (unsigned char)c;
+        ssum += (signed char)c;
+    }
+    off_t want = parseNumber(hdr+148, 8);
+    if (want != (off_t)sum && want != (off_t)ssum)
+        return PxResult::FResult("TarExtractor::processHeader (bad checksum)", EINVAL);
+
+    char type = hdr[156];
+    off_t size = parseNumber(hdr+124, 12);
+
+    if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+        metaType = type;
+        meta.clear();
+        remaining = size;
+        padding = paddingFor(size);
+        state = Meta;
+        if (remaining == 0) return processMeta();
+        return PxResult::Null;
+    }
+
+    if (type == 'S') return PxResult::FResult("TarExtractor::processHeader (sparse files are not supported)", ENOTSUP);
+
+    cur = Entry();
+    cur.type = type;
+    cur.path = parseString(hdr, 100);
+    if (strncmp(hdr+257, "ustar", 5) == 0 && hdr[345] != 0) {
+        cur.path = parseString(hdr+345, 155)+"/"+cur.path;
+    }
+    cur.linkpath = parseString(hdr+157, 100);
+    cur.mode = parseNumber(hdr+100, 8);
+    cur.uid = parseNumber(hdr+108, 8);
+    cur.gid = parseNumber(hdr+116, 8);
+    cur.size = size;
+    cur.mtime.tv_sec = parseNumber(hdr+136, 12);
+    cur.devmajor = parseNumber(hdr+329, 8);
+    cur.devminor = parseNumber(hdr+337, 8);
+
+    if (!longName.empty()) cur.path = longName;
+    if (!longLink.empty()) cur.linkpath = longLink;
+    longName.clear();
+    longLink.clear();
+
+    for (auto *records : {&paxGlobal, &paxNext}) {
+        for (auto &[key, value] : *records) {
+            try {
+                if (key == "path") cur.path = value;
+                else if (key == "linkpath") cur.linkpath = value;
+                else if (key == "size") cur.size = std::stoll(value);
+                else if (key == "uid") cur.uid = std::stoul(value);
+                else if (key == "gid") cur.gid = std::stoul(value);
+                else if (key == "mtime") {
+                    auto dot = value.find('.');
+                    cur.mtime.tv_sec = std::stoll(value.substr(0, dot));
+                    if (dot != std::string::npos) {
+                        auto frac = (value.substr(dot+1)+"000000000").substr(0, 9);
+                        cur.mtime.tv_nsec = std::stol(frac);
+                    }
+                }
+                else if (PxFunction::startsWith(key, "SCHILY.xattr.")) cur.xattrs.push_back({key.substr(13), value});
+            } catch (std::exception &e) {
+                return PxResult::FResult("TarExtractor::processHeader (bad pax record "+key+")", EINVAL);
+            }
+        }
+    }
+    paxNext.clear();
+
+    bool isFile = type == '0' || type == '7' || type == '\0';
+    remaining = isFile ? cur.size : size;
+    padding = paddingFor(remaining);
+    state = isFile ? Data : Skip;
+
+    entries++;
+    PXASSERT(begin());
+
+    if (remaining == 0) {
+        // begin() turns the data into Skip when an incremental sync finds the file already in place
+        if (state == Data && pool) queue(cur, NULL);
+        else if (state == Data) PXASSERT(finishFile());
+        state = padding ? Padding : Header;
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<void> TarExtractor::processMeta() {
+    state = padding ? Padding : Header;
+
+    if (metaType == 'L') {
+        longName = parseString(meta.data(), meta.size());
+        return PxResult::Null;
+    }
+    if (metaType == 'K') {
+        longLink = parseString(meta.data(), meta.size());
+        return PxResult::Null;
+    }
+
+    // pax records look like "<length> <key>=<value>\n", where length covers the whole record
+    auto &records = metaType == 'g' ? paxGlobal : paxNext;
+    size_t pos = 0;
+    while (pos < meta.size()) {
+        size_t space = meta.find(' ', pos);
+        if (space == std::string::npos) break;
+        size_t len = strtoul(meta.c_str() + pos, NULL, 10);
+        if (len == 0 || pos + len > meta.size())
+            return PxResult::FResult("TarExtractor::processMeta (bad pax header)", EINVAL);
+
+        std::string record = meta.substr(space+1, pos + len - space - 2);
+        size_t eq = record.find('=');
+        if (eq != std::string::npos) {
+            records.push_back({record.substr(0, eq), record.substr(eq+1)});
+        }
+        pos += len;
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<void> TarExtractor::applyMeta(int fd, const Entry &e, bool isLink) {
+    // new files already belong to root, so only chown (and re-apply the mode it clears) when that's wrong
+    if (e.uid != 0 || e.gid != 0) {
+        if (isLink) {
+            if (fchownat(rootfd, e.path.c_str(), e.uid, e.gid, AT_SYMLINK_NOFOLLOW) != 0)
+                return PxResult::FResult("TarExtractor::applyMeta / fchownat", errno);
+        } else {
+            if (fchown(fd, e.uid, e.gid) != 0) return PxResult::FResult("TarExtractor::applyMeta / fchown", errno);
+            if (fchmod(fd, e.mode & 07777) != 0) return PxResult::FResult("TarExtractor::applyMeta / fchmod", errno);
+        }
+    }
+
+    for (auto &[name, value] : e.xattrs) {
+        int err;
+        if (isLink) {
+            err = lsetxattr((dest+"/"+e.path).c_str(), name.c_str(), value.data(), value.size(), 0);
+        } else {
+            err = fsetxattr(fd, name.c_str(), value.data(), value.size(), 0);
+        }
+        if (err != 0) return PxResult::FResult("TarExtractor::applyMeta / setxattr "+name, errno);
+    }
+
+    struct timespec times[2] = {{0, UTIME_OMIT}, e.mtime};
+    int err = isLink ? utimensat(rootfd, e.path.c_str(), times, AT_SYMLINK_NOFOLLOW) : futimens(fd, times);
+    if (err != 0) return PxResult::FResult("TarExtractor::applyMeta / utimens", errno);
+
+    return PxResult::Null;
+}
+
+// Checks whether what an older tree has at e.path is exactly what the archive
+// describes, so an incremental sync can leave it alone. A directory standing
+// where something else goes is removed, since creating the entry can't replace it.
+PxResult::Result<bool> TarExtractor::reuse(const Entry &e) {
+    struct stat st;
+    if (fstatat(rootfd, e.path.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno == ENOENT) return false;
+        return PxResult::FResult("TarExtractor::reuse / fstatat "+e.path, errno);
+    }
+    if (S_ISDIR(st.st_mode)) {
+        auto res = removetree(dest+"/"+e.path);
+        if (res.eno) return PxResult::FResult(res.funcName, res.eno);
+        return false;
+    }
+
+    mode_t fmt = e.type == '2' ? S_IFLNK : e.type == '3' ? S_IFCHR : e.type == '4' ? S_IFBLK : e.type == '6' ? S_IFIFO : S_IFREG;
+    if ((st.st_mode & S_IFMT) != fmt || st.st_uid != e.uid || st.st_gid != e.gid) return false;
+    if (st.st_mtim.tv_sec != e.mtime.tv_sec || st.st_mtim.tv_nsec != e.mtime.tv_nsec) return false;
+    if (fmt != S_IFLNK && (st.st_mode & 07777) != (e.mode & 07777)) return false;
+    if (fmt == S_IFREG && st.st_size != e.size) return false;
+    if ((fmt == S_IFCHR || fmt == S_IFBLK) && st.st_rdev != makedev(e.devmajor, e.devminor)) return false;
+    if (fmt == S_IFLNK) {
+        std::string target(e.linkpath.size() + 1, '\0');
+        ssize_t len = readlinkat(rootfd, e.path.c_str(), target.data(), target.size());
+        if (len != (ssize_t)e.linkpath.size() || target.compare(0, len, e.linkpath) != 0) return false;
+    }
+
+    // xattrs (file capabilities in particular) are as much a part of the entry as its data
+    auto path = dest+"/"+e.path;
+    ssize_t listlen = llistxattr(path.c_str(), NULL, 0);
+    std::string names(std::max(listlen, (ssize_t)0), '\0');
+    if (listlen > 0) listlen = llistxattr(path.c_str(), names.data(), names.size());
+    size_t count = listlen > 0 ? std::count(names.begin(), names.begin() + listlen, '\0') : 0;
+    if (count != e.xattrs.size()) return false;
+    for (auto &[name, value] : e.xattrs) {
+        std::string have(value.size() + 1, '\0');
+        ssize_t len = lgetxattr(path.c_str(), name.c_str(), have.data(), have.size());
+        if (len != (ssize_t)value.size() || have.compare(0, len, value) != 0) return false;
+    }
+    return true;
+}
+
+// Like tar, replace whatever is in the way, but only after the fast path failed.
+template<typename F> static int replacing(int rootfd, const char *path, F fn) {
+    int res = fn();
+    if (res < 0 && errno == EEXIST) {
+        unlinkat(rootfd, path, 0);
+        res = fn();
+    }
+    return res;
+}
+
+PxResult::Result<void> TarExtractor::createNode(const Entry &e) {
+    const char *path = e.path.c_str();
+    mode_t mode = e.mode & 07777;
+
+    if (incremental) {
+        auto same = reuse(e);
+        PXASSERT(same);
+        if (same.assert()) {
+            reused++;
+            return PxResult::Null;
+        }
+    }
+
+    if (e.type == '2') {
+        if (replacing(rootfd, path, [&]() { return symlinkat(e.linkpath.c_str(), rootfd, path); }) != 0)
+            return PxResult::FResult("TarExtractor::createNode / symlinkat "+e.path, errno);
+        return applyMeta(-1, e, true);
+    }
+
+    mode_t fmt = e.type == '3' ? S_IFCHR : e.type == '4' ? S_IFBLK : S_IFIFO;
+    if (replacing(rootfd, path, [&]() { return mknodat(rootfd, path, fmt | mode, makedev(e.devmajor, e.devminor)); }) != 0)
+        return PxResult::FResult("TarExtractor::createNode / mknodat "+e.path, errno);
+    if (e.uid != 0 || e.gid != 0) {
+        if (fchownat(rootfd, path, e.uid, e.gid, AT_SYMLINK_NOFOLLOW) != 0 ||
+            fchmodat(rootfd, path, mode, 0) != 0)
+            return PxResult::FResult("TarExtractor::createNode / fchownat "+e.path, errno);
+    }
+    // device nodes can't be opened safely, so go through the path like for symlinks
+    Entry node = e;
+    node.uid = node.gid = 0;
+    return applyMeta(-1, node, true);
+}
+
+PxResult::Result<void> TarExtractor::writeFile(const Entry &e, const char *data) {
+    const char *path = e.path.c_str();
+
+    if (incremental) {
+        auto same = reuse(e);
+        PXASSERT(same);
+        if (same.assert()) {
+            reused++;
+            return PxResult::Null;
+        }
+    }
+    int fd = replacing(rootfd, path, [&]() { return openat(rootfd, path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, e.mode & 07777); });
+    if (fd < 0) return PxResult::FResult("TarExtractor::writeFile / openat "+e.path, errno);
+    DEFER(close_fd, close(fd));
+
+    if (e.size > (off_t)writeSize) fallocate(fd, 0, 0, e.size);
+
+    off_t done = 0;
+    while (done < e.size) {
+        ssize_t res = pwrite(fd, data + done, std::min((off_t)writeSize * 8, e.size - done), done);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return PxResult::FResult("TarExtractor::writeFile / pwrite "+e.path, errno);
+        }
+        done += res;
+    }
+
+    return applyMeta(fd, e, false);
+}
+
+void TarExtractor::queue(const Entry &e, const char *data) {
+    batch.push_back({e, data});
+    batchBytes += e.size;
+    // small entries are handed out in groups so the pool isn't dominated by locking
+    if (batch.size() >= 64 || batchBytes >= (off_t)(8 * writeSize)) flushBatch();
+}
+
+void TarExtractor::flushBatch() {
+    if (batch.empty()) return;
+
+    auto jobs = std::make_shared<std::vector<std::pair<Entry, const char*>>>(std::move(batch));
+    batch.clear();
+    batchBytes = 0;
+
+    // keep the reader from running arbitrarily far ahead of the writers
+    pool->waitBelow(pool->size() * 16);
+    pool->submit([this, jobs]() {
+        for (auto &[e, data] : *jobs) {
+            if (failed) return;
+            auto res = e.type == '2' || e.type == '3' || e.type == '4' || e.type == '6' ? createNode(e) : writeFile(e, data);
+            if (res.eno) {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (!failed) workerError = res;
+                failed = true;
+                return;
+            }
+        }
+    });
+}
+
+PxResult::Result<void> TarExtractor::begin() {
+    if (!normalizePath(cur.path))
+        return PxResult::FResult("TarExtractor::begin (unsafe path "+cur.path+")", EPERM);
+
+    const char *path = cur.path.c_str();
+    if (incremental) seen.insert(cur.path);
+
+    switch (cur.type) {
+        case '0': case '7': case '\0': {
+            // with a pool, the data is collected by update() and the file is written by a worker
+            if (pool) return PxResult::Null;
+
+            if (incremental) {
+                auto same = reuse(cur);
+                PXASSERT(same);
+                if (same.assert()) {
+                    reused++;
+                    state = Skip;
+                    return PxResult::Null;
+                }
+            }
+
+            outfd = replacing(rootfd, path, [&]() { return openat(rootfd, path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, cur.mode & 07777); });
+            if (outfd < 0) return PxResult::FResult("TarExtractor::begin / openat "+cur.path, errno);
+            // one allocation up front keeps big files contiguous
+            if (cur.size > (off_t)writeSize) fallocate(outfd, 0, 0, cur.size);
+            woff = 0;
+            wlen = 0;
+            return PxResult::Null;
+        }
+        case '5': {
+            // always made here by the reader, so a directory exists before anything queued inside it
+            if (mkdirat(rootfd, path, 0700) != 0) {
+                if (errno != EEXIST) return PxResult::FResult("TarExtractor::begin / mkdirat "+cur.path, errno);
+
+                // an older tree may have something else by this name
+                struct stat st;
+                if (incremental && fstatat(rootfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(st.st_mode)) {
+                    if (unlinkat(rootfd, path, 0) != 0 || mkdirat(rootfd, path, 0700) != 0)
+                        return PxResult::FResult("TarExtractor::begin / mkdirat "+cur.path, errno);
+                }
+            }
+
+            // a directory that already existed may belong to someone else
+            if (cur.uid != 0 || cur.gid != 0 || incremental) {
+                if (fchownat(rootfd, path, cur.uid, cur.gid, AT_SYMLINK_NOFOLLOW) != 0)
+                    return PxResult::FResult("TarExtractor::begin / fchownat "+cur.path, errno);
+            }
+            for (auto &[name, value] : cur.xattrs) {
+                if (lsetxattr((dest+"/"+cur.path).c_str(), name.c_str(), value.data(), value.size(), 0) != 0)
+                    return PxResult::FResult("TarExtractor::begin / lsetxattr "+name, errno);
+            }
+            dirs.push_back(cur);
+            return PxResult::Null;
+        }
+        case '2': case '3': case '4': case '6': {
+            if (pool) {
+                queue(cur, NULL);
+                return PxResult::Null;
+            }
+            return createNode(cur);
+        }
+        case '1': {
+            if (!normalizePath(cur.linkpath))
+                return PxResult::FResult("TarExtractor::begin (unsafe link target "+cur.linkpath+")", EPERM);
+            // the target may still be in a worker's queue, so links wait until the pool is drained
+            if (pool) {
+                links.push_back(cur);
+                return PxResult::Null;
+            }
+            return makeLink(cur);
+        }
+        default:
+            PxLog::log.warn("Skipping unsupported tar entry type '"+std::string(1, cur.type)+"' for "+cur.path);
+            return PxResult::Null;
+    }
+}
+
+PxResult::Result<void> TarExtractor::makeLink(const Entry &e) {
+    const char *path = e.path.c_str();
+
+    if (incremental) {
+        struct stat st, target;
+        if (fstatat(rootfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            fstatat(rootfd, e.linkpath.c_str(), &target, AT_SYMLINK_NOFOLLOW) == 0 &&
+            st.st_dev == target.st_dev && st.st_ino == target.st_ino) {
+            reused++;
+            return PxResult::Null;
+        }
+    }
+    if (replacing(rootfd, path, [&]() { return linkat(rootfd, e.linkpath.c_str(), rootfd, path, 0); }) != 0)
+        return PxResult::FResult("TarExtractor::makeLink / linkat "+e.path, errno);
+    return PxResult::Null;
+}
+
+PxResult::Result<void> TarExtractor::flush() {
+    size_t done = 0;
+    while (done < wlen) {
+        ssize_t res = pwrite(outfd, wbuf + done, wlen - done, woff);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return PxResult::FResult("TarExtractor::flush / pwrite "+cur.path, errno);
+        }
+        done += res;
+        woff += res;
+    }
+    wlen = 0;
+    return PxResult::Null;
+}
+
+PxResult::Result<void> TarExtractor::writeData(const char *data, size_t count) {
+    // big chunks (like an mmapped image) go straight to the file, small ones are gathered first
+    if (wlen == 0 && count >= writeSize) {
+        size_t done = 0;
+        while (done < count) {
+            ssize_t res = pwrite(outfd, data + done, count - done, woff);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                return PxResult::FResult("TarExtractor::writeData / pwrite "+cur.path, errno);
+            }
+            done += res;
+            woff += res;
+        }
+        return PxResult::Null;
+    }
+
+    while (count > 0) {
+        size_t take = std::min(count, writeSize - wlen);
+        memcpy(wbuf + wlen, data, take);
+        wlen += take;
+        data += take;
+        count -= take;
+        if (wlen == writeSize) PXASSERT(flush());
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<void> TarExtractor::finishFile() {
+    PXASSERT(flush());
+    auto res = applyMeta(outfd, cur, false);
+    close(outfd);
+    outfd = -1;
+    return res;
+}
+
+PxResult::Result<void> TarExtractor::update(const char *data, size_t count) {
+    if (failed) {
+        std::lock_guard<std::mutex> guard(errorLock);
+        result = workerError;
+    }
+    if (result.eno) return result;
+    consumed += count;
+
+    while (count > 0 && state != End) {
+        size_t take;
+        switch (state) {
+            case Header:
+                take = std::min(count, 512 - hdrlen);
+                memcpy(hdr + hdrlen, data, take);
+                hdrlen += take;
+                if (hdrlen == 512) {
+                    hdrlen = 0;
+                    result = processHeader();
+                }
+                break;
+            case Meta:
+                take = std::min((off_t)count, remaining);
+                meta.append(data, take);
+                remaining -= take;
+                if (remaining == 0) result = processMeta();
+                break;
+            case Data:
+                take = std::min((off_t)count, remaining);
+                if (pool) {
+                    // the input is one stable buffer, so remember where the file starts and let a worker write it
+                    if (!capturing) dataStart = data;
+                    capturing = true;
+                    remaining -= take;
+                    if (remaining == 0) {
+                        queue(cur, dataStart);
+                        capturing = false;
+                        state = padding ? Padding : Header;
+                    }
+                    break;
+                }
+                result = writeData(data, take);
+                remaining -= take;
+                if (remaining == 0 && !result.eno) {
+                    result = finishFile();
+                    state = padding ? Padding : Header;
+                }
+                break;
+            case Skip:
+                take = std::min((off_t)count, remaining);
+                remaining -= take;
+                if (remaining == 0) state = padding ? Padding : Header;
+                break;
+            case Padding:
+                take = std::min(count, padding);
+                padding -= take;
+                if (padding == 0) state = Header;
+                break;
+            case End:
+                take = count;
+                break;
+        }
+        if (result.eno) return result;
+        data += take;
+        count -= take;
+    }
+
+    updateTask();
+    return PxResult::Null;
+}
+
+// Deletes everything under `dest` that isn't in `seen`, children before their
+// directories, leaving the top-level names in `keep` alone.
+static PxResult::Result<size_t> pruneTree(std::string dest, const std::unordered_set<std::string> &seen, const std::vector<std::string> &keep, size_t threads) {
+    std::atomic<size_t> removed = 0;
+    PXASSERTM(fswalk(dest, FWHND_NONE, [&](const fsentry_t &e) -> PxResult::Result<void> {
+        if (e.rel.empty() || seen.count(e.rel)) return PxResult::Null;
+        if (PxFunction::contains(keep, e.rel.substr(0, e.rel.find('/')))) return PxResult::Null;
+
+        if (unlinkat(e.dirfd, e.name, S_ISDIR(e.st.st_mode) ? AT_REMOVEDIR : 0) != 0 && errno != ENOENT)
+            return PxResult::FResult("pruneTree / unlinkat "+e.rel, errno);
+        removed++;
+        return PxResult::Null;
+    }, threads, false), "pruneTree");
+    return removed.load();
+}
+
+PxResult::Result<void> TarExtractor::final() {
+    if (result.eno) return result;
+    if (state != End && !(state == Header && hdrlen == 0))
+        return PxResult::FResult("TarExtractor::final (truncated archive)", EIO);
+
+    if (pool) {
+        flushBatch();
+        pool->wait();
+        if (failed) return workerError;
+
+        for (auto &i : links) PXASSERT(makeLink(i));
+        links.clear();
+    }
+
+    // before directory mtimes are set, since removing entries would change them again
+    if (incremental) {
+        auto res = pruneTree(dest, seen, keep, threads);
+        PXASSERTM(res, "TarExtractor::final");
+        pruned = res.assert();
+    }
+
+    // deepest directories first, so setting a parent's mtime isn't undone by its children
+    for (auto i = dirs.rbegin(); i != dirs.rend(); i++) {
+        if (fchmodat(rootfd, i->path.c_str(), i->mode & 07777, 0) != 0)
+            return PxResult::FResult("TarExtractor::final / fchmodat "+i->path, errno);
+        struct timespec times[2] = {{0, UTIME_OMIT}, i->mtime};
+        if (utimensat(rootfd, i->path.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+            return PxResult::FResult("TarExtractor::final / utimensat "+i->path, errno);
+    }
+    dirs.clear();
+
+    updateTask(true);
+    return PxResult::Null;
+}
+
+void TarExtractor::initTask(std::string name) {
+    logid = PxLog::log.newTask(tsk = new LogExtractTask(name));
+}
+
+void TarExtractor::updateTask(bool force) {
+    if (tsk == NULL) return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now - lastDraw < std::chrono::milliseconds(100)) return;
+    lastDraw = now;
+
+    std::vector<std::string> strstats = { std::to_string(entries)+" files" };
+
+    auto elapsed = std::chrono::duration<double>(now - started).count();
+    if (elapsed > 0) {
+        float spd = std::floor(consumed / elapsed / 1024. / 1024. * 10.)/10.;
+        strstats.push_back(std::to_string(spd)+" MiB/s");
+    }
+    if (total > 0) {
+        strstats.push_back(std::to_string((int)std::round((float)consumed * 100. / (float)total))+"%");
+    }
+    tsk->stats = PxFunction::join(strstats, ", ");
+
+    PxLog::log.top();
+    PxLog::log.printTasks();
+}
+
+PxResult::Result<void> extractImage(std::string image, std::string dest, bool sync, std::vector<std::string> keep) {
+    int fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return PxResult::FResult("extractImage / open", errno);
+    DEFER(close_fd, close(fd));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) return PxResult::FResult("extractImage / fstat", errno);
+
+    char magic[6] = {0};
+    if (st.st_size < 512 || pread(fd, magic, 5, 257) != 5 || strcmp(magic, "ustar") != 0) {
+        PxLog::log.info("Image is not a plain tar archive, using tar to extract it.");
+        if (sync) {
+            // tar can't tell us what it wrote, so the old tree goes first
+            PXASSERTM(pruneTree(dest, {}, keep, std::min(8u, std::max(1u, std::thread::hardware_concurrency()))), "extractImage");
+        }
+        if (system(("tar xpf "+image+" --xattrs-include=\\* -C "+dest).c_str()) != 0) {
+            return PxResult::FResult("extractImage / system", EINVAL);
+        }
+        return PxResult::Null;
+    }
+
+    char *map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return PxResult::FResult("extractImage / mmap", errno);
+    DEFER(unmap, munmap(map, st.st_size));
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    TarExtractor tx(dest);
+    tx.threads = std::min(16u, std::max(1u, std::thread::hardware_concurrency()));
+    tx.contiguous = true;
+    tx.incremental = sync;
+    tx.keep = keep;
+    PXASSERTM(tx.open(), "extractImage");
+    tx.total = st.st_size;
+    tx.initTask("image");
+
+    // fed in slices only so progress gets redrawn along the way
+    const off_t slice = 64 * 1024 * 1024;
+    for (off_t off = 0; off < st.st_size; off += slice) {
+        auto res = tx.update(map + off, std::min(slice, st.st_size - off));
+        if (res.eno) {
+            PxLog::log.completeTask(tx.logid, PxLog::Fail);
+            return res.merge("extractImage");
+        }
+    }
+    auto res = tx.final();
+    PxLog::log.completeTask(tx.logid, res.eno ? PxLog::Fail : PxLog::Success);
+    PXASSERTM(res, "extractImage");
+
+    if (sync) {
+        PxLog::log.info("Synced "+std::to_string(tx.entries)+" entries: "+std::to_string(tx.reused.load())+" unchanged, "+
+            std::to_string(tx.pruned)+" removed");
+    }
+
+    return PxResult::Null;
+}
@@ -0,0 +1,271 @@
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <verify.hpp>
+#include <trace.hpp>
+#include <PxDefer.hpp>
+#include <PxFunction.hpp>
+#include <PxState.hpp>
+#include <atomic>
+#include <cstdio>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <sys/stat.h>
+
+extern char **environ;
+
+GpgStreamVerifier::~GpgStreamVerifier() {
+    if (pipefd >= 0) close(pipefd);
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+bool GpgStreamVerifier::ready() {
+    return signature->done && !signature->result.eno;
+}
+
+PxResult::Result<void> GpgStreamVerifier::spawn() {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return PxResult::FResult("GpgStreamVerifier::spawn / pipe2", errno);
+
+    // a bigger pipe means fewer round trips through gpg per chunk curl hands us
+    fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], 0);
+
+    const char *argv[] = { "gpg", "--homedir", "/etc/pxos-gpg", "--verify", sigpath.c_str(), "-", NULL };
+    int err = posix_spawnp(&pid, "gpg", &actions, NULL, (char* const*)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[0]);
+
+    if (err != 0) {
+        close(fds[1]);
+        pid = -1;
+        return PxResult::FResult("GpgStreamVerifier::spawn / posix_spawnp", err);
+    }
+
+    // gpg quitting early must show up as an error from write, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    pipefd = fds[1];
+    return PxResult::Null;
+}
+
+PxResult::Result<void> GpgStreamVerifier::update(const char *data, size_t count) {
+    if (pid < 0) PXASSERT(spawn());
+
+    size_t done = 0;
+    while (done < count) {
+        ssize_t res = write(pipefd, data + done, count - done);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return PxResult::FResult("GpgStreamVerifier::update / write", errno);
+        }
+        done += res;
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<void> GpgStreamVerifier::final() {
+    // only the wait for gpg's verdict; feeding it happens during the download
+    TRACE(span, "gpg verify");
+    // an empty file still has to be checked
+    if (pid < 0) PXASSERT(spawn());
+
+    close(pipefd);
+    pipefd = -1;
+
+    int status;
+    pid_t res;
+    while ((res = waitpid(pid, &status, 0)) < 0 && errno == EINTR);
+    pid = -1;
+    if (res < 0) return PxResult::FResult("GpgStreamVerifier::final / waitpid", errno);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return PxResult::FResult("GpgStreamVerifier::final (bad signature)", EBADMSG);
+    }
+    return PxResult::Null;
+}
+
+namespace TreeHash {
+    chunkhash_t root(off_t size, const std::vector<chunkhash_t> &leaves) {
+        // the size goes first, so files that only differ in trailing leaves can't collide
+        std::vector<unsigned char> buf(8);
+        for (int i = 0; i < 8; i++) buf[i] = (uint64_t)size >> (i * 8);
+        for (auto &i : leaves) buf.insert(buf.end(), i.begin(), i.end());
+        return Chunker::hash(buf.data(), buf.size());
+    }
+
+    PxResult::Result<std::vector<chunkhash_t>> files(std::vector<std::string> paths, size_t leaf, WorkPool &pool) {
+        std::vector<int> fds;
+        DEFER(close_fds, for (auto fd : fds) close(fd));
+        std::vector<off_t> sizes;
+        std::vector<std::vector<chunkhash_t>> leaves(paths.size());
+
+        for (size_t i = 0; i < paths.size(); i++) {
+            int fd = open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return PxResult::FResult("TreeHash::files / open "+paths[i], errno);
+            fds.push_back(fd);
+            struct stat st;
+            if (fstat(fd, &st) != 0) return PxResult::FResult("TreeHash::files / fstat", errno);
+            sizes.push_back(st.st_size);
+            leaves[i].resize((st.st_size + leaf - 1) / leaf);
+        }
+
+        // every leaf of every file is its own task, so small files don't leave cores idle
+        std::atomic<int> err = 0;
+        for (size_t i = 0; i < paths.size(); i++) {
+            for (size_t n = 0; n < leaves[i].size(); n++) {
+                pool.submit([&, i, n]() {
+                    std::vector<unsigned char> buf(leaf);
+                    off_t off = (off_t)n * leaf;
+                    size_t want = std::min((off_t)leaf, sizes[i] - off);
+                    size_t done = 0;
+                    while (done < want) {
+                        ssize_t res = pread(fds[i], buf.data() + done, want - done, off + done);
+                        if (res < 0 && errno == EINTR) continue;
+                        if (res <= 0) {
+                            err = res < 0 ? errno : EIO;
+                            return;
+                        }
+                        done += res;
+                    }
+                    leaves[i][n] = Chunker::hash(buf.data(), want);
+                });
+            }
+        }
+        pool.wait();
+        if (err) return PxResult::FResult("TreeHash::files / pread", err);
+
+        std::vector<chunkhash_t> out;
+        for (size_t i = 0; i < paths.size(); i++) out.push_back(root(sizes[i], leaves[i]));
+        return out;
+    }
+}
+
+PxResult::Result<void> verifySignature(const std::string &data, const std::string &sig, std::string keypath) {
+    FILE *keyfile = fopen(keypath.c_str(), "r");
+    if (keyfile == NULL) return PxResult::FResult("verifySignature / fopen "+keypath, errno);
+    EVP_PKEY *key = PEM_read_PUBKEY(keyfile, NULL, NULL, NULL);
+    fclose(keyfile);
+    if (key == NULL) return PxResult::FResult("verifySignature (unreadable key "+keypath+")", EINVAL);
+    DEFER(free_key, EVP_PKEY_free(key));
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL) return PxResult::FResult("verifySignature / EVP_MD_CTX_new", ENOMEM);
+    DEFER(free_ctx, EVP_MD_CTX_free(ctx));
+
+    // one-shot, since Ed25519 can't be fed in pieces
+    if (EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, key) != 1 ||
+        EVP_DigestVerify(ctx, (const unsigned char*)sig.data(), sig.size(), (const unsigned char*)data.data(), data.size()) != 1) {
+        return PxResult::FResult("verifySignature (bad signature)", EBADMSG);
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<void> Manifest::loadSigned(const std::string &text, const std::string &sig, std::string keypath) {
+    // nothing in the manifest is looked at before its signature checks out
+    PXASSERTM(verifySignature(text, sig, keypath), "Manifest::loadSigned");
+
+    files.clear();
+    try {
+        for (auto &line : PxFunction::split(text, "\n")) {
+            auto eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            auto key = line.substr(0, eq);
+            auto value = line.substr(eq+1);
+
+            if (key == "LEAF") {
+                leaf = std::stoull(value);
+            } else if (key == "FILE") {
+                // NAME:SIZE:ROOT, taken from the right in case a name has a colon
+                auto last = value.rfind(':');
+                auto mid = last == std::string::npos || last == 0 ? std::string::npos : value.rfind(':', last - 1);
+                if (mid == std::string::npos) continue;
+                File file;
+                file.size = std::stoll(value.substr(mid + 1, last - mid - 1));
+                if (!Chunker::fromHex(value.substr(last + 1), file.root)) continue;
+                files[value.substr(0, mid)] = file;
+            }
+        }
+    } catch (std::exception &e) {
+        return PxResult::FResult("Manifest::loadSigned (corrupt manifest)", EINVAL);
+    }
+    if (leaf == 0) return PxResult::FResult("Manifest::loadSigned (corrupt manifest)", EINVAL);
+    return PxResult::Null;
+}
+
+PxResult::Result<void> Manifest::save(std::string path) {
+    std::string out = "LEAF="+std::to_string(leaf)+"\n";
+    for (auto &i : files) {
+        out += "FILE="+i.first+":"+std::to_string(i.second.size)+":"+Chunker::hex(i.second.root)+"\n";
+    }
+    PXASSERTM(PxState::fput(path, out), "Manifest::save");
+    return PxResult::Null;
+}
+
+PxResult::Result<void> Manifest::check(std::string dir, std::vector<std::string> names, size_t threads) {
+    std::vector<std::string> paths;
+    for (auto &i : names) {
+        if (!files.count(i)) return PxResult::FResult("Manifest::check ("+i+" isn't in the manifest)", EBADMSG);
+        paths.push_back(dir+"/"+i);
+    }
+
+    WorkPool pool(threads);
+    auto res = TreeHash::files(paths, leaf, pool);
+    PXASSERTM(res, "Manifest::check");
+    auto roots = res.assert();
+    for (size_t i = 0; i < names.size(); i++) {
+        if (roots[i] != files[names[i]].root)
+            return PxResult::FResult("Manifest::check ("+names[i]+" doesn't match)", EBADMSG);
+    }
+    return PxResult::Null;
+}
+
+TreeHashVerifier::TreeHashVerifier(Manifest::File expected, size_t leaf, size_t threads)
+    : expected(expected), leaf(leaf), pool(threads) {
+    leaves.resize((expected.size + leaf - 1) / leaf);
+    current.reserve(leaf);
+}
+
+void TreeHashVerifier::submit() {
+    size_t index = (seen - 1) / leaf;
+    // a few leaves per thread in flight is enough to keep them busy without holding much
+    pool.waitBelow(pool.size() * 2);
+    pool.submit([this, index, data = std::move(current)]() {
+        leaves[index] = Chunker::hash(data.data(), data.size());
+    });
+    current = std::vector<unsigned char>();
+    current.reserve(leaf);
+}
+
+PxResult::Result<void> TreeHashVerifier::update(const char *data, size_t count) {
+    if (seen + (off_t)count > expected.size)
+        return PxResult::FResult("TreeHashVerifier::update (file is larger than its manifest entry)", EBADMSG);
+
+    while (count > 0) {
+        size_t take = std::min(count, leaf - current.size());
+        current.insert(current.end(), data, data + take);
+        data += take;
+        count -= take;
+        seen += take;
+        if (current.size() == leaf) submit();
+    }
+    return PxResult::Null;
+}
+
+PxResult::Result<void> TreeHashVerifier::final() {
+    TRACE(span, "tree hash verify");
+    if (!current.empty()) submit();
+    pool.wait();
+
+    if (seen != expected.size || TreeHash::root(seen, leaves) != expected.root)
+        return PxResult::FResult("TreeHashVerifier::final (file doesn't match its manifest entry)", EBADMSG);
+    return PxResult::Null;
+}